@@ -126,17 +126,56 @@ paddr_t ram_getfirstfree(void);
 /*
  * TLB shootdown bits.
  *
- * We'll take up to 16 invalidations before just flushing the whole TLB.
+ * A shootdown asks a cpu to drop its TLB entries for TS_NPAGES pages
+ * of an address space from TS_VADDR (all of them if TS_NPAGES is 0),
+ * or of kernel memory in kseg2 if TS_AS is NULL, and then count down
+ * *TS_PENDING, which the sender waits on. A sender can be preempted
+ * while it waits, so a cpu may have a shootdown outstanding from any
+ * number of threads; when a target's queue is full, ipi_tlbshootdown
+ * sleeps until the target has emptied it.
  */
 
+struct addrspace;
+
 struct tlbshootdown {
-	/*
-	 * Change this to what you need for your VM design.
-	 */
-	int ts_placeholder;
+	struct addrspace *ts_as;
+	vaddr_t ts_vaddr;
+	unsigned ts_npages;
+	volatile unsigned *ts_pending;
 };
 
-#define TLBSHOOTDOWN_MAX 16
+#define TLBSHOOTDOWN_MAX 32
+
+/*
+ * Atomically replace the page table entry *PTE with NEWPTE if it
+ * still holds OLDPTE. Returns true if it did; false if it didn't, or
+ * if the store-conditional failed anyway, which callers treat the
+ * same way. Uses LL/SC as in spinlock.h: the comparison happens in
+ * registers, so there are no other memory accesses between the two.
+ */
+static inline bool
+pte_cas(volatile paddr_t *pte, paddr_t oldpte, paddr_t newpte)
+{
+	paddr_t x;
+	uint32_t ok;
+
+	__asm volatile(
+		".set push;"		/* save assembler mode */
+		".set mips32;"		/* allow MIPS32 instructions */
+		".set volatile;"	/* avoid unwanted optimization */
+		".set noreorder;"	/* we fill the delay slot */
+		"ll %0, 0(%2);"		/*   x = *pte */
+		"bne %0, %3, 1f;"	/*   if (x != oldpte) fail */
+		"move %1, $0;"		/*   ok = 0 (in delay slot) */
+		"move %1, %4;"		/*   ok = newpte */
+		"sc %1, 0(%2);"		/*   *pte = ok; ok = success? */
+		"1:"
+		".set pop"		/* restore assembler mode */
+		: "=&r" (x), "=&r" (ok)
+		: "r" (pte), "r" (oldpte), "r" (newpte)
+		: "memory");
+	return ok != 0;
+}
 
 
 #endif /* _MIPS_VM_H_ */
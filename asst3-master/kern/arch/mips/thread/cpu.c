@@ -67,6 +67,13 @@
 vaddr_t cpustacks[MAXCPUS];
 vaddr_t cputhreads[MAXCPUS];
 
+/*
+ * Top level page table of the address space each CPU is running, or
+ * NULL, for the UTLB refill handler in exception-mips1.S. Set by
+ * as_activate() and as_deactivate().
+ */
+vaddr_t cpupagetables[MAXCPUS];
+
 /*
  * Do machine-dependent initialization of the cpu structure or things
  * associated with a new cpu. Note that we're not running on the new
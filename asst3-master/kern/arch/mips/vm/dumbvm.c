@@ -149,6 +149,21 @@ free_kpages(vaddr_t addr)
 
 #endif
 
+/*
+ * dumbvm doesn't map kseg2, so kvmalloc is just kmalloc.
+ */
+void *
+kvmalloc(size_t size)
+{
+	return kmalloc(size);
+}
+
+void
+kvfree(void *ptr)
+{
+	kfree(ptr);
+}
+
 void
 vm_tlbshootdown(const struct tlbshootdown *ts)
 {
@@ -32,6 +32,14 @@
 #include <vm.h>
 #include <mainbus.h>
 #include <spinlock.h>
+#include <spl.h>
+#include <cpu.h>
+#include <current.h>
+#include <thread.h>
+#include <wchan.h>
+#include <platform/maxcpus.h>
+#include <pagetable.h>
+#include "opt-dumbvm.h"
 
 vaddr_t firstfree;   /* first free virtual address; set by start.S */
 
@@ -42,7 +50,14 @@ static paddr_t lastpaddr;   /* one past end of last free physical page */
 
 typedef struct ft_entry {
         unsigned allocated:1; /* the corresponding frame is allocated */
-        unsigned not_last:1; /* the frame is part of a multiframe allocation */
+        unsigned block_head:1; /* the frame heads a free buddy block */
+        unsigned order:5; /* order of the free block headed here */
+        unsigned refcount:16; /* number of users sharing the frame */
+        uint32_t npages; /* size of the allocation starting here, or 0 */
+        uint32_t prev_free; /* free list links (frame numbers), only */
+        uint32_t next_free; /* meaningful for free block heads */
+        struct addrspace *owner; /* user mapping, if pageable */
+        vaddr_t owner_va; /* where owner maps the frame */
 } ft_entry_t;
 
 
@@ -50,6 +65,34 @@ static ft_entry_t * frame_table = NULL; /* base of frame table */
 static uint32_t first_frame;
 static uint32_t last_frame;
 
+/*
+ * Free memory is managed by a binary buddy allocator over the frames
+ * [first_frame, last_frame). A free block of order k is 2^k frames
+ * long, starts at a multiple of 2^k frames from first_frame, and is
+ * linked through its head frame onto free_heads[k]. Freed blocks are
+ * merged with their buddy whenever both halves are free.
+ *
+ * Frame 0 holds the exception vectors and is never free, so it
+ * doubles as the end-of-list marker.
+ *
+ * NORDERS covers the largest RAM we support (512M = 2^17 frames).
+ */
+#define NO_FRAME 0
+#define NORDERS 18
+static uint32_t free_heads[NORDERS];
+static uint32_t nfree_blocks[NORDERS];
+static uint32_t nfree_frames;
+
+/*
+ * Page replacement is second chance (clock). A frame is only a
+ * candidate while it is mapped by exactly one address space, which
+ * the VM system records with kpage_setowner(); shared frames, kernel
+ * frames and page tables have no owner and are never chosen. Whether
+ * the page was used recently is kept in the owner's page table entry
+ * (see vm_page_referenced()), where the TLB refill handler can set it.
+ */
+static uint32_t clock_hand;
+
 #define PAGE_BITS 12
 #define TRUE 1
 #define FALSE 0
@@ -61,6 +104,217 @@ static uint32_t last_frame;
 
 static struct spinlock frame_table_spinlock = SPINLOCK_INITIALIZER;
 
+/*
+ * Each cpu keeps a small cache (magazine) of free frames in front of
+ * the frame table, refilled and drained FRAMECACHE_BATCH frames at a
+ * time, so most single-frame allocations and frees never touch
+ * frame_table_spinlock. A cache is only used by its own cpu with
+ * interrupts off. Cached frames are marked allocated with npages 0,
+ * so nobody else can free or merge them.
+ */
+#define FRAMECACHE_SIZE  16
+#define FRAMECACHE_BATCH 8
+
+struct framecache {
+        uint32_t fc_frames[FRAMECACHE_SIZE];
+        unsigned fc_count;
+
+        /* statistics */
+        unsigned fc_allocs; /* single frames allocated on this cpu */
+        unsigned fc_frees; /* single frames freed on this cpu */
+        unsigned fc_locks; /* frame table lock acquisitions for those */
+};
+
+static struct framecache framecaches[MAXCPUS];
+
+/*
+ * Pool of frames zeroed ahead of time by a kernel thread, so that
+ * faults on new anonymous memory need not clear a page themselves.
+ * The thread tops the pool up to ZEROPOOL_SIZE after it drops below
+ * ZEROPOOL_LOW, as long as more than ZEROPOOL_MINFREE frames are
+ * free. Pool frames are marked like cached frames and still count as
+ * free: an allocation that finds nothing else takes one.
+ * Protected by frame_table_spinlock.
+ */
+#define ZEROPOOL_SIZE    32
+#define ZEROPOOL_LOW     16
+#define ZEROPOOL_MINFREE 64
+
+static uint32_t zero_pool[ZEROPOOL_SIZE];
+static unsigned zero_count;
+static struct wchan *zero_wchan;
+
+/* statistics */
+static unsigned zero_hits;   /* zeroed allocations served by the pool */
+static unsigned zero_misses; /* zeroed allocations cleared on demand */
+
+/*
+ * Frames handed out and given back, for kpages_counts(). Frames in the
+ * zeroed pool count as free. Statistics only, so updates are allowed
+ * to race.
+ */
+static unsigned frames_allocated;
+static unsigned frames_freed;
+
+/*
+ * Multiframe allocations asked for, and how many of those found no
+ * free block big enough: the cost of fragmentation.
+ */
+static unsigned multi_allocs;
+static unsigned multi_failures;
+
+/* Push the free block at frame i onto the list for its order */
+static void buddy_insert(uint32_t i, unsigned order)
+{
+        frame_table[i].block_head = TRUE;
+        frame_table[i].order = order;
+        frame_table[i].prev_free = NO_FRAME;
+        frame_table[i].next_free = free_heads[order];
+        if (free_heads[order] != NO_FRAME) {
+                frame_table[free_heads[order]].prev_free = i;
+        }
+        free_heads[order] = i;
+        nfree_blocks[order]++;
+        nfree_frames += 1U << order;
+}
+
+/* Unlink the free block at frame i from the list for its order */
+static void buddy_remove(uint32_t i)
+{
+        unsigned order = frame_table[i].order;
+        uint32_t prev = frame_table[i].prev_free;
+        uint32_t next = frame_table[i].next_free;
+
+        KASSERT(frame_table[i].block_head == TRUE);
+
+        if (prev != NO_FRAME) {
+                frame_table[prev].next_free = next;
+        }
+        else {
+                KASSERT(free_heads[order] == i);
+                free_heads[order] = next;
+        }
+        if (next != NO_FRAME) {
+                frame_table[next].prev_free = prev;
+        }
+        frame_table[i].block_head = FALSE;
+        KASSERT(nfree_blocks[order] > 0);
+        nfree_blocks[order]--;
+        nfree_frames -= 1U << order;
+}
+
+/*
+ * Free the block of 2^order frames at frame i, merging it with its
+ * buddy for as long as the buddy is also free.
+ */
+static void buddy_free_block(uint32_t i, unsigned order)
+{
+        uint32_t buddy;
+
+        while (order < NORDERS - 1) {
+                buddy = first_frame + ((i - first_frame) ^ (1U << order));
+                if (buddy >= last_frame ||
+                    frame_table[buddy].block_head == FALSE ||
+                    frame_table[buddy].order != order) {
+                        break;
+                }
+                buddy_remove(buddy);
+                if (buddy < i) {
+                        i = buddy;
+                }
+                order++;
+        }
+        buddy_insert(i, order);
+}
+
+/*
+ * Free an arbitrary range of frames by splitting it into the largest
+ * aligned blocks that fit.
+ */
+static void buddy_free_range(uint32_t i, uint32_t n)
+{
+        unsigned order;
+
+        while (n > 0) {
+                order = 0;
+                while (order < NORDERS - 1 &&
+                       ((i - first_frame) & (1U << order)) == 0 &&
+                       (2U << order) <= n) {
+                        order++;
+                }
+                buddy_free_block(i, order);
+                i += 1U << order;
+                n -= 1U << order;
+        }
+}
+
+/*
+ * Take a block of 2^order frames off the free lists, splitting a
+ * larger block if there is none of the right size. Returns the head
+ * frame, or NO_FRAME if nothing large enough is free.
+ */
+static uint32_t buddy_alloc_block(unsigned order)
+{
+        unsigned k;
+        uint32_t i;
+
+        for (k = order; k < NORDERS; k++) {
+                if (free_heads[k] != NO_FRAME) {
+                        break;
+                }
+        }
+        if (k == NORDERS) {
+                return NO_FRAME;
+        }
+
+        i = free_heads[k];
+        buddy_remove(i);
+
+        /* Give back the upper halves until the block is small enough */
+        while (k > order) {
+                k--;
+                buddy_insert(i + (1U << k), k);
+        }
+
+        return i;
+}
+
+/* Move up to FRAMECACHE_BATCH frames from the free lists into FC */
+static void framecache_refill(struct framecache *fc)
+{
+        uint32_t i;
+
+        spinlock_acquire(&frame_table_spinlock);
+        fc->fc_locks++;
+        while (fc->fc_count < FRAMECACHE_BATCH) {
+                i = buddy_alloc_block(0);
+                if (i == NO_FRAME) {
+                        break;
+                }
+                frame_table[i].allocated = TRUE;
+                frame_table[i].refcount = 0;
+                frame_table[i].npages = 0;
+                fc->fc_frames[fc->fc_count++] = i;
+        }
+        spinlock_release(&frame_table_spinlock);
+}
+
+/* Return FRAMECACHE_BATCH frames from FC to the free lists */
+static void framecache_drain(struct framecache *fc)
+{
+        uint32_t i;
+        unsigned n;
+
+        spinlock_acquire(&frame_table_spinlock);
+        fc->fc_locks++;
+        for (n = 0; n < FRAMECACHE_BATCH && fc->fc_count > 0; n++) {
+                i = fc->fc_frames[--fc->fc_count];
+                frame_table[i].allocated = FALSE;
+                buddy_free_block(i, 0);
+        }
+        spinlock_release(&frame_table_spinlock);
+}
+
 /*
  * Called very early in system boot to figure out how much physical
  * RAM is available.
@@ -129,7 +383,10 @@ ram_bootstrap(void)
         for (i = 0; i < (firstpaddr >> PAGE_BITS); i++) {
                 /* Mark as allocated as individual pages */
                 frame_table[i].allocated = TRUE;
-                frame_table[i].not_last = FALSE;
+                frame_table[i].block_head = FALSE;
+                frame_table[i].refcount = 1;
+                frame_table[i].npages = 1;
+                frame_table[i].owner = NULL;
         }                                            
         
         /* 
@@ -137,10 +394,17 @@ ram_bootstrap(void)
          */
         
         first_frame = firstpaddr >> PAGE_BITS;
+        KASSERT(first_frame != NO_FRAME);
         
-        for (i = first_frame; i < (lastpaddr >> PAGE_BITS); i++) {
+        for (i = first_frame; i < last_frame; i++) {
                 frame_table[i].allocated = FALSE;
+                frame_table[i].block_head = FALSE;
+                frame_table[i].refcount = 0;
+                frame_table[i].npages = 0;
+                frame_table[i].owner = NULL;
         }
+        buddy_free_range(first_frame, last_frame - first_frame);
+        clock_hand = first_frame;
 
         
 }
@@ -189,90 +453,117 @@ ram_getfirstfree(void)
 }
 
 /*
- * This is a relatively inefficient first-fit allocator. Single pages
- * always fit. Multiframe allocations can suffer from external
- * fragmentation. It is intended to be easy to understand and robust,
- * not efficient.
+ * Single frames come straight off the order 0 free list, or from
+ * splitting a larger block, in constant time. Multiframe allocations
+ * take the smallest block that fits and give the unused tail back.
  */
 
 
+/* Mark frames [i, i+npages) as one allocation headed at i */
+static void mark_allocated(uint32_t i, uint32_t npages)
+{
+        uint32_t j;
+
+        for (j = i; j < i + npages; j++) {
+                KASSERT(frame_table[j].allocated == FALSE);
+                frame_table[j].allocated = TRUE;
+                frame_table[j].block_head = FALSE;
+                frame_table[j].refcount = 0;
+                frame_table[j].npages = 0;
+                frame_table[j].owner = NULL;
+        }
+        frame_table[i].refcount = 1; /* the block is counted at its head */
+        frame_table[i].npages = npages;
+}
+
 static paddr_t alloc_one_frame(unsigned int npages)
 {
-        unsigned int i;
+        struct framecache *fc;
+        uint32_t i;
+        int spl;
 
-        /* 
-         * Just scan from the start of the frame_table array for an
-         * unallocated block
-         */
-        
         KASSERT(npages == 1);
 
-        spinlock_acquire(&frame_table_spinlock);
-        for (i =  first_frame; i < last_frame; i++) {
-                if (frame_table[i].allocated == FALSE) {
-                        frame_table[i].allocated = TRUE;
-                        frame_table[i].not_last = FALSE;
-
-                        spinlock_release(&frame_table_spinlock);
+        if (!CURCPU_EXISTS()) {
+                /* Too early in boot for the per-cpu caches */
+                spinlock_acquire(&frame_table_spinlock);
+                i = buddy_alloc_block(0);
+                if (i != NO_FRAME) {
+                        mark_allocated(i, 1);
+                }
+                spinlock_release(&frame_table_spinlock);
+                return (paddr_t) (i << PAGE_BITS);
+        }
 
-                        return (paddr_t) (i << PAGE_BITS);
+        spl = splhigh();
+        fc = &framecaches[curcpu->c_number];
+        fc->fc_allocs++;
+        if (fc->fc_count == 0) {
+                framecache_refill(fc);
+        }
+        if (fc->fc_count == 0) {
+                /* Last resort: a frame waiting in the zeroed pool */
+                spinlock_acquire(&frame_table_spinlock);
+                if (zero_count > 0) {
+                        fc->fc_frames[fc->fc_count++] =
+                                zero_pool[--zero_count];
                 }
+                spinlock_release(&frame_table_spinlock);
         }
-        
-        /* Did not find an unallocated frame :-( */
+        if (fc->fc_count == 0) {
+                /* No unallocated frame :-( */
+                splx(spl);
+                return (paddr_t) 0;
+        }
+        i = fc->fc_frames[--fc->fc_count];
+        splx(spl);
 
-        spinlock_release(&frame_table_spinlock);
-        return (paddr_t) 0;
+        /* The frame is ours alone now; no lock needed */
+        KASSERT(frame_table[i].allocated == TRUE);
+        KASSERT(frame_table[i].npages == 0);
+        frame_table[i].refcount = 1;
+        frame_table[i].npages = 1;
+
+        return (paddr_t) (i << PAGE_BITS);
 }
 
 static paddr_t alloc_multiple_frames(unsigned int npages)
 {
-        unsigned int i,j;
-
-
-        /* scan from 'i' for the number of needed free frames. If an
-         * allocated frame is encountered, restart the scan from after
-         * that point.
-         */
-        
-
-        spinlock_acquire(&frame_table_spinlock);
-
-        i = first_frame; j = 0;
+        unsigned order;
+        uint32_t i;
 
-        while (i < (last_frame - npages) && j < npages) {
-                if (frame_table[i+j].allocated == TRUE) {
-                        i = i + j + 1; /* continue scan after allocated frame */
-                        j = 0;         /* restart the count */
-                }
-                else {
-                        j = j + 1; /* increment count of free frames */
-                }
+        for (order = 0; order < NORDERS && (1U << order) < npages; order++) {
+                /* find the smallest block that fits */
+        }
+        multi_allocs++;
+        if (order == NORDERS) {
+                multi_failures++;
+                return (paddr_t) 0;
         }
 
-        if  (j == npages) { /* we exited as we found the number of frames required. */
-                for (j = i; j < i + npages - 1; j++) {
-                        frame_table[j].allocated = TRUE; /* mark frame allocated */
-                        frame_table[j].not_last = TRUE;  /* as a contiguous block */
-                }
-                frame_table[j].allocated = TRUE;
-                frame_table[j].not_last = FALSE;
+        spinlock_acquire(&frame_table_spinlock);
 
+        i = buddy_alloc_block(order);
+        if (i == NO_FRAME) {
+                /* No free block large enough :-( */
+                multi_failures++;
                 spinlock_release(&frame_table_spinlock);
-                
-                return (paddr_t) (i << PAGE_BITS);
+                return (paddr_t) 0;
         }
-        
-        /* Did not find an unallocated contiguous range of frames :-( */
+
+        /* Keep exactly npages and free the rest of the block */
+        buddy_free_range(i + npages, (1U << order) - npages);
+        mark_allocated(i, npages);
 
         spinlock_release(&frame_table_spinlock);
-        return (paddr_t) 0;
+                
+        return (paddr_t) (i << PAGE_BITS);
 }
 
 static void free_frames(vaddr_t vaddr)
 {
         paddr_t paddr;
-        uint32_t i;
+        uint32_t i, j, npages;
 
         KASSERT(vaddr != (vaddr_t) NULL);
 
@@ -280,18 +571,68 @@ static void free_frames(vaddr_t vaddr)
 
         i = paddr >> PAGE_BITS;
 
-        spinlock_acquire(&frame_table_spinlock);
-
+        /*
+         * These fields don't change while the caller holds its
+         * reference, so they can be checked before taking the lock,
+         * for both paths below.
+         */
         if (frame_table[i].allocated == FALSE) { /* check for double free error */
                 panic("Double free error!!");
         }
-        
-        while (frame_table[i].allocated == TRUE) { /* otherwise mark block free */
-                frame_table[i].allocated = FALSE;
-                if (frame_table[i].not_last == TRUE) {
-                        i++;
+        if (frame_table[i].npages == 0) {
+                panic("free_kpages: 0x%x is not the start of an allocation",
+                      vaddr);
+        }
+        KASSERT(frame_table[i].refcount > 0);
+
+        /*
+         * The last user of a single frame can hand it to this cpu's
+         * cache without the lock: as nobody else holds a reference,
+         * nobody else can be touching its frame table entry.
+         */
+        if (CURCPU_EXISTS() &&
+            frame_table[i].npages == 1 &&
+            frame_table[i].refcount == 1) {
+                struct framecache *fc;
+                int spl;
+
+                frame_table[i].refcount = 0;
+                frame_table[i].npages = 0;
+                frame_table[i].owner = NULL;
+
+                spl = splhigh();
+                fc = &framecaches[curcpu->c_number];
+                fc->fc_frees++;
+                frames_freed++;
+                if (fc->fc_count == FRAMECACHE_SIZE) {
+                        framecache_drain(fc);
                 }
+                fc->fc_frames[fc->fc_count++] = i;
+                splx(spl);
+                return;
+        }
+
+        spinlock_acquire(&frame_table_spinlock);
+
+        /*
+         * A shared frame is only released once the last user lets
+         * go of it (see share_kpage()).
+         */
+        KASSERT(frame_table[i].refcount > 0);
+        if (--frame_table[i].refcount > 0) {
+                spinlock_release(&frame_table_spinlock);
+                return;
         }
+
+        npages = frame_table[i].npages;
+        frames_freed += npages;
+        for (j = i; j < i + npages; j++) { /* otherwise mark block free */
+                frame_table[j].allocated = FALSE;
+                frame_table[j].npages = 0;
+                frame_table[j].owner = NULL;
+        }
+        buddy_free_range(i, npages);
+
         spinlock_release(&frame_table_spinlock);
 }
         
@@ -310,6 +651,7 @@ alloc_kpages(unsigned npages)
 	if (paddr == 0) {
 		return 0;
 	}
+        frames_allocated += npages;
 	return PADDR_TO_KVADDR(paddr);
 }
 
@@ -319,3 +661,335 @@ free_kpages(vaddr_t addr)
         free_frames(addr);
 }
 
+/*
+ * Allocate a single frame filled with zeroes, from the zeroed pool if
+ * it has one.
+ */
+vaddr_t
+alloc_zeroed_kpage(void)
+{
+        vaddr_t kpage;
+        uint32_t i = NO_FRAME;
+
+        spinlock_acquire(&frame_table_spinlock);
+        if (zero_count > 0) {
+                i = zero_pool[--zero_count];
+                zero_hits++;
+        }
+        else {
+                zero_misses++;
+        }
+        if (zero_count < ZEROPOOL_LOW && zero_wchan != NULL) {
+                wchan_wakeone(zero_wchan, &frame_table_spinlock);
+        }
+        spinlock_release(&frame_table_spinlock);
+
+        if (i != NO_FRAME) {
+                /* Ours alone now, as in alloc_one_frame() */
+                KASSERT(frame_table[i].allocated == TRUE);
+                KASSERT(frame_table[i].npages == 0);
+                frame_table[i].refcount = 1;
+                frame_table[i].npages = 1;
+                frames_allocated++;
+                return PADDR_TO_KVADDR((paddr_t) (i << PAGE_BITS));
+        }
+
+        kpage = alloc_kpages(1);
+        if (kpage != 0) {
+                bzero((void *) kpage, PAGE_SIZE);
+        }
+        return kpage;
+}
+
+/*
+ * The zeroing thread. It sleeps until the pool runs low, then clears
+ * free frames into it one at a time, yielding after each so it only
+ * soaks up time other threads don't want.
+ */
+static void zero_thread(void *unused1, unsigned long unused2)
+{
+        vaddr_t kpage;
+        uint32_t i;
+
+        (void) unused1;
+        (void) unused2;
+
+        while (1) {
+                spinlock_acquire(&frame_table_spinlock);
+                while (zero_count == ZEROPOOL_SIZE ||
+                       nfree_frames < ZEROPOOL_MINFREE) {
+                        wchan_sleep(zero_wchan, &frame_table_spinlock);
+                }
+                spinlock_release(&frame_table_spinlock);
+
+                kpage = alloc_kpages(1);
+                if (kpage != 0) {
+                        bzero((void *) kpage, PAGE_SIZE);
+                        i = KVADDR_TO_PADDR(kpage) >> PAGE_BITS;
+
+                        spinlock_acquire(&frame_table_spinlock);
+                        if (zero_count < ZEROPOOL_SIZE) {
+                                frame_table[i].refcount = 0;
+                                frame_table[i].npages = 0;
+                                zero_pool[zero_count++] = i;
+                                kpage = 0;
+                                /* Free again, as far as counts go */
+                                frames_allocated--;
+                        }
+                        spinlock_release(&frame_table_spinlock);
+
+                        if (kpage != 0) {
+                                /* Filled up while we were zeroing */
+                                free_kpages(kpage);
+                        }
+                }
+                thread_yield();
+        }
+}
+
+/*
+ * Start the zeroing thread. Called from vm_bootstrap().
+ */
+void
+zeropool_bootstrap(void)
+{
+        int result;
+
+        zero_wchan = wchan_create("zeropool");
+        if (zero_wchan == NULL) {
+                panic("zeropool_bootstrap: Out of memory\n");
+        }
+        result = thread_fork("pagezero", NULL, zero_thread, NULL, 0);
+        if (result) {
+                panic("zeropool_bootstrap: thread_fork failed: %s\n",
+                      strerror(result));
+        }
+}
+
+/*
+ * Add a user to an allocated single frame, e.g. a page that is mapped
+ * copy-on-write into more than one address space. Each extra user
+ * drops its reference with free_kpages().
+ */
+void
+share_kpage(vaddr_t addr)
+{
+        uint32_t i;
+
+        i = KVADDR_TO_PADDR(addr) >> PAGE_BITS;
+
+        spinlock_acquire(&frame_table_spinlock);
+        KASSERT(frame_table[i].allocated == TRUE);
+        KASSERT(frame_table[i].npages == 1);
+        KASSERT(frame_table[i].refcount > 0);
+        KASSERT(frame_table[i].refcount < 0xffff);
+        frame_table[i].refcount++;
+        frame_table[i].owner = NULL; /* no longer pageable */
+        spinlock_release(&frame_table_spinlock);
+}
+
+/*
+ * Return the number of users of an allocated frame.
+ *
+ * This is called on every copy-on-write fault, so it does not take
+ * the lock. A caller holding a reference can rely on a count of 1
+ * (nobody else can add one); a higher count may be stale, which at
+ * worst costs an unnecessary copy.
+ */
+unsigned
+kpage_refcount(vaddr_t addr)
+{
+        uint32_t i;
+
+        i = KVADDR_TO_PADDR(addr) >> PAGE_BITS;
+
+        KASSERT(frame_table[i].allocated == TRUE);
+        return frame_table[i].refcount;
+}
+
+/*
+ * Record that the single frame at KPAGE is mapped at VA in AS and
+ * nowhere else, making it a page replacement candidate. Shared frames
+ * are left alone.
+ *
+ * This is called whenever vm_fault() loads the TLB, so the common
+ * cases (already owned by AS, or shared) don't take the lock.
+ */
+void
+kpage_setowner(vaddr_t kpage, struct addrspace *as, vaddr_t va)
+{
+        uint32_t i;
+
+        i = KVADDR_TO_PADDR(kpage) >> PAGE_BITS;
+
+        if (frame_table[i].owner == as && frame_table[i].owner_va == va) {
+                return;
+        }
+        if (frame_table[i].refcount != 1) {
+                /* Shared; a stale count is rechecked on the next fault */
+                return;
+        }
+
+        spinlock_acquire(&frame_table_spinlock);
+        KASSERT(frame_table[i].allocated == TRUE);
+        KASSERT(frame_table[i].npages == 1);
+        if (frame_table[i].refcount == 1) {
+                frame_table[i].owner = as;
+                frame_table[i].owner_va = va;
+        }
+        spinlock_release(&frame_table_spinlock);
+}
+
+/*
+ * Choose a frame to page out. Sweep the clock hand over the frame
+ * table, giving each recently used frame a second chance, until we
+ * find an owned frame that has not been used since the last pass.
+ *
+ * The chosen frame is disowned, so it won't be chosen again, and its
+ * old owner and mapping are handed back. Returns 0 if no frame is
+ * pageable.
+ */
+vaddr_t
+kpage_victim(struct addrspace **as, vaddr_t *va)
+{
+        uint32_t i, n;
+
+        spinlock_acquire(&frame_table_spinlock);
+        for (n = 0; n < 2 * (last_frame - first_frame); n++) {
+                i = clock_hand;
+                if (++clock_hand == last_frame) {
+                        clock_hand = first_frame;
+                }
+
+                if (frame_table[i].allocated == FALSE ||
+                    frame_table[i].owner == NULL ||
+                    frame_table[i].refcount != 1) {
+                        continue;
+                }
+                if (vm_page_referenced(frame_table[i].owner,
+                                       frame_table[i].owner_va)) {
+                        continue;
+                }
+
+                *as = frame_table[i].owner;
+                *va = frame_table[i].owner_va;
+                frame_table[i].owner = NULL;
+                spinlock_release(&frame_table_spinlock);
+                return PADDR_TO_KVADDR((paddr_t) (i << PAGE_BITS));
+        }
+        spinlock_release(&frame_table_spinlock);
+        return 0;
+}
+
+/*
+ * Report the number of frames managed by the allocator and how many
+ * of them are currently free.
+ */
+void
+kpages_stats(unsigned *nframes, unsigned *nfree)
+{
+        unsigned c;
+
+        spinlock_acquire(&frame_table_spinlock);
+        *nframes = last_frame - first_frame;
+        *nfree = nfree_frames + zero_count;
+        spinlock_release(&frame_table_spinlock);
+
+        /* Frames sitting in the per-cpu caches are free too */
+        for (c = 0; c < MAXCPUS; c++) {
+                *nfree += framecaches[c].fc_count;
+        }
+}
+
+/*
+ * Report how many frames have been allocated and freed since boot.
+ */
+void
+kpages_counts(unsigned *nalloc, unsigned *nfreed)
+{
+        *nalloc = frames_allocated;
+        *nfreed = frames_freed;
+}
+
+/*
+ * Print the free lists of the buddy allocator: how many free blocks
+ * of each order there are. Lots of low order blocks and few high
+ * order ones means physical memory is fragmented.
+ */
+void
+kpages_printstats(void)
+{
+        uint32_t counts[NORDERS];
+        uint32_t nframes, nfree;
+        unsigned order, c;
+        unsigned ops, locks, faults;
+        unsigned zcount, zhits, zmisses;
+
+        /* Take a snapshot so we don't print with the lock held */
+        spinlock_acquire(&frame_table_spinlock);
+        for (order = 0; order < NORDERS; order++) {
+                counts[order] = nfree_blocks[order];
+        }
+        nframes = last_frame - first_frame;
+        nfree = nfree_frames;
+        zcount = zero_count;
+        zhits = zero_hits;
+        zmisses = zero_misses;
+        spinlock_release(&frame_table_spinlock);
+
+        kprintf("Frame allocator: %u frames, %u free in buddy lists\n",
+                nframes, nfree);
+        kprintf("order  pages  free blocks  free pages\n");
+        for (order = 0; order < NORDERS; order++) {
+                if (counts[order] == 0) {
+                        continue;
+                }
+                kprintf("%5u  %5u  %11u  %10u\n", order, 1U << order,
+                        counts[order], counts[order] << order);
+        }
+
+        /*
+         * Without the caches every single-frame alloc or free would
+         * take the frame table lock once.
+         */
+        kprintf("cpu  cached  allocs  frees  lock acquisitions  saved\n");
+        ops = locks = 0;
+        for (c = 0; c < MAXCPUS; c++) {
+                struct framecache *fc = &framecaches[c];
+
+                if (fc->fc_allocs + fc->fc_frees == 0) {
+                        continue;
+                }
+                kprintf("%3u  %6u  %6u  %5u  %17u  %5u\n", c,
+                        fc->fc_count, fc->fc_allocs, fc->fc_frees,
+                        fc->fc_locks,
+                        fc->fc_allocs + fc->fc_frees - fc->fc_locks);
+                ops += fc->fc_allocs + fc->fc_frees;
+                locks += fc->fc_locks;
+        }
+
+        kprintf("Zeroed pool: %u/%u frames, %u hits, %u misses\n",
+                zcount, ZEROPOOL_SIZE, zhits, zmisses);
+        kprintf("Multiframe allocations: %u, %u failed\n",
+                multi_allocs, multi_failures);
+
+#if OPT_DUMBVM
+        faults = 0;
+#else
+        faults = vm_fault_count();
+#endif
+        if (faults > 0) {
+                kprintf("%u lock acquisitions saved over %u page faults "
+                        "(%u.%02u per fault)\n", ops - locks, faults,
+                        (ops - locks) / faults,
+                        (ops - locks) % faults * 100 / faults);
+        }
+
+#if !OPT_DUMBVM
+        size_t ptbytes, ptpeak;
+
+        pt_stats(&ptbytes, &ptpeak);
+        kprintf("Page tables: %u bytes, %u peak\n",
+                (unsigned) ptbytes, (unsigned) ptpeak);
+#endif
+}
@@ -851,13 +851,16 @@ emufs_namefile(struct vnode *v, struct uio *uio)
 
 /*
  * VOP_MMAP
+ *
+ * As for sfs, the VM system does the work through VOP_READ and
+ * VOP_WRITE, so any file can be mapped.
  */
 static
 int
 emufs_mmap(struct vnode *v)
 {
 	(void)v;
-	return ENOSYS;
+	return 0;
 }
 
 //////////////////////////////
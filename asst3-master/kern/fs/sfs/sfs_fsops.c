@@ -408,6 +408,12 @@ sfs_domount(void *options, struct device *dev, struct fs **ret)
 		return ENXIO;
 	}
 
+	result = sfs_vnode_cache_init();
+	if (result) {
+		vfs_biglock_release();
+		return result;
+	}
+
 	sfs = sfs_fs_create();
 	if (sfs == NULL) {
 		vfs_biglock_release();
@@ -35,10 +35,35 @@
 #include <types.h>
 #include <kern/errno.h>
 #include <lib.h>
+#include <kmem.h>
 #include <vfs.h>
 #include <sfs.h>
 #include "sfsprivate.h"
 
+/*
+ * In-memory inodes come from an object cache shared by all volumes,
+ * made at the first mount.
+ */
+static struct kmem_cache *sfs_vnode_cache;
+
+/*
+ * Make the vnode cache if there isn't one yet. Called at mount time.
+ */
+int
+sfs_vnode_cache_init(void)
+{
+	KASSERT(vfs_biglock_do_i_hold());
+
+	if (sfs_vnode_cache == NULL) {
+		sfs_vnode_cache = kmem_cache_create("sfs_vnode",
+						    sizeof(struct sfs_vnode),
+						    NULL, NULL);
+		if (sfs_vnode_cache == NULL) {
+			return ENOMEM;
+		}
+	}
+	return 0;
+}
 
 /*
  * Write an on-disk inode structure back out to disk.
@@ -136,7 +161,7 @@ sfs_reclaim(struct vnode *v)
 	vfs_biglock_release();
 
 	/* Release the storage for the vnode structure itself. */
-	kfree(sv);
+	kmem_cache_free(sfs_vnode_cache, sv);
 
 	/* Done */
 	return 0;
@@ -184,7 +209,7 @@ sfs_loadvnode(struct sfs_fs *sfs, uint32_t ino, int forcetype,
 
 	/* Didn't have it loaded; load it */
 
-	sv = kmalloc(sizeof(struct sfs_vnode));
+	sv = kmem_cache_alloc(sfs_vnode_cache);
 	if (sv==NULL) {
 		return ENOMEM;
 	}
@@ -198,7 +223,7 @@ sfs_loadvnode(struct sfs_fs *sfs, uint32_t ino, int forcetype,
 	/* Read the block the inode is in */
 	result = sfs_readblock(sfs, ino, &sv->sv_i, sizeof(sv->sv_i));
 	if (result) {
-		kfree(sv);
+		kmem_cache_free(sfs_vnode_cache, sv);
 		return result;
 	}
 
@@ -235,7 +260,7 @@ sfs_loadvnode(struct sfs_fs *sfs, uint32_t ino, int forcetype,
 	/* Call the common vnode initializer */
 	result = vnode_init(&sv->sv_absvn, ops, &sfs->sfs_absfs, sv);
 	if (result) {
-		kfree(sv);
+		kmem_cache_free(sfs_vnode_cache, sv);
 		return result;
 	}
 
@@ -246,7 +271,7 @@ sfs_loadvnode(struct sfs_fs *sfs, uint32_t ino, int forcetype,
 	result = vnodearray_add(sfs->sfs_vnodes, &sv->sv_absvn, NULL);
 	if (result) {
 		vnode_cleanup(&sv->sv_absvn);
-		kfree(sv);
+		kmem_cache_free(sfs_vnode_cache, sv);
 		return result;
 	}
 
@@ -35,10 +35,16 @@
  */
 
 
+#include <array.h>
+#include <spinlock.h>
+#include <kern/vmstat.h>
 #include <vm.h>
+#include <platform/maxcpus.h>
 #include "opt-dumbvm.h"
+#include "opt-hashpt.h"
 
 struct vnode;
+struct rwlock;
 
 /* the region of process */
 #define RG_READ_MASK     4
@@ -47,14 +53,64 @@ struct vnode;
 
 #define PAGE_TABLE_SIZE 1024
 
+/* Page table indices of a user address: |PT1|PT2|Offset| = |10|10|12| */
+#define PT1_INDEX(va) ((va) >> 22)
+#define PT2_INDEX(va) (((va) >> 12) & (PAGE_TABLE_SIZE - 1))
+
+/*
+ * A page table entry is either 0 (no page yet), a TLBLO value with
+ * TLBLO_VALID set (page in memory), or the page's swap slot with
+ * PTE_SWAPPED set (page out on swap).
+ *
+ * PTE_REFERENCED, in a TLBLO bit the hardware doesn't use, is set
+ * whenever vm_fault() loads the page into the TLB and cleared by page
+ * replacement. The UTLB refill handler only loads pages that have it
+ * set (it hardcodes the bit), so the first use of a page after page
+ * replacement has looked at it goes through vm_fault() and sets it
+ * again. It is never written to the TLB.
+ */
+#define PTE_SWAPPED       0x00000001
+#define PTE_REFERENCED    0x00000002
+#define PTE_MKSWAP(slot)  (((paddr_t)(slot) << 12) | PTE_SWAPPED)
+#define PTE_SWAPSLOT(pte) ((pte) >> 12)
+
 struct region{
     vaddr_t vbase;
     size_t npages;
     uint32_t w;
     uint32_t w_reserve;
-    struct region* next;
+
+    /*
+     * File backing, filled in lazily at fault time: the bytes from
+     * file_vaddr up to file_vaddr+file_size come from vn at
+     * file_offset, the rest of the region is zero-filled. vn is NULL
+     * for anonymous memory.
+     *
+     * A region made by mmap() is shared with the file: pages written
+     * through it are written back by munmap(), fsync() and exit.
+     */
+    struct vnode *vn;
+    off_t file_offset;
+    vaddr_t file_vaddr;
+    size_t file_size;
+    bool mmapped;
 };
 
+/* Does region R cover address VA? */
+#define REGION_CONTAINS(r, va) \
+        ((va) >= (r)->vbase && (va) - (r)->vbase < (r)->npages * PAGE_SIZE)
+
+/*
+ * Array of regions. An address space keeps its regions sorted by
+ * vbase and never overlapping, so lookups can binary search.
+ */
+#ifndef REGIONINLINE
+#define REGIONINLINE INLINE
+#endif
+
+DECLARRAY(region, REGIONINLINE);
+DEFARRAY(region, REGIONINLINE);
+
 /*
  * Address space - data structure associated with the virtual memory
  * space of a process.
@@ -73,14 +129,29 @@ struct addrspace {
         paddr_t as_stackpbase;
 #else
         /* Put stuff here for your VM system */
-        paddr_t **page_table;
-        struct region *first_region;
+#if OPT_HASHPT
+        struct hpt_entry *as_hptlist;   /* our entries in the hash table */
+#else
+        paddr_t **page_table;           /* see pagetable.c */
+        uint16_t *as_l2count;           /* PTEs in use per L2 table */
+        uint32_t as_l1map[PAGE_TABLE_SIZE / 32]; /* L2 tables present */
+#endif
+        struct rwlock *as_lock;         /* regions; see vm.c */
+        struct spinlock as_ptlock;      /* PTE changes; see vm.c */
+        struct regionarray as_regions;  /* sorted by vbase */
+        struct region *as_lastregion;   /* last hit of as_find_region */
+        struct region *as_heap;         /* grown and shrunk by sbrk */
+        vaddr_t as_heapend;             /* current break */
+        uint32_t as_asid[MAXCPUS]; /* TLB address space ID tag per cpu */
+        struct vmstat as_stats;         /* see vm_getstats() */
 #endif
 };
 
 /*
  * Functions in addrspace.c:
  *
+ *    as_bootstrap - set up global state. Called from vm_bootstrap().
+ *
  *    as_create - create a new empty address space. You need to make
  *                sure this gets called in all the right places. You
  *                may find you want to change the argument list. May
@@ -102,37 +173,89 @@ struct addrspace {
  *    as_destroy - dispose of an address space. You may need to change
  *                the way this works if implementing user-level threads.
  *
+ *    as_tlbhi  - return the TLB entryhi value for a page of an address
+ *                space on the current cpu, or 0 if the address space
+ *                has no TLB entries on this cpu. Call with interrupts
+ *                off.
+ *
+ *    as_tlb_shootdown - drop the TLB entries for some pages of an
+ *                address space (all of it, if npages is 0) on every
+ *                cpu, waiting for other cpus to do it. Call with
+ *                interrupts on, before reusing what the pages mapped.
+ *
+ *    as_tlbshootdown - carry out a shootdown sent by another cpu.
+ *
+ *    as_find_region - return the region containing an address, or
+ *                NULL if there is none. Call with as_lock held.
+ *
  *    as_define_region - set up a region of memory within the address
- *                space.
+ *                space. Fails with EINVAL if it would overlap an
+ *                existing region.
  *
  *    as_prepare_load - this is called before actually loading from an
  *                executable into the address space.
  *
  *    as_complete_load - this is called when loading from an executable
- *                is complete.
+ *                is complete. Sets up the (empty) heap.
+ *
+ *    as_define_file - back part of a region with a file, to be paged
+ *                in on demand.
+ *
+ *    as_sbrk   - move the end of the heap, which starts right after
+ *                the last region loaded from the executable, and
+ *                return the old end.
+ *
+ *    as_mmap   - map part of a file into the address space at an
+ *                address of the address space's choosing.
+ *
+ *    as_munmap - remove a mapping made by as_mmap, writing back
+ *                modified pages.
+ *
+ *    as_msync  - write back modified pages of every mapping of a file.
  *
  *    as_define_stack - set up the stack region in the address space.
  *                (Normally called *after* as_complete_load().) Hands
  *                back the initial stack pointer for the new process.
  *
+ * as_sbrk, as_mmap, as_munmap, as_msync and as_copy (of the source
+ * address space) take as_lock themselves. The functions that set up a
+ * new address space for a program (as_define_*, as_prepare_load,
+ * as_complete_load) are called before anything runs in it, and don't.
+ *
  * Note that when using dumbvm, addrspace.c is not used and these
  * functions are found in dumbvm.c.
  */
 
+void              as_bootstrap(void);
 struct addrspace *as_create(void);
 int               as_copy(struct addrspace *src, struct addrspace **ret);
 void              as_activate(void);
 void              as_deactivate(void);
 void              as_destroy(struct addrspace *);
+uint32_t          as_tlbhi(struct addrspace *as, vaddr_t vaddr);
+void              as_tlb_shootdown(struct addrspace *as, vaddr_t vaddr,
+                                   unsigned npages);
+void              as_tlbshootdown(const struct tlbshootdown *ts);
+struct region    *as_find_region(struct addrspace *as, vaddr_t vaddr);
 
 int               as_define_region(struct addrspace *as,
                                    vaddr_t vaddr, size_t sz,
                                    int readable,
                                    int writeable,
                                    int executable);
+int               as_define_file(struct addrspace *as,
+                                 vaddr_t vaddr, size_t filesize,
+                                 struct vnode *v, off_t offset);
 int               as_prepare_load(struct addrspace *as);
 int               as_complete_load(struct addrspace *as);
 int               as_define_stack(struct addrspace *as, vaddr_t *initstackptr);
+int               as_sbrk(struct addrspace *as, intptr_t amount,
+                          vaddr_t *oldbreak);
+int               as_mmap(struct addrspace *as, size_t length,
+                          bool writeable, struct vnode *v, off_t offset,
+                          vaddr_t *ret);
+int               as_munmap(struct addrspace *as, vaddr_t vaddr);
+int               as_msync(struct addrspace *as, struct vnode *v);
 
 
 /*
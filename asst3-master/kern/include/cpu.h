@@ -35,6 +35,8 @@
 #include <threadlist.h>
 #include <machine/vm.h>  /* for TLBSHOOTDOWN_MAX */
 
+struct wchan;
+
 
 /*
  * Per-cpu structure
@@ -77,7 +79,8 @@ struct cpu {
 	 * TLB shootdown requests made to this CPU are queued in
 	 * c_shootdown[], with c_numshootdown holding the number of
 	 * requests. TLBSHOOTDOWN_MAX is the maximum number that can
-	 * be queued at once, which is machine-dependent.
+	 * be queued at once, which is machine-dependent. Senders that
+	 * find the queue full wait on c_shootdown_wchan.
 	 *
 	 * The contents of struct tlbshootdown are also machine-
 	 * dependent and might reasonably be either an address space
@@ -86,6 +89,7 @@ struct cpu {
 	uint32_t c_ipi_pending;		/* One bit for each IPI number */
 	struct tlbshootdown c_shootdown[TLBSHOOTDOWN_MAX];
 	unsigned c_numshootdown;
+	struct wchan *c_shootdown_wchan;
 	struct spinlock c_ipi_lock;
 
 	/*
@@ -156,6 +160,8 @@ void cpu_halt(void);
  * ipi_broadcast sends an IPI to all CPUs except the current one.
  * ipi_tlbshootdown is like ipi_send but carries TLB shootdown data.
  *
+ * cpu_get returns the CPU with a given c_number, for picking targets.
+ *
  * interprocessor_interrupt is called on the target CPU when an IPI is
  * received.
  */
@@ -166,6 +172,7 @@ void cpu_halt(void);
 #define IPI_UNIDLE		2	/* Runnable threads are available */
 #define IPI_TLBSHOOTDOWN	3	/* MMU mapping(s) need invalidation */
 
+struct cpu *cpu_get(unsigned number);
 void ipi_send(struct cpu *target, int code);
 void ipi_broadcast(int code);
 void ipi_tlbshootdown(struct cpu *target, const struct tlbshootdown *mapping);
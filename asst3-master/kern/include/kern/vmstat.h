@@ -0,0 +1,66 @@
+/*
+ * Copyright (c) 2000, 2001, 2002, 2003, 2004, 2005, 2008, 2009
+ *	The President and Fellows of Harvard College.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE UNIVERSITY AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE UNIVERSITY OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#ifndef _KERN_VMSTAT_H_
+#define _KERN_VMSTAT_H_
+
+/*
+ * Virtual memory statistics, as returned by vmstat(). Counters count
+ * from boot (global) or from process creation (per process); vs_rss
+ * and vs_peakrss are in pages.
+ */
+
+struct vmstat {
+	/* Page faults, by type */
+	__u32 vs_readfaults;	/* read of an unmapped page */
+	__u32 vs_writefaults;	/* write to an unmapped page */
+	__u32 vs_readonlyfaults; /* write to a read-only page (e.g. COW) */
+
+	__u32 vs_zerofills;	/* anonymous pages touched for the first time */
+
+	/* TLB misses loaded in vm_fault() (not the UTLB refill handler) */
+	__u32 vs_tlbrefills;
+	__u32 vs_tlbflushes;	/* whole address space TLB flushes */
+	__u32 vs_shootdowns;	/* TLB shootdown IPIs sent */
+	__u32 vs_shootdownusec;	/* time spent waiting for them (global) */
+
+	/* Frames allocated and freed: all of them, or for our pages */
+	__u32 vs_framealloc;
+	__u32 vs_framefree;
+
+	__u32 vs_rss;		/* pages mapped now */
+	__u32 vs_peakrss;	/* pages mapped at most */
+};
+
+/* Which statistics vmstat() returns */
+#define VMSTAT_GLOBAL	0	/* the whole system */
+#define VMSTAT_SELF	1	/* the calling process */
+
+
+#endif /* _KERN_VMSTAT_H_ */
@@ -0,0 +1,76 @@
+/*
+ * Copyright (c) 2000, 2001, 2002, 2003, 2004, 2005, 2008, 2009
+ *	The President and Fellows of Harvard College.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE UNIVERSITY AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE UNIVERSITY OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#ifndef _KMEM_H_
+#define _KMEM_H_
+
+/*
+ * Object caches.
+ *
+ * A kmem cache hands out objects of one size, usually one type. An
+ * object given back to its cache is kept as it is for the next
+ * allocation, so the constructor only runs when an object is first
+ * made and the destructor only when the cache finally lets it go.
+ * That way sub-objects like locks and cvs, which cost allocations of
+ * their own, survive from one use of the object to the next. Objects
+ * must be given back in the state the constructor leaves them in.
+ *
+ * Functions:
+ *     kmem_cache_create  - create a cache for objects of SIZE bytes.
+ *                          CTOR, if not NULL, sets up a newly made
+ *                          object and returns an error code if it
+ *                          can't; DTOR, if not NULL, undoes it.
+ *                          Returns NULL if out of memory.
+ *     kmem_cache_destroy - destroy a cache. All its objects must have
+ *                          been given back.
+ *     kmem_cache_alloc   - get an object. Returns NULL if out of memory.
+ *     kmem_cache_free    - give an object back.
+ *     kmem_reap          - destroy the objects all caches are keeping,
+ *                          to free up memory.
+ *     kmem_counts        - return the total number of allocations, and
+ *                          how many of them found an object ready.
+ *     kmem_printstats    - print statistics for each cache.
+ *
+ * Destructors may be called with a spinlock held, and neither
+ * constructors nor destructors may sleep.
+ */
+
+struct kmem_cache;
+
+struct kmem_cache *kmem_cache_create(const char *name, size_t size,
+				     int (*ctor)(void *obj),
+				     void (*dtor)(void *obj));
+void kmem_cache_destroy(struct kmem_cache *kc);
+void *kmem_cache_alloc(struct kmem_cache *kc);
+void kmem_cache_free(struct kmem_cache *kc, void *obj);
+void kmem_reap(void);
+void kmem_counts(unsigned *nallocs, unsigned *nhits);
+void kmem_printstats(void);
+
+#endif /* _KMEM_H_ */
@@ -125,13 +125,38 @@ uint32_t random(void);
  *
  * kheap_nextgeneration, dump, and dumpall do nothing unless heap
  * labeling (for leak detection) in kmalloc.c (q.v.) is enabled.
+ * Likewise kheap_printprofile and resetprofile, which print and reset
+ * per call site counts, need allocation profiling (PROFILE) enabled;
+ * the list is sorted by one of the KHEAP_BY* keys.
+ *
+ * kheap_counts returns how many times kmalloc and kfree have been
+ * called. kheap_pagerefs returns how many pages of subpage allocator
+ * bookkeeping there are, and how many heap pages they describe.
+ *
+ * kvmalloc is like kmalloc, but memory bigger than a page is made of
+ * separate frames mapped one after the other, so it doesn't need a
+ * physically contiguous run of free memory. Such memory is only
+ * virtually contiguous, so can't be given to DMA. It must be freed
+ * with kvfree, and kvfree may not be called with spinlocks held (it
+ * waits for the other cpus to drop the mappings). Small allocations
+ * just go to kmalloc.
  */
 void *kmalloc(size_t size);
 void kfree(void *ptr);
 void kheap_printstats(void);
+void kheap_counts(unsigned *nallocs, unsigned *nfrees);
+void kheap_pagerefs(unsigned *npages, unsigned *ninuse);
+void *kvmalloc(size_t size);
+void kvfree(void *ptr);
 void kheap_nextgeneration(void);
 void kheap_dump(void);
 void kheap_dumpall(void);
+void kheap_printprofile(int sortby);
+void kheap_resetprofile(void);
+
+#define KHEAP_BYLIVE   0	/* bytes allocated and not yet freed */
+#define KHEAP_BYALLOCS 1	/* number of allocations */
+#define KHEAP_BYFREES  2	/* number of frees */
 
 /*
  * C string functions.
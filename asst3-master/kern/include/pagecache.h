@@ -0,0 +1,80 @@
+/*
+ * Copyright (c) 2000, 2001, 2002, 2003, 2004, 2005, 2008, 2009
+ *	The President and Fellows of Harvard College.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE UNIVERSITY AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE UNIVERSITY OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#ifndef _PAGECACHE_H_
+#define _PAGECACHE_H_
+
+/*
+ * Cache of read-only file pages, keyed by (vnode, file offset), so
+ * that every process running the same executable maps the same
+ * physical frames for its text.
+ *
+ * The cache holds a reference to each frame (see share_kpage) and to
+ * each vnode it has pages of, and keeps each vnode's pages on a list
+ * of their own so they can be found without searching the whole
+ * cache. All functions but pagecache_invalidate must be called with
+ * the paging lock (swap_acquire) held.
+ */
+
+struct vnode;
+
+/*
+ * Look up the page of V at file offset OFFSET. If it is cached, add
+ * a reference to the frame for the caller and return it; otherwise
+ * return 0. Either way, store the cache generation in *GEN for a
+ * later pagecache_insert.
+ */
+vaddr_t pagecache_lookup(struct vnode *v, off_t offset, unsigned *gen);
+
+/*
+ * Cache the page at KPAGE, which holds the contents of V at OFFSET
+ * and must never be written again. GEN is from the pagecache_lookup
+ * done before KPAGE was read; if anything has been invalidated since,
+ * the page is not cached, as it might be out of date. Running out of
+ * memory for the cache entry also just means the page is not shared.
+ */
+void pagecache_insert(struct vnode *v, off_t offset, vaddr_t kpage,
+		      unsigned gen);
+
+/*
+ * Free the cached pages of V that are no longer mapped anywhere,
+ * e.g. after an address space using V has gone away.
+ */
+void pagecache_purge(struct vnode *v);
+
+/*
+ * Drop all cached pages of V, because V has been written or
+ * truncated. Pages that are still mapped stay with their mappers.
+ * May be called with or without the paging lock; without it, it is
+ * only taken if V has pages cached.
+ */
+void pagecache_invalidate(struct vnode *v);
+
+
+#endif /* _PAGECACHE_H_ */
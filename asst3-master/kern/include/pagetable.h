@@ -0,0 +1,114 @@
+/*
+ * Copyright (c) 2000, 2001, 2002, 2003, 2004, 2005, 2008, 2009
+ *	The President and Fellows of Harvard College.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE UNIVERSITY AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE UNIVERSITY OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#ifndef _PAGETABLE_H_
+#define _PAGETABLE_H_
+
+/*
+ * Page tables: the map from the user pages of an address space to
+ * their page table entries (see addrspace.h for what a PTE holds).
+ *
+ * There are two implementations. By default each address space has
+ * its own two-level table (pagetable.c), which the UTLB refill handler
+ * can walk. With "options hashpt" there is instead a single hashed
+ * table for all address spaces, sized to physical memory (hashpt.c).
+ *
+ * Functions:
+ *    pt_bootstrap - set up global state. Called from vm_bootstrap().
+ *
+ *    pt_create  - give a new address space an empty page table.
+ *
+ *    pt_destroy - free an address space's page table. Whatever its
+ *                 entries refer to must already have been released.
+ *
+ *    pt_lookup  - return a pointer to the PTE for a user address, or
+ *                 NULL if it has none. The pointer stays good until
+ *                 the PTE is removed. A PTE that is still 0 may or
+ *                 may not be found.
+ *
+ *    pt_reserve - make room for the PTE for a user address, so that
+ *                 pt_alloc can make it without allocating memory. May
+ *                 page something out to get memory.
+ *
+ *    pt_unreserve - give back the room pt_reserve made for the PTE for
+ *                 a user address, if it was never used (nor anything
+ *                 else in the same page table page), e.g. after a
+ *                 fault that failed part way.
+ *
+ *    pt_alloc   - like pt_lookup, but make the PTE (holding 0) if
+ *                 there isn't one; pt_reserve must have made room for
+ *                 it. The caller must fill it in before releasing the
+ *                 PTE lock.
+ *
+ *    pt_remove  - drop the PTE for a user address, which pt_alloc
+ *                 must have made. Frees page table memory that is no
+ *                 longer needed, after waiting for other cpus to stop
+ *                 looking at it.
+ *
+ *    pt_foreach - call a function on every nonzero PTE of an address
+ *                 space, stopping early if it returns nonzero. The
+ *                 function must not add or remove slots in that
+ *                 address space.
+ *
+ *    pt_hwbase  - return the table for the UTLB refill handler to walk
+ *                 (see cpupagetables[]), or 0 if it can't.
+ *
+ *    pt_stats   - report the memory used by page tables, now and at
+ *                 most.
+ *
+ * Locking (see vm.c): pt_alloc must be called with the address
+ * space's PTE lock (as_ptlock) held. pt_lookup may be too, and is
+ * otherwise called, like pt_reserve, with as_lock held, from page-out,
+ * or on an address space nobody else can see yet. pt_remove,
+ * pt_unreserve, pt_foreach and pt_destroy need the page table to
+ * themselves: as_lock held for writing and the paging lock, or an
+ * address space nobody else can see. pt_remove and pt_unreserve take
+ * the PTE lock themselves. What the
+ * implementations share between address spaces they lock themselves.
+ */
+
+struct addrspace;
+
+typedef int (*pt_func)(struct addrspace *as, vaddr_t va, paddr_t *pte,
+                       void *data);
+
+void     pt_bootstrap(void);
+int      pt_create(struct addrspace *as);
+void     pt_destroy(struct addrspace *as);
+paddr_t *pt_lookup(struct addrspace *as, vaddr_t va);
+int      pt_reserve(struct addrspace *as, vaddr_t va);
+paddr_t *pt_alloc(struct addrspace *as, vaddr_t va);
+void     pt_remove(struct addrspace *as, vaddr_t va);
+void     pt_unreserve(struct addrspace *as, vaddr_t va);
+int      pt_foreach(struct addrspace *as, pt_func func, void *data);
+vaddr_t  pt_hwbase(struct addrspace *as);
+void     pt_stats(size_t *bytes, size_t *peakbytes);
+
+
+#endif /* _PAGETABLE_H_ */
@@ -0,0 +1,86 @@
+/*
+ * Copyright (c) 2000, 2001, 2002, 2003, 2004, 2005, 2008, 2009
+ *	The President and Fellows of Harvard College.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE UNIVERSITY AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE UNIVERSITY OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#ifndef _SWAP_H_
+#define _SWAP_H_
+
+/*
+ * Swap space: page-sized slots on a raw disk device, used to page out
+ * user memory when physical memory runs out.
+ *
+ * A page that is swapped out is recorded in its page table entry as
+ * its slot number with PTE_SWAPPED set and TLBLO_VALID clear (see
+ * addrspace.h).
+ *
+ * Functions other than swap_bootstrap must be called with the paging
+ * lock (swap_acquire) held. It serialises page-in and page-out, and
+ * anything that would pull pages out from under page-out: taking
+ * pages away from an address space (unmap, exit) or walking its page
+ * table (fork). Page-out changes its victim's PTE under the victim's
+ * PTE lock, and never waits for an address space lock, so it can be
+ * called from the middle of a fault on any address space. Lock order
+ * is the address space lock, then the paging lock (see vm.c).
+ */
+
+/* Disk used for swap; vfs_swapon() hands back its raw device */
+#define SWAP_DEVICE "lhd0:"
+
+/*
+ * Attach the swap device. Without one, the system runs with physical
+ * memory only.
+ */
+void swap_bootstrap(void);
+
+/* Paging lock */
+void swap_acquire(void);
+void swap_release(void);
+bool swap_i_hold(void);
+
+/*
+ * Free a page of physical memory by writing some user page out to
+ * swap. Returns ENOMEM if there is no swap space or no pageable page.
+ * Rarely it returns 0 without writing anything, when the page it chose
+ * was being freed anyway; callers just try to allocate again.
+ */
+int swap_evict(void);
+
+/* Read slot SLOT into the page at kernel address KPAGE, keeping it */
+int swap_read(unsigned slot, vaddr_t kpage);
+
+/* Read slot SLOT into the page at kernel address KPAGE and free it */
+int swap_pagein(unsigned slot, vaddr_t kpage);
+
+/* Duplicate slot SLOT into a newly allocated one (for fork) */
+int swap_copy(unsigned slot, unsigned *ret);
+
+/* Release slot SLOT */
+void swap_free(unsigned slot);
+
+
+#endif /* _SWAP_H_ */
@@ -140,4 +140,42 @@ void cv_signal(struct cv *cv, struct lock *lock);
 void cv_broadcast(struct cv *cv, struct lock *lock);
 
 
+/*
+ * Reader/writer lock.
+ *
+ * Any number of readers may hold the lock at once, or one writer. A
+ * waiting writer keeps new readers out, so a steady stream of readers
+ * can't starve it. Neither side may be acquired recursively.
+ *
+ * The name field is for easier debugging. A copy of the name is made
+ * internally.
+ */
+struct rwlock {
+        char *rw_name;
+        struct wchan *rw_wchan;
+        struct spinlock rw_lock;
+        volatile unsigned rw_readers;           /* readers holding it */
+        volatile unsigned rw_writerswaiting;    /* writers waiting */
+        struct thread *volatile rw_writer;      /* writer holding it */
+};
+
+struct rwlock *rwlock_create(const char *name);
+void rwlock_destroy(struct rwlock *);
+
+/*
+ * Operations:
+ *    rwlock_acquire_read  - Get the lock for reading. Blocks while a
+ *                           writer holds it or is waiting for it.
+ *    rwlock_release_read  - Give up a read hold.
+ *    rwlock_acquire_write - Get the lock for writing. Blocks until
+ *                           nobody else holds it.
+ *    rwlock_release_write - Give up the write hold. Only the thread
+ *                           holding it may do this.
+ */
+void rwlock_acquire_read(struct rwlock *);
+void rwlock_release_read(struct rwlock *);
+void rwlock_acquire_write(struct rwlock *);
+void rwlock_release_write(struct rwlock *);
+
+
 #endif /* _SYNCH_H_ */
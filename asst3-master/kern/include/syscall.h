@@ -92,4 +92,9 @@ int sys_fstat(int fd, userptr_t statptr);
 int sys_fsync(int fd);
 int sys_ftruncate(int fd, off_t len);
 
+int sys_sbrk(intptr_t amount, int32_t *retval);
+int sys_mmap(size_t length, int prot, int fd, off_t offset, int32_t *retval);
+int sys_munmap(userptr_t addr);
+int sys_vmstat(int which, userptr_t buf);
+
 #endif /* _SYSCALL_H_ */
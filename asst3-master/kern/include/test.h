@@ -96,6 +96,12 @@ int kmalloctest(int, char **);
 int kmallocstress(int, char **);
 int kmalloctest3(int, char **);
 int kmalloctest4(int, char **);
+int kmallocbench(int, char **);
+int kmembench(int, char **);
+int kmallocstress100k(int, char **);
+int frameallocbench(int, char **);
+int fragallocbench(int, char **);
+int vmfaultstress(int, char **);
 int nettest(int, char **);
 
 /* Routine for running a user-level program. */
@@ -39,25 +39,86 @@
 
 #include <machine/vm.h>
 
+struct addrspace;
+struct region;
+
 /* Fault-type arguments to vm_fault() */
 #define VM_FAULT_READ        0    /* A read was attempted */
 #define VM_FAULT_WRITE       1    /* A write was attempted */
 #define VM_FAULT_READONLY    2    /* A write to a readonly page was attempted*/
 
+/*
+ * Fault-around window, in pages. A fault that maps a new page also
+ * maps whatever else in the aligned window around it can be had
+ * without I/O, and preloads it into free TLB slots. Must be a power
+ * of two no larger than a page table; 1 turns fault-around off.
+ */
+#define VM_FAULTAROUND       8
+
 
 /* Initialization function */
 void vm_bootstrap(void);
 
-int vm_create_l1_pte(paddr_t **page_table, uint32_t pt1);
-int vm_create_l2_pte(paddr_t **page_table, uint32_t pt1, uint32_t pt2, uint32_t dirty);
+/* Allocate a user or page table frame, paging out if need be */
+vaddr_t vm_alloc_page(bool zeroed);
 
 /* Fault handling function called by trap code */
 int vm_fault(int faulttype, vaddr_t faultaddress);
 
+/* Drop this cpu's TLB entry, if any, for a page of an address space */
+void vm_tlb_invalidate(struct addrspace *as, vaddr_t vaddr);
+
+/* Page replacement: test and clear a user page's referenced bit */
+bool vm_page_referenced(struct addrspace *as, vaddr_t vaddr);
+
+/* Write back modified pages of a region mapped with mmap() */
+int vm_msync(struct addrspace *as, struct region *reg);
+
+/* Does a PTE map the shared zero page? */
+bool vm_pte_iszero(paddr_t pte);
+
+/* Number of calls to vm_fault so far, for statistics */
+unsigned vm_fault_count(void);
+
+/*
+ * VM statistics (see <kern/vmstat.h>). Each address space counts its
+ * own and vm_stats counts everything; VM_STAT counts an event for both.
+ * Statistics only, so updates are allowed to race, except the resident
+ * page counts vm_stat_rss() keeps, which are locked.
+ */
+struct vmstat;
+extern struct vmstat vm_stats;
+#define VM_STAT(as, field) ((as)->as_stats.field++, vm_stats.field++)
+void vm_stat_rss(struct addrspace *as, int npages);
+void vm_getstats(struct addrspace *as, struct vmstat *vs);
+void vm_printstats(void);
+
 /* Allocate/free kernel heap pages (called by kmalloc/kfree) */
 vaddr_t alloc_kpages(unsigned npages);
 void free_kpages(vaddr_t addr);
 
+/* kvmalloc's kseg2 mappings: TLB misses, shootdowns, statistics */
+int kvm_fault(int faulttype, vaddr_t faultaddress);
+void kvm_tlbshootdown(const struct tlbshootdown *);
+void kvm_printstats(void);
+
+/* Allocate a page of zeroes, and the thread that zeroes pages ahead */
+vaddr_t alloc_zeroed_kpage(void);
+void zeropool_bootstrap(void);
+
+/* Reference counting for frames shared copy-on-write */
+void share_kpage(vaddr_t addr);
+unsigned kpage_refcount(vaddr_t addr);
+
+/* Page replacement: owners of pageable frames and victim selection */
+void kpage_setowner(vaddr_t kpage, struct addrspace *as, vaddr_t va);
+vaddr_t kpage_victim(struct addrspace **as, vaddr_t *va);
+
+/* Frame allocator occupancy */
+void kpages_stats(unsigned *nframes, unsigned *nfree);
+void kpages_counts(unsigned *nalloc, unsigned *nfreed);
+void kpages_printstats(void);
+
 /* TLB shootdown handling called from interprocessor_interrupt */
 void vm_tlbshootdown(const struct tlbshootdown *);
 
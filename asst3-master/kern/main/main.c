@@ -47,6 +47,7 @@
 #include <vfs.h>
 #include <device.h>
 #include <pid.h>
+#include <openfile.h>
 #include <syscall.h>
 #include <test.h>
 #include <version.h>
@@ -114,6 +115,7 @@ boot(void)
 	pid_bootstrap();
 	hardclock_bootstrap();
 	vfs_bootstrap();
+	openfile_bootstrap();
 	kheap_nextgeneration();
 
 	/* Probe and initialize devices. Interrupts should come on. */
@@ -41,12 +41,16 @@
 #include <thread.h>
 #include <proc.h>
 #include <vfs.h>
+#include <vm.h>
 #include <sfs.h>
 #include <pid.h>
 #include <syscall.h>
+#include <kmem.h>
 #include <test.h>
 #include "opt-sfs.h"
 #include "opt-net.h"
+#include "opt-unsw.h"
+#include "opt-dumbvm.h"
 
 /*
  * In-kernel menu and command dispatcher.
@@ -467,6 +471,7 @@ cmd_kheapstats(int nargs, char **args)
 	(void)args;
 
 	kheap_printstats();
+	kmem_printstats();
 
 	return 0;
 }
@@ -500,6 +505,64 @@ cmd_kheapdump(int nargs, char **args)
 	return 0;
 }
 
+static
+int
+cmd_kheapprofile(int nargs, char **args)
+{
+	const char *key;
+
+	key = nargs == 2 ? args[1] : "live";
+	if (nargs > 2) {
+		key = "";
+	}
+
+	if (!strcmp(key, "live")) {
+		kheap_printprofile(KHEAP_BYLIVE);
+	}
+	else if (!strcmp(key, "allocs")) {
+		kheap_printprofile(KHEAP_BYALLOCS);
+	}
+	else if (!strcmp(key, "frees")) {
+		kheap_printprofile(KHEAP_BYFREES);
+	}
+	else if (!strcmp(key, "reset")) {
+		kheap_resetprofile();
+	}
+	else {
+		kprintf("Usage: khprof [live|allocs|frees|reset]\n");
+	}
+
+	return 0;
+}
+
+#if OPT_UNSW
+static
+int
+cmd_kpagestats(int nargs, char **args)
+{
+	(void)nargs;
+	(void)args;
+
+	kpages_printstats();
+
+	return 0;
+}
+#endif
+
+#if !OPT_DUMBVM
+static
+int
+cmd_vmstats(int nargs, char **args)
+{
+	(void)nargs;
+	(void)args;
+
+	vm_printstats();
+
+	return 0;
+}
+#endif
+
 ////////////////////////////////////////
 //
 // Menus.
@@ -566,6 +629,16 @@ static const char *testmenu[] = {
 	"[km2] kmalloc stress test           ",
 	"[km3] Large kmalloc test            ",
 	"[km4] Multipage kmalloc test        ",
+	"[km5] kmalloc throughput benchmark  ",
+	"[km6] Object cache benchmark        ",
+	"[km7] 100k live objects stress test ",
+#if OPT_UNSW
+	"[fa1] Frame allocator benchmark     ",
+	"[fa2] Fragmented large allocation   ",
+#endif
+#if !OPT_DUMBVM
+	"[vm1] Parallel page fault stress    ",
+#endif
 	"[tt1] Thread test 1                 ",
 	"[tt2] Thread test 2                 ",
 	"[tt3] Thread test 3                 ",
@@ -606,6 +679,13 @@ static const char *mainmenu[] = {
 	"[kh] Kernel heap stats              ",
 	"[khgen] Next kernel heap generation ",
 	"[khdump] Dump kernel heap           ",
+	"[khprof] Kernel heap profile        ",
+#if OPT_UNSW
+	"[kp] Physical page allocator stats  ",
+#endif
+#if !OPT_DUMBVM
+	"[vm] Virtual memory stats           ",
+#endif
 	"[q] Quit and shut down              ",
 	NULL
 };
@@ -657,6 +737,13 @@ static struct {
 	{ "kh",         cmd_kheapstats },
 	{ "khgen",      cmd_kheapgeneration },
 	{ "khdump",     cmd_kheapdump },
+	{ "khprof",     cmd_kheapprofile },
+#if OPT_UNSW
+	{ "kp",         cmd_kpagestats },
+#endif
+#if !OPT_DUMBVM
+	{ "vm",         cmd_vmstats },
+#endif
 
 	/* base system tests */
 	{ "at",		arraytest },
@@ -667,6 +754,16 @@ static struct {
 	{ "km2",	kmallocstress },
 	{ "km3",	kmalloctest3 },
 	{ "km4",	kmalloctest4 },
+	{ "km5",	kmallocbench },
+	{ "km6",	kmembench },
+	{ "km7",	kmallocstress100k },
+#if OPT_UNSW
+	{ "fa1",	frameallocbench },
+	{ "fa2",	fragallocbench },
+#endif
+#if !OPT_DUMBVM
+	{ "vm1",	vmfaultstress },
+#endif
 #if OPT_NET
 	{ "net",	nettest },
 #endif
@@ -46,6 +46,7 @@
 #include <kern/errno.h>
 #include <spl.h>
 #include <synch.h>
+#include <kmem.h>
 #include <proc.h>
 #include <current.h>
 #include <addrspace.h>
@@ -58,6 +59,38 @@
  */
 struct proc *kproc;
 
+/*
+ * Proc structures come from an object cache, which keeps the threads
+ * lock and the threads array of each one freed for the next.
+ */
+static struct kmem_cache *proc_cache;
+
+static
+int
+proc_ctor(void *obj)
+{
+	struct proc *proc = obj;
+
+	proc->p_threadslock = lock_create("p_threads");
+	if (proc->p_threadslock == NULL) {
+		return ENOMEM;
+	}
+	threadarray_init(&proc->p_threads);
+	spinlock_init(&proc->p_lock);
+	return 0;
+}
+
+static
+void
+proc_dtor(void *obj)
+{
+	struct proc *proc = obj;
+
+	spinlock_cleanup(&proc->p_lock);
+	threadarray_cleanup(&proc->p_threads);
+	lock_destroy(proc->p_threadslock);
+}
+
 /*
  * Create a proc structure.
  */
@@ -67,25 +100,16 @@ proc_create(const char *name)
 {
 	struct proc *proc;
 
-	proc = kmalloc(sizeof(*proc));
+	proc = kmem_cache_alloc(proc_cache);
 	if (proc == NULL) {
 		return NULL;
 	}
 	proc->p_name = kstrdup(name);
 	if (proc->p_name == NULL) {
-		kfree(proc);
+		kmem_cache_free(proc_cache, proc);
 		return NULL;
 	}
 
-	proc->p_threadslock = lock_create("p_threads");
-	if (proc->p_threadslock == NULL) {
-		kfree(proc->p_name);
-		kfree(proc);
-		return NULL;
-	}
-	threadarray_init(&proc->p_threads);
-
-	spinlock_init(&proc->p_lock);
 	proc->p_pid = INVALID_PID;
 
 	/* VM fields */
@@ -183,12 +207,11 @@ proc_destroy(struct proc *proc)
 	}
 
 	KASSERT(proc->p_pid == INVALID_PID);
-	spinlock_cleanup(&proc->p_lock);
-	threadarray_cleanup(&proc->p_threads);
-	lock_destroy(proc->p_threadslock);
+	KASSERT(threadarray_num(&proc->p_threads) == 0);
 
+	/* The cache keeps the threads lock and array */
 	kfree(proc->p_name);
-	kfree(proc);
+	kmem_cache_free(proc_cache, proc);
 }
 
 /*
@@ -197,6 +220,12 @@ proc_destroy(struct proc *proc)
 void
 proc_bootstrap(void)
 {
+	proc_cache = kmem_cache_create("proc", sizeof(struct proc),
+				       proc_ctor, proc_dtor);
+	if (proc_cache == NULL) {
+		panic("proc_bootstrap: Out of memory\n");
+	}
+
 	kproc = proc_create("[kernel]");
 	if (kproc == NULL) {
 		panic("proc_create for kproc failed\n");
@@ -73,7 +73,10 @@
  * executable whose load address is in kernel space. If you should
  * change this code to not use uiomove, be sure to check for this case
  * explicitly.
+ *
+ * Only dumbvm loads segments this way; see map_segment below.
  */
+#if OPT_DUMBVM
 static
 int
 load_segment(struct addrspace *as, struct vnode *v,
@@ -145,6 +148,34 @@ load_segment(struct addrspace *as, struct vnode *v,
 	return result;
 }
 
+#else /* !OPT_DUMBVM */
+
+/*
+ * Map a segment; the arguments are as for load_segment. With the
+ * real VM system nothing is read here: the segment is recorded as
+ * file backed and vm_fault() reads in each page on first touch, so
+ * exec only pays for the pages the program uses. (Region setup has
+ * already rejected segments in kernel space.)
+ */
+static
+int
+map_segment(struct addrspace *as, struct vnode *v,
+	    off_t offset, vaddr_t vaddr,
+	    size_t memsize, size_t filesize)
+{
+	if (filesize > memsize) {
+		kprintf("ELF: warning: segment filesize > segment memsize\n");
+		filesize = memsize;
+	}
+
+	DEBUG(DB_EXEC, "ELF: Mapping %lu bytes at 0x%lx\n",
+	      (unsigned long) filesize, (unsigned long) vaddr);
+
+	return as_define_file(as, vaddr, filesize, v, offset);
+}
+
+#endif /* OPT_DUMBVM */
+
 /*
  * Load an ELF executable user program into the current address space.
  *
@@ -288,9 +319,14 @@ load_elf(struct vnode *v, vaddr_t *entrypoint)
 			return ENOEXEC;
 		}
 
+#if OPT_DUMBVM
 		result = load_segment(as, v, ph.p_offset, ph.p_vaddr,
 				      ph.p_memsz, ph.p_filesz,
 				      ph.p_flags & PF_X);
+#else
+		result = map_segment(as, v, ph.p_offset, ph.p_vaddr,
+				     ph.p_memsz, ph.p_filesz);
+#endif
 		if (result) {
 			return result;
 		}
@@ -36,9 +36,54 @@
 #include <kern/fcntl.h>
 #include <lib.h>
 #include <synch.h>
+#include <kmem.h>
 #include <vfs.h>
 #include <openfile.h>
 
+/*
+ * Open files come from their own object cache, which keeps the locks
+ * of closed files for the next open.
+ */
+static struct kmem_cache *openfile_cache;
+
+static
+int
+openfile_ctor(void *obj)
+{
+	struct openfile *file = obj;
+
+	file->of_offsetlock = lock_create("openfile");
+	if (file->of_offsetlock == NULL) {
+		return ENOMEM;
+	}
+	spinlock_init(&file->of_reflock);
+	return 0;
+}
+
+static
+void
+openfile_dtor(void *obj)
+{
+	struct openfile *file = obj;
+
+	spinlock_cleanup(&file->of_reflock);
+	lock_destroy(file->of_offsetlock);
+}
+
+/*
+ * Set up the openfile cache. Called once at boot.
+ */
+void
+openfile_bootstrap(void)
+{
+	openfile_cache = kmem_cache_create("openfile",
+					   sizeof(struct openfile),
+					   openfile_ctor, openfile_dtor);
+	if (openfile_cache == NULL) {
+		panic("openfile_bootstrap: Out of memory\n");
+	}
+}
+
 /*
  * Constructor for struct openfile.
  */
@@ -53,19 +98,11 @@ openfile_create(struct vnode *vn, int accmode)
 		accmode == O_WRONLY ||
 		accmode == O_RDWR);
 
-	file = kmalloc(sizeof(struct openfile));
+	file = kmem_cache_alloc(openfile_cache);
 	if (file == NULL) {
 		return NULL;
 	}
 
-	file->of_offsetlock = lock_create("openfile");
-	if (file->of_offsetlock == NULL) {
-		kfree(file);
-		return NULL;
-	}
-
-	spinlock_init(&file->of_reflock);
-
 	file->of_vnode = vn;
 	file->of_accmode = accmode;
 	file->of_offset = 0;
@@ -85,9 +122,8 @@ openfile_destroy(struct openfile *file)
 	/* balance vfs_open with vfs_close (not VOP_DECREF) */
 	vfs_close(file->of_vnode);
 
-	spinlock_cleanup(&file->of_reflock);
-	lock_destroy(file->of_offsetlock);
-	kfree(file);
+	/* The cache keeps the locks */
+	kmem_cache_free(openfile_cache, file);
 }
 
 /*
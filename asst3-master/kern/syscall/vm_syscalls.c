@@ -0,0 +1,173 @@
+/*
+ * Copyright (c) 2000, 2001, 2002, 2003, 2004, 2005, 2008, 2009
+ *	The President and Fellows of Harvard College.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE UNIVERSITY AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE UNIVERSITY OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * Memory-related system calls.
+ */
+
+#include <types.h>
+#include <kern/errno.h>
+#include <kern/fcntl.h>
+#include <kern/mman.h>
+#include <kern/vmstat.h>
+#include <lib.h>
+#include <copyinout.h>
+#include <proc.h>
+#include <current.h>
+#include <addrspace.h>
+#include <vm.h>
+#include <openfile.h>
+#include <filetable.h>
+#include <syscall.h>
+#include "opt-dumbvm.h"
+
+/*
+ * sbrk: move the end of the heap by AMOUNT bytes (which may be
+ * negative) and return the old end.
+ */
+int
+sys_sbrk(intptr_t amount, int32_t *retval)
+{
+#if OPT_DUMBVM
+	(void)amount;
+	(void)retval;
+	return ENOSYS;
+#else
+	struct addrspace *as;
+	vaddr_t oldbreak;
+	int result;
+
+	as = proc_getas();
+	if (as == NULL) {
+		return ENOMEM;
+	}
+
+	result = as_sbrk(as, amount, &oldbreak);
+	if (result) {
+		return result;
+	}
+	*retval = (int32_t)oldbreak;
+	return 0;
+#endif
+}
+
+/*
+ * mmap: map LENGTH bytes of the open file FD, from OFFSET, somewhere
+ * in the address space and return where. This is the simplified UNSW
+ * mmap: the kernel always picks the address, and the mapping is
+ * shared with the file.
+ */
+int
+sys_mmap(size_t length, int prot, int fd, off_t offset, int32_t *retval)
+{
+#if OPT_DUMBVM
+	(void)length;
+	(void)prot;
+	(void)fd;
+	(void)offset;
+	(void)retval;
+	return ENOSYS;
+#else
+	struct openfile *file;
+	vaddr_t addr;
+	int result;
+
+	if ((prot & ~(PROT_READ | PROT_WRITE)) != 0) {
+		return EINVAL;
+	}
+
+	result = filetable_get(curproc->p_filetable, fd, &file);
+	if (result) {
+		return result;
+	}
+
+	/* The file must be readable, and writable for a writable map */
+	if (file->of_accmode == O_WRONLY ||
+	    ((prot & PROT_WRITE) && file->of_accmode == O_RDONLY)) {
+		filetable_put(curproc->p_filetable, fd, file);
+		return EACCES;
+	}
+
+	result = as_mmap(proc_getas(), length, (prot & PROT_WRITE) != 0,
+			 file->of_vnode, offset, &addr);
+	filetable_put(curproc->p_filetable, fd, file);
+	if (result) {
+		return result;
+	}
+	*retval = (int32_t)addr;
+	return 0;
+#endif
+}
+
+/*
+ * munmap: remove the mapping at ADDR, writing back any changes.
+ */
+int
+sys_munmap(userptr_t addr)
+{
+#if OPT_DUMBVM
+	(void)addr;
+	return ENOSYS;
+#else
+	return as_munmap(proc_getas(), (vaddr_t)addr);
+#endif
+}
+
+/*
+ * vmstat: copy out VM statistics for the whole system or for the
+ * calling process, as selected by WHICH.
+ */
+int
+sys_vmstat(int which, userptr_t buf)
+{
+#if OPT_DUMBVM
+	(void)which;
+	(void)buf;
+	return ENOSYS;
+#else
+	struct vmstat vs;
+	struct addrspace *as;
+
+	switch (which) {
+	    case VMSTAT_GLOBAL:
+		vm_getstats(NULL, &vs);
+		break;
+	    case VMSTAT_SELF:
+		as = proc_getas();
+		if (as == NULL) {
+			return EINVAL;
+		}
+		vm_getstats(as, &vs);
+		break;
+	    default:
+		return EINVAL;
+	}
+	return copyout(&vs, buf, sizeof(vs));
+#endif
+}
@@ -0,0 +1,278 @@
+/*
+ * Copyright (c) 2000, 2001, 2002, 2003, 2004, 2005, 2008, 2009
+ *	The President and Fellows of Harvard College.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE UNIVERSITY AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE UNIVERSITY OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * Tests and benchmarks for the physical frame allocator.
+ */
+#include <types.h>
+#include <kern/errno.h>
+#include <lib.h>
+#include <clock.h>
+#include <vm.h>
+#include <test.h>
+
+////////////////////////////////////////////////////////////
+// fa1
+
+/*
+ * Measure single-frame alloc_kpages/free_kpages throughput with the
+ * frame table filled to various levels of occupancy.
+ *
+ * The frames used to hold memory at a given occupancy are chained
+ * together through their first word, so the test needs no other
+ * memory to keep track of them.
+ */
+
+#define FA_NTRIES 10000
+
+static const unsigned fa_levels[] = { 10, 50, 95 };
+
+struct heldframe {
+	struct heldframe *next;
+};
+
+/*
+ * Allocate frames onto *HELD until at least PERCENT of the managed
+ * frames are in use. Returns ENOMEM if memory ran out first.
+ */
+static
+int
+fa_fill(struct heldframe **held, unsigned percent)
+{
+	struct heldframe *hf;
+	unsigned nframes, nfree;
+
+	while (1) {
+		kpages_stats(&nframes, &nfree);
+		if ((nframes - nfree) * 100 >= nframes * percent) {
+			return 0;
+		}
+		hf = (struct heldframe *)alloc_kpages(1);
+		if (hf == NULL) {
+			return ENOMEM;
+		}
+		hf->next = *held;
+		*held = hf;
+	}
+}
+
+/*
+ * Time FA_NTRIES allocate/free pairs and return allocations per
+ * second.
+ */
+static
+unsigned
+fa_measure(void)
+{
+	struct timespec before, after;
+	uint64_t nsecs;
+	vaddr_t page;
+	unsigned i;
+
+	gettime(&before);
+	for (i=0; i<FA_NTRIES; i++) {
+		page = alloc_kpages(1);
+		if (page == 0) {
+			panic("fa1: alloc_kpages failed\n");
+		}
+		free_kpages(page);
+	}
+	gettime(&after);
+
+	timespec_sub(&after, &before, &after);
+	nsecs = (uint64_t)after.tv_sec * 1000000000 + after.tv_nsec;
+	if (nsecs == 0) {
+		nsecs = 1;
+	}
+	return (unsigned)((uint64_t)FA_NTRIES * 1000000000 / nsecs);
+}
+
+int
+frameallocbench(int nargs, char **args)
+{
+	struct heldframe *held = NULL, *hf;
+	unsigned nframes, nfree;
+	unsigned i;
+	int result = 0;
+
+	(void)nargs;
+	(void)args;
+
+	kpages_stats(&nframes, &nfree);
+	kprintf("Frame allocator benchmark: %u frames, %u free\n",
+		nframes, nfree);
+
+	for (i=0; i<ARRAYCOUNT(fa_levels); i++) {
+		result = fa_fill(&held, fa_levels[i]);
+		if (result) {
+			kprintf("fa1: ran out of memory filling to %u%%\n",
+				fa_levels[i]);
+			break;
+		}
+		kpages_stats(&nframes, &nfree);
+		kprintf("%3u%% occupied (%u/%u frames): %u allocs/sec\n",
+			fa_levels[i], nframes - nfree, nframes,
+			fa_measure());
+	}
+
+	while (held != NULL) {
+		hf = held;
+		held = hf->next;
+		free_kpages((vaddr_t)hf);
+	}
+
+	kprintf("Frame allocator benchmark done\n");
+	return result;
+}
+
+////////////////////////////////////////////////////////////
+// fa2
+
+/*
+ * Fragment physical memory, then see how many large allocations
+ * still succeed: FA2_NTRIES blocks of FA2_NPAGES pages each, first
+ * from alloc_kpages, which needs physically contiguous frames, then
+ * from kvmalloc, which doesn't.
+ *
+ * Memory is fragmented by filling it to 95% and then freeing every
+ * other frame (by physical address), which leaves about half of it
+ * free but hardly any two free frames next to each other.
+ */
+
+#define FA2_NTRIES 32
+#define FA2_NPAGES 4
+
+/*
+ * Try FA2_NTRIES allocations of FA2_NPAGES pages, either from
+ * alloc_kpages or from kvmalloc, and return how many failed. The
+ * blocks are all held until the end, and each is written and checked.
+ */
+static
+unsigned
+fa2_try(bool virtual)
+{
+	void *blocks[FA2_NTRIES];
+	unsigned i, j, nfailed;
+	uint32_t *p;
+
+	nfailed = 0;
+	for (i=0; i<FA2_NTRIES; i++) {
+		if (virtual) {
+			blocks[i] = kvmalloc(FA2_NPAGES * PAGE_SIZE);
+		}
+		else {
+			blocks[i] = (void *)alloc_kpages(FA2_NPAGES);
+		}
+		if (blocks[i] == NULL) {
+			nfailed++;
+			continue;
+		}
+		p = blocks[i];
+		for (j=0; j<FA2_NPAGES * PAGE_SIZE / sizeof(*p); j++) {
+			p[j] = i ^ j;
+		}
+	}
+
+	for (i=0; i<FA2_NTRIES; i++) {
+		if (blocks[i] == NULL) {
+			continue;
+		}
+		p = blocks[i];
+		for (j=0; j<FA2_NPAGES * PAGE_SIZE / sizeof(*p); j++) {
+			if (p[j] != (i ^ j)) {
+				panic("fa2: block %u word %u is wrong\n", i, j);
+			}
+		}
+		if (virtual) {
+			kvfree(blocks[i]);
+		}
+		else {
+			free_kpages((vaddr_t)blocks[i]);
+		}
+	}
+	return nfailed;
+}
+
+int
+fragallocbench(int nargs, char **args)
+{
+	struct heldframe *held = NULL, *kept = NULL, *hf;
+	unsigned nframes, nfree, nfailed;
+	int result;
+
+	(void)nargs;
+	(void)args;
+
+	kprintf("Fragmented large allocation test...\n");
+
+	result = fa_fill(&held, 95);
+	if (result) {
+		kprintf("fa2: ran out of memory filling to 95%%\n");
+		goto done;
+	}
+
+	/* Free the odd frames */
+	while (held != NULL) {
+		hf = held;
+		held = hf->next;
+		if ((KVADDR_TO_PADDR((vaddr_t)hf) / PAGE_SIZE) % 2) {
+			free_kpages((vaddr_t)hf);
+		}
+		else {
+			hf->next = kept;
+			kept = hf;
+		}
+	}
+
+	kpages_stats(&nframes, &nfree);
+	kprintf("%u of %u frames free\n", nfree, nframes);
+
+	nfailed = fa2_try(false);
+	kprintf("alloc_kpages(%u): %u of %u failed (%u%%)\n", FA2_NPAGES,
+		nfailed, FA2_NTRIES, nfailed * 100 / FA2_NTRIES);
+	nfailed = fa2_try(true);
+	kprintf("kvmalloc(%u): %u of %u failed (%u%%)\n",
+		FA2_NPAGES * PAGE_SIZE, nfailed, FA2_NTRIES,
+		nfailed * 100 / FA2_NTRIES);
+
+ done:
+	while (kept != NULL) {
+		hf = kept;
+		kept = hf->next;
+		free_kpages((vaddr_t)hf);
+	}
+	while (held != NULL) {
+		hf = held;
+		held = hf->next;
+		free_kpages((vaddr_t)hf);
+	}
+
+	kprintf("Fragmented large allocation test done\n");
+	return result;
+}
@@ -32,9 +32,18 @@
  */
 #include <types.h>
 #include <kern/errno.h>
+#include <kern/fcntl.h>
+#include <kern/wait.h>
 #include <lib.h>
+#include <clock.h>
+#include <cpu.h>
+#include <current.h>
 #include <thread.h>
 #include <synch.h>
+#include <proc.h>
+#include <pid.h>
+#include <openfile.h>
+#include <kmem.h>
 #include <vm.h> /* for PAGE_SIZE */
 #include <test.h>
 
@@ -379,3 +388,410 @@ kmalloctest4(int nargs, char **args)
 	kprintf("Multipage kmalloc test done\n");
 	return 0;
 }
+
+////////////////////////////////////////////////////////////
+// km5
+
+/*
+ * Measure subpage kmalloc/kfree throughput with 1, 2, and 4 threads
+ * at once. Each thread makes KM5_NOPS allocations of assorted small
+ * sizes, freeing each one KM5_NLIVE allocations later, much like the
+ * small objects syscalls create and destroy. Threads spread out over
+ * the cpus as they're migrated, so with enough cpus the rate should
+ * grow with the number of threads rather than stay flat.
+ */
+
+#define KM5_NOPS  100000
+#define KM5_NLIVE 8
+
+static const unsigned km5_nthreads[] = { 1, 2, 4 };
+static const size_t km5_sizes[] = { 24, 40, 100, 64, 200, 16, 500, 128 };
+
+/* The cpu each thread finished on */
+static unsigned km5_cpus[4];
+
+static
+void
+kmallocbenchthread(void *sm, unsigned long num)
+{
+	struct semaphore *sem = sm;
+	void *ptrs[KM5_NLIVE];
+	unsigned i, slot;
+
+	for (i=0; i<KM5_NLIVE; i++) {
+		ptrs[i] = NULL;
+	}
+
+	for (i=0; i<KM5_NOPS; i++) {
+		slot = i % KM5_NLIVE;
+		kfree(ptrs[slot]);
+		ptrs[slot] = kmalloc(km5_sizes[(i + num) %
+					       ARRAYCOUNT(km5_sizes)]);
+		if (ptrs[slot] == NULL) {
+			panic("kmallocbench: thread %lu: kmalloc failed\n",
+			      num);
+		}
+	}
+
+	for (i=0; i<KM5_NLIVE; i++) {
+		kfree(ptrs[i]);
+	}
+
+	km5_cpus[num] = curcpu->c_number;
+	V(sem);
+}
+
+int
+kmallocbench(int nargs, char **args)
+{
+	struct semaphore *sem;
+	struct timespec before, after;
+	uint64_t nsecs;
+	unsigned n, nthreads, ncpus;
+	unsigned i, j;
+	int result;
+
+	(void)nargs;
+	(void)args;
+
+	kprintf("Starting kmalloc throughput benchmark...\n");
+
+	sem = sem_create("kmallocbench", 0);
+	if (sem == NULL) {
+		panic("kmallocbench: sem_create failed\n");
+	}
+
+	for (n=0; n<ARRAYCOUNT(km5_nthreads); n++) {
+		nthreads = km5_nthreads[n];
+		KASSERT(nthreads <= ARRAYCOUNT(km5_cpus));
+
+		gettime(&before);
+		for (i=0; i<nthreads; i++) {
+			result = thread_fork("kmallocbench", NULL,
+					     kmallocbenchthread, sem, i);
+			if (result) {
+				panic("kmallocbench: thread_fork failed: %s\n",
+				      strerror(result));
+			}
+		}
+		for (i=0; i<nthreads; i++) {
+			P(sem);
+		}
+		gettime(&after);
+
+		timespec_sub(&after, &before, &after);
+		nsecs = (uint64_t)after.tv_sec * 1000000000 + after.tv_nsec;
+		if (nsecs == 0) {
+			nsecs = 1;
+		}
+
+		/* Count the cpus the threads ended up on */
+		ncpus = 0;
+		for (i=0; i<nthreads; i++) {
+			for (j=0; j<i; j++) {
+				if (km5_cpus[j] == km5_cpus[i]) {
+					break;
+				}
+			}
+			if (j == i) {
+				ncpus++;
+			}
+		}
+
+		kprintf("%u thread%s on %u cpu%s: %u kmalloc/kfree pairs/sec\n",
+			nthreads, nthreads == 1 ? "" : "s",
+			ncpus, ncpus == 1 ? "" : "s",
+			(unsigned)((uint64_t)nthreads * KM5_NOPS *
+				   1000000000 / nsecs));
+	}
+
+	sem_destroy(sem);
+	kprintf("kmalloc throughput benchmark done\n");
+	return 0;
+}
+
+////////////////////////////////////////////////////////////
+// km6
+
+/*
+ * Measure what creating and destroying common kernel objects costs
+ * in kmalloc calls. Fork a process whose one thread exits right
+ * away, and wait for it, KM6_NOPS times; then open and close a file
+ * (by default the console) KM6_NOPS times. For each, print the time
+ * per operation, the kmalloc calls per operation, and how many of
+ * the object cache allocations found a constructed object waiting.
+ * Proc, thread, pid, and openfile structures should all come out of
+ * their caches with their locks, cvs, and stacks already made.
+ */
+
+#define KM6_NOPS 2000
+
+static
+void
+kmembenchchild(void *unused1, unsigned long unused2)
+{
+	(void)unused1;
+	(void)unused2;
+
+	proc_exit(_MKWAIT_EXIT(0));
+}
+
+static
+int
+kmembench_fork(void)
+{
+	struct proc *newproc;
+	pid_t pid;
+	int status, result;
+
+	result = proc_fork(&newproc);
+	if (result) {
+		return result;
+	}
+	pid = newproc->p_pid;
+	result = thread_fork("kmembench", newproc, kmembenchchild, NULL, 0);
+	if (result) {
+		proc_unfork(newproc);
+		return result;
+	}
+	return pid_wait(pid, &status, 0, NULL);
+}
+
+static
+int
+kmembench_open(const char *path)
+{
+	struct openfile *file;
+	char *name;
+	int result;
+
+	/* openfile_open destroys the name */
+	name = kstrdup(path);
+	if (name == NULL) {
+		return ENOMEM;
+	}
+	result = openfile_open(name, O_RDONLY, 0, &file);
+	kfree(name);
+	if (result) {
+		return result;
+	}
+	openfile_decref(file);
+	return 0;
+}
+
+static
+void
+kmembench_report(const char *what, struct timespec *before,
+		 unsigned mallocs0, unsigned kmems0, unsigned hits0)
+{
+	struct timespec after;
+	uint64_t nsecs;
+	unsigned mallocs, frees, kmems, hits;
+
+	gettime(&after);
+	kheap_counts(&mallocs, &frees);
+	kmem_counts(&kmems, &hits);
+
+	timespec_sub(&after, before, &after);
+	nsecs = (uint64_t)after.tv_sec * 1000000000 + after.tv_nsec;
+
+	kmems -= kmems0;
+	hits -= hits0;
+	kprintf("%s: %u ns/op, %u.%02u kmalloc calls/op, "
+		"%u%% object cache hits\n", what,
+		(unsigned)(nsecs / KM6_NOPS),
+		(mallocs - mallocs0) / KM6_NOPS,
+		(mallocs - mallocs0) % KM6_NOPS * 100 / KM6_NOPS,
+		kmems == 0 ? 0 : (unsigned)((uint64_t)hits * 100 / kmems));
+}
+
+int
+kmembench(int nargs, char **args)
+{
+	const char *path;
+	struct timespec before;
+	unsigned mallocs, frees, kmems, hits;
+	unsigned i;
+	int result;
+
+	path = nargs > 1 ? args[1] : "con:";
+
+	kprintf("Starting object cache benchmark...\n");
+
+	/* Warm up the caches so the first pass doesn't count */
+	result = kmembench_fork();
+	if (result == 0) {
+		result = kmembench_open(path);
+	}
+	if (result) {
+		kprintf("kmembench: %s\n", strerror(result));
+		return result;
+	}
+
+	gettime(&before);
+	kheap_counts(&mallocs, &frees);
+	kmem_counts(&kmems, &hits);
+	for (i=0; i<KM6_NOPS; i++) {
+		result = kmembench_fork();
+		if (result) {
+			kprintf("kmembench: fork: %s\n", strerror(result));
+			return result;
+		}
+	}
+	kmembench_report("fork/exit/wait", &before, mallocs, kmems, hits);
+
+	gettime(&before);
+	kheap_counts(&mallocs, &frees);
+	kmem_counts(&kmems, &hits);
+	for (i=0; i<KM6_NOPS; i++) {
+		result = kmembench_open(path);
+		if (result) {
+			kprintf("kmembench: open %s: %s\n", path,
+				strerror(result));
+			return result;
+		}
+	}
+	kmembench_report("open/close", &before, mallocs, kmems, hits);
+
+	kmem_printstats();
+	kprintf("Object cache benchmark done\n");
+	return 0;
+}
+
+////////////////////////////////////////////////////////////
+// km7
+
+/*
+ * Hold KM7_NOBJS small objects live at once, spread over KM7_NTHREADS
+ * threads, the way a busy system holds thousands of vnodes, pids, and
+ * open files. Then check and free them all. The subpage allocator's
+ * bookkeeping (pageref pages) should grow to cover the heap and
+ * shrink back afterwards.
+ *
+ * Each thread chains its objects together through their first word,
+ * so no other memory is needed to keep track of them.
+ */
+
+#define KM7_NOBJS    100000
+#define KM7_NTHREADS 4
+
+static const size_t km7_sizes[] = { 16, 24, 32, 48, 64 };
+
+struct km7obj {
+	struct km7obj *next;
+	uint32_t check;
+};
+
+static struct semaphore *km7_built;
+static struct semaphore *km7_go;
+static volatile unsigned km7_failed;
+
+static
+uint32_t
+km7_check(unsigned long num, unsigned i)
+{
+	return (uint32_t)num << 24 ^ i ^ 0xc0ffee;
+}
+
+static
+void
+km7thread(void *sm, unsigned long num)
+{
+	struct semaphore *done = sm;
+	struct km7obj *head = NULL, *obj;
+	unsigned i, n;
+
+	n = KM7_NOBJS / KM7_NTHREADS;
+	for (i=0; i<n; i++) {
+		obj = kmalloc(km7_sizes[(i + num) % ARRAYCOUNT(km7_sizes)]);
+		if (obj == NULL) {
+			kprintf("km7: thread %lu: kmalloc failed after %u "
+				"objects\n", num, i);
+			km7_failed++;
+			break;
+		}
+		obj->next = head;
+		obj->check = km7_check(num, i);
+		head = obj;
+	}
+	n = i;
+
+	V(km7_built);
+	P(km7_go);
+
+	/* They come off the chain in reverse order */
+	while (head != NULL) {
+		obj = head;
+		head = obj->next;
+		n--;
+		if (obj->check != km7_check(num, n)) {
+			panic("km7: thread %lu: object %u is corrupt\n",
+			      num, n);
+		}
+		kfree(obj);
+	}
+	KASSERT(n == 0);
+
+	V(done);
+}
+
+int
+kmallocstress100k(int nargs, char **args)
+{
+	struct semaphore *done;
+	unsigned npages, ninuse;
+	unsigned i;
+	int result;
+
+	(void)nargs;
+	(void)args;
+
+	kprintf("Starting 100k live object test...\n");
+
+	km7_built = sem_create("km7_built", 0);
+	km7_go = sem_create("km7_go", 0);
+	done = sem_create("km7_done", 0);
+	if (km7_built == NULL || km7_go == NULL || done == NULL) {
+		panic("km7: sem_create failed\n");
+	}
+	km7_failed = 0;
+
+	kheap_pagerefs(&npages, &ninuse);
+	kprintf("Before: %u pageref pages, %u heap pages\n", npages, ninuse);
+
+	for (i=0; i<KM7_NTHREADS; i++) {
+		result = thread_fork("km7", NULL, km7thread, done, i);
+		if (result) {
+			panic("km7: thread_fork failed: %s\n",
+			      strerror(result));
+		}
+	}
+	for (i=0; i<KM7_NTHREADS; i++) {
+		P(km7_built);
+	}
+
+	kheap_pagerefs(&npages, &ninuse);
+	kprintf("Holding %s%u objects: %u pageref pages, %u heap pages\n",
+		km7_failed ? "fewer than " : "", KM7_NOBJS, npages, ninuse);
+
+	for (i=0; i<KM7_NTHREADS; i++) {
+		V(km7_go);
+	}
+	for (i=0; i<KM7_NTHREADS; i++) {
+		P(done);
+	}
+
+	kheap_pagerefs(&npages, &ninuse);
+	kprintf("After: %u pageref pages, %u heap pages\n", npages, ninuse);
+
+	sem_destroy(km7_built);
+	sem_destroy(km7_go);
+	sem_destroy(done);
+
+	if (km7_failed) {
+		kprintf("100k live object test failed\n");
+		return ENOMEM;
+	}
+	kprintf("100k live object test done\n");
+	return 0;
+}
@@ -0,0 +1,199 @@
+/*
+ * Copyright (c) 2000, 2001, 2002, 2003, 2004, 2005, 2008, 2009
+ *	The President and Fellows of Harvard College.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE UNIVERSITY AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE UNIVERSITY OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * Stress test for page faults taken by several threads of the same
+ * process at once.
+ */
+#include <types.h>
+#include <kern/errno.h>
+#include <lib.h>
+#include <clock.h>
+#include <thread.h>
+#include <synch.h>
+#include <proc.h>
+#include <current.h>
+#include <addrspace.h>
+#include <copyinout.h>
+#include <vm.h>
+#include <kern/vmstat.h>
+#include <test.h>
+
+////////////////////////////////////////////////////////////
+// vm1
+
+/*
+ * VF_NTHREADS threads share one address space with a single writable
+ * region of vf_npages pages. In each round every thread writes a word
+ * of its own into every page, starting at a different page each time
+ * so the threads fault on different pages as well as on the same
+ * ones, and then reads them all back. The first round takes every
+ * kind of fault at once: zero-fill, copy-on-write of the zero page,
+ * and TLB misses; later rounds page out and in if memory is short.
+ */
+
+#define VF_NTHREADS	8
+#define VF_NROUNDS	4
+#define VF_NPAGES	256
+#define VF_BASE		0x10000000
+
+static unsigned vf_npages;
+static volatile unsigned vf_errors[VF_NTHREADS];
+static struct semaphore *vf_donesem;
+
+static
+uint32_t
+vf_value(unsigned round, unsigned page, unsigned t)
+{
+	return ((round + 1) << 24) | ((page & 0xffff) << 8) | t;
+}
+
+static
+void
+vf_thread(void *junk, unsigned long t)
+{
+	userptr_t addr;
+	uint32_t val;
+	unsigned r, i, p;
+
+	(void)junk;
+
+	for (r=0; r<VF_NROUNDS; r++) {
+		for (i=0; i<vf_npages; i++) {
+			p = (i + t * (r + 1) * vf_npages / VF_NTHREADS) %
+				vf_npages;
+			addr = (userptr_t)(VF_BASE + p * PAGE_SIZE +
+					   t * sizeof(uint32_t));
+			val = vf_value(r, p, t);
+			if (copyout(&val, addr, sizeof(val))) {
+				vf_errors[t]++;
+			}
+		}
+		for (p=0; p<vf_npages; p++) {
+			addr = (userptr_t)(VF_BASE + p * PAGE_SIZE +
+					   t * sizeof(uint32_t));
+			if (copyin((const_userptr_t)addr, &val, sizeof(val)) ||
+			    val != vf_value(r, p, t)) {
+				vf_errors[t]++;
+			}
+		}
+	}
+
+	/* Go back to the kernel process so thread_exit is happy */
+	proc_remthread(curthread);
+	proc_addthread(kproc, curthread);
+
+	V(vf_donesem);
+}
+
+int
+vmfaultstress(int nargs, char **args)
+{
+	struct proc *proc;
+	struct addrspace *as;
+	struct vmstat vs;
+	struct timespec before, after;
+	unsigned i, errors;
+	int result;
+
+	vf_npages = VF_NPAGES;
+	if (nargs > 1) {
+		vf_npages = atoi(args[1]);
+	}
+	if (vf_npages == 0) {
+		kprintf("Usage: vm1 [npages]\n");
+		return EINVAL;
+	}
+
+	if (vf_donesem == NULL) {
+		vf_donesem = sem_create("vf_donesem", 0);
+		if (vf_donesem == NULL) {
+			panic("vm1: sem_create failed\n");
+		}
+	}
+
+	result = proc_create_runprogram("vm1", &proc);
+	if (result) {
+		return result;
+	}
+	as = as_create();
+	if (as == NULL) {
+		proc_unfork(proc);
+		return ENOMEM;
+	}
+	proc->p_addrspace = as;
+	result = as_define_region(as, VF_BASE, vf_npages * PAGE_SIZE,
+				  1, 1, 0);
+	if (result) {
+		proc_unfork(proc);
+		return result;
+	}
+
+	kprintf("Starting parallel fault stress: %u threads, %u pages...\n",
+		VF_NTHREADS, vf_npages);
+
+	gettime(&before);
+	for (i=0; i<VF_NTHREADS; i++) {
+		vf_errors[i] = 0;
+		result = thread_fork("vm1", proc, vf_thread, NULL, i);
+		if (result) {
+			panic("vm1: thread_fork failed: %s\n",
+			      strerror(result));
+		}
+	}
+	for (i=0; i<VF_NTHREADS; i++) {
+		P(vf_donesem);
+	}
+	gettime(&after);
+	timespec_sub(&after, &before, &after);
+
+	errors = 0;
+	for (i=0; i<VF_NTHREADS; i++) {
+		errors += vf_errors[i];
+	}
+	vm_getstats(as, &vs);
+
+	kprintf("Elapsed: %llu.%09lu seconds\n",
+		(unsigned long long)after.tv_sec,
+		(unsigned long)after.tv_nsec);
+	kprintf("Faults: %u read, %u write, %u read-only; %u zero-filled\n",
+		vs.vs_readfaults, vs.vs_writefaults, vs.vs_readonlyfaults,
+		vs.vs_zerofills);
+
+	/* Frees the pid and the address space */
+	proc_unfork(proc);
+
+	if (errors > 0) {
+		kprintf("vm1: %u errors\n", errors);
+		kprintf("Parallel fault stress FAILED\n");
+		return EFAULT;
+	}
+	kprintf("Parallel fault stress done\n");
+	return 0;
+}
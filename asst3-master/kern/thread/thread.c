@@ -49,6 +49,7 @@
 #include <proc.h>
 #include <current.h>
 #include <synch.h>
+#include <kmem.h>
 #include <addrspace.h>
 #include <mainbus.h>
 #include <vnode.h>
@@ -72,6 +73,34 @@ static struct cpuarray allcpus;
 /* Used to wait for secondary CPUs to come online. */
 static struct semaphore *cpu_startup_sem;
 
+/*
+ * Thread structures come from an object cache. A thread given back to
+ * the cache keeps its stack, if it had one, so most forks don't need
+ * to allocate one.
+ */
+static struct kmem_cache *thread_cache;
+
+static
+int
+thread_ctor(void *obj)
+{
+	struct thread *thread = obj;
+
+	thread->t_stack = NULL;
+	return 0;
+}
+
+static
+void
+thread_dtor(void *obj)
+{
+	struct thread *thread = obj;
+
+	if (thread->t_stack != NULL) {
+		kfree(thread->t_stack);
+	}
+}
+
 ////////////////////////////////////////////////////////////
 
 /*
@@ -123,14 +152,14 @@ thread_create(const char *name)
 
 	DEBUGASSERT(name != NULL);
 
-	thread = kmalloc(sizeof(*thread));
+	thread = kmem_cache_alloc(thread_cache);
 	if (thread == NULL) {
 		return NULL;
 	}
 
 	thread->t_name = kstrdup(name);
 	if (thread->t_name == NULL) {
-		kfree(thread);
+		kmem_cache_free(thread_cache, thread);
 		return NULL;
 	}
 	thread->t_wchan_name = "NEW";
@@ -139,7 +168,7 @@ thread_create(const char *name)
 	/* Thread subsystem fields */
 	thread_machdep_init(&thread->t_machdep);
 	threadlistnode_init(&thread->t_listnode, thread);
-	thread->t_stack = NULL;
+	/* t_stack is kept by the cache */
 	thread->t_context = NULL;
 	thread->t_cpu = NULL;
 	thread->t_proc = NULL;
@@ -189,6 +218,10 @@ cpu_create(unsigned hardware_number)
 
 	c->c_ipi_pending = 0;
 	c->c_numshootdown = 0;
+	c->c_shootdown_wchan = wchan_create("shootdown");
+	if (c->c_shootdown_wchan == NULL) {
+		panic("cpu_create: Out of memory\n");
+	}
 	spinlock_init(&c->c_ipi_lock);
 
 	result = cpuarray_add(&allcpus, c, &c->c_number);
@@ -211,9 +244,12 @@ cpu_create(unsigned hardware_number)
 		 * make it possible to free the boot stack?)
 		 */
 		/*c->c_curthread->t_stack = ... */
+		KASSERT(c->c_curthread->t_stack == NULL);
 	}
 	else {
-		c->c_curthread->t_stack = kmalloc(STACK_SIZE);
+		if (c->c_curthread->t_stack == NULL) {
+			c->c_curthread->t_stack = kmalloc(STACK_SIZE);
+		}
 		if (c->c_curthread->t_stack == NULL) {
 			panic("cpu_create: couldn't allocate stack");
 		}
@@ -275,11 +311,8 @@ thread_destroy(struct thread *thread)
 	 * either here or in thread_exit(). (And not both...)
 	 */
 
-	/* Thread subsystem fields */
+	/* Thread subsystem fields; the cache keeps the stack */
 	KASSERT(thread->t_proc == NULL);
-	if (thread->t_stack != NULL) {
-		kfree(thread->t_stack);
-	}
 	threadlistnode_cleanup(&thread->t_listnode);
 	thread_machdep_cleanup(&thread->t_machdep);
 
@@ -287,7 +320,7 @@ thread_destroy(struct thread *thread)
 	thread->t_wchan_name = "DESTROYED";
 
 	kfree(thread->t_name);
-	kfree(thread);
+	kmem_cache_free(thread_cache, thread);
 }
 
 /*
@@ -376,6 +409,12 @@ thread_bootstrap(void)
 {
 	cpuarray_init(&allcpus);
 
+	thread_cache = kmem_cache_create("thread", sizeof(struct thread),
+					 thread_ctor, thread_dtor);
+	if (thread_cache == NULL) {
+		panic("thread_bootstrap: Out of memory\n");
+	}
+
 	/*
 	 * Create the cpu structure for the bootup CPU, the one we're
 	 * currently running on. Assume the hardware number is 0; that
@@ -508,11 +547,13 @@ thread_fork(const char *name,
 		return ENOMEM;
 	}
 
-	/* Allocate a stack */
-	newthread->t_stack = kmalloc(STACK_SIZE);
+	/* Allocate a stack, unless the cache kept one */
 	if (newthread->t_stack == NULL) {
-		thread_destroy(newthread);
-		return ENOMEM;
+		newthread->t_stack = kmalloc(STACK_SIZE);
+		if (newthread->t_stack == NULL) {
+			thread_destroy(newthread);
+			return ENOMEM;
+		}
 	}
 	thread_checkstack_init(newthread);
 
@@ -1116,6 +1157,16 @@ ipi_send(struct cpu *target, int code)
 	spinlock_release(&target->c_ipi_lock);
 }
 
+/*
+ * Look up a CPU by its number (c_number).
+ */
+struct cpu *
+cpu_get(unsigned number)
+{
+	KASSERT(number < cpuarray_num(&allcpus));
+	return cpuarray_get(&allcpus, number);
+}
+
 /*
  * Send an IPI to all CPUs.
  */
@@ -1134,7 +1185,9 @@ ipi_broadcast(int code)
 }
 
 /*
- * Send a TLB shootdown IPI to the specified CPU.
+ * Send a TLB shootdown IPI to the specified CPU. If its queue is
+ * full, wait until it has worked through it; so this may sleep, and
+ * must not be called from an interrupt handler or with spinlocks held.
  */
 void
 ipi_tlbshootdown(struct cpu *target, const struct tlbshootdown *mapping)
@@ -1143,23 +1196,13 @@ ipi_tlbshootdown(struct cpu *target, const struct tlbshootdown *mapping)
 
 	spinlock_acquire(&target->c_ipi_lock);
 
-	n = target->c_numshootdown;
-	if (n == TLBSHOOTDOWN_MAX) {
-		/*
-		 * If you have problems with this panic going off,
-		 * consider: (1) increasing the maximum, (2) putting
-		 * logic here to sleep until space appears (may
-		 * interact awkwardly with VM system locking), (3)
-		 * putting logic here to coalesce requests together,
-		 * and/or (4) improving VM system state tracking to
-		 * reduce the number of unnecessary shootdowns.
-		 */
-		panic("ipi_tlbshootdown: Too many shootdowns queued\n");
-	}
-	else {
-		target->c_shootdown[n] = *mapping;
-		target->c_numshootdown = n+1;
+	while (target->c_numshootdown == TLBSHOOTDOWN_MAX) {
+		/* The IPI that empties it is already on its way */
+		wchan_sleep(target->c_shootdown_wchan, &target->c_ipi_lock);
 	}
+	n = target->c_numshootdown;
+	target->c_shootdown[n] = *mapping;
+	target->c_numshootdown = n+1;
 
 	target->c_ipi_pending |= (uint32_t)1 << IPI_TLBSHOOTDOWN;
 	mainbus_send_ipi(target);
@@ -1211,6 +1254,10 @@ interprocessor_interrupt(void)
 		for (i=0; i<curcpu->c_numshootdown; i++) {
 			vm_tlbshootdown(&curcpu->c_shootdown[i]);
 		}
+		if (curcpu->c_numshootdown == TLBSHOOTDOWN_MAX) {
+			wchan_wakeall(curcpu->c_shootdown_wchan,
+				      &curcpu->c_ipi_lock);
+		}
 		curcpu->c_numshootdown = 0;
 	}
 
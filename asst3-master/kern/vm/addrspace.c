@@ -27,16 +27,29 @@
  * SUCH DAMAGE.
  */
 
+#define REGIONINLINE
+
 #include <types.h>
 #include <kern/errno.h>
+#include <kern/stat.h>
 #include <lib.h>
 #include <spl.h>
 #include <spinlock.h>
+#include <synch.h>
+#include <kmem.h>
 #include <current.h>
+#include <thread.h>
+#include <clock.h>
 #include <mips/tlb.h>
+#include <mips/trapframe.h>
+#include <cpu.h>
 #include <addrspace.h>
 #include <vm.h>
 #include <proc.h>
+#include <vnode.h>
+#include <swap.h>
+#include <pagecache.h>
+#include <pagetable.h>
 
 /*
  * Note! If OPT_DUMBVM is set, as is the case until you start the VM
@@ -48,6 +61,236 @@
  *
  */
 
+/*
+ * Address space IDs.
+ *
+ * TLB entries are tagged with the ASID of their address space, so a
+ * context switch only has to change the current ASID rather than
+ * flush the TLB, and a process switched back in finds its entries
+ * still there.
+ *
+ * Each cpu hands out ASIDs 1..NUM_ASIDS-1 in turn to the address
+ * spaces activated on it. When it runs out it flushes its TLB and
+ * starts a new generation, handing them out from 1 again. Each
+ * address space remembers the ASID it got on each cpu tagged with
+ * the generation, so ASIDs from an old generation are just stale.
+ * ASID 0 is never handed out; it is current while no address space
+ * is active, so no user translation matches.
+ *
+ * To forget an address space's TLB entries on a cpu, drop its ASID
+ * there: nobody gets that ASID again until the next generation, which
+ * starts with a flush.
+ *
+ * TLB shootdown: when a translation changes, every cpu that may hold
+ * the old one must drop it before the page it mapped is reused. A cpu
+ * that has the address space's ASID but isn't running it just has the
+ * ASID dropped. Only cpus actually running the address space are sent
+ * an IPI (see as_tlb_shootdown), and the sender waits until they have
+ * all done it. Several pages go in one request; past TLB_PROBE_MAX
+ * pages the target drops the whole ASID rather than probing for each.
+ *
+ * as_asid[] of every address space, the generation counts and
+ * cpu_curas[] (the address space whose ASID each cpu has loaded) are
+ * protected by asid_lock. A cpu may read its own slots with just
+ * interrupts off: another cpu can only drop an ASID, which at worst
+ * makes a probe miss an entry that nothing can match any more.
+ */
+#define ASID_TAG(gen, asid)  (((gen) << TLBHI_PIDSHIFT) | (asid))
+#define ASID_TAG_GEN(tag)    ((tag) >> TLBHI_PIDSHIFT)
+#define ASID_TAG_ASID(tag)   ((tag) & (NUM_ASIDS - 1))
+
+#define TLB_PROBE_MAX        16
+
+static uint32_t asid_generation[MAXCPUS];
+static uint32_t asid_used[MAXCPUS];
+static struct addrspace *cpu_curas[MAXCPUS];
+static struct spinlock asid_lock = SPINLOCK_INITIALIZER;
+
+/*
+ * Invalidate every entry in this CPU's TLB.
+ */
+static
+void
+tlb_flush_all(void)
+{
+	/* Disable interrupts on this CPU while frobbing the TLB. */
+	int spl = splhigh();
+	for (int i = 0; i < NUM_TLB; i++) {
+		tlb_write(TLBHI_INVALID(i), TLBLO_INVALID(), i);
+	}
+	splx(spl);
+}
+
+/*
+ * Return AS's ASID on this cpu, or 0 if it has none in the current
+ * generation.
+ */
+static
+uint32_t
+as_getasid(struct addrspace *as)
+{
+	unsigned c = curcpu->c_number;
+	uint32_t tag = as->as_asid[c];
+
+	if (ASID_TAG_GEN(tag) != asid_generation[c]) {
+		return 0;
+	}
+	return ASID_TAG_ASID(tag);
+}
+
+uint32_t
+as_tlbhi(struct addrspace *as, vaddr_t vaddr)
+{
+	uint32_t asid = as_getasid(as);
+
+	if (asid == 0) {
+		return 0;
+	}
+	return (vaddr & TLBHI_VPAGE) | (asid << TLBHI_PIDSHIFT);
+}
+
+/*
+ * Give AS a fresh ASID on this cpu and load it, starting a new
+ * generation if need be. Called with asid_lock held.
+ */
+static
+uint32_t
+as_newasid(struct addrspace *as)
+{
+	unsigned c = curcpu->c_number;
+	uint32_t asid;
+
+	KASSERT(spinlock_do_i_hold(&asid_lock));
+
+	if (asid_used[c] == NUM_ASIDS - 1) {
+		/* Out of ASIDs: start a new generation */
+		tlb_flush_all();
+		vm_stats.vs_tlbflushes++;
+		asid_generation[c]++;
+		asid_used[c] = 0;
+	}
+	asid = ++asid_used[c];
+	as->as_asid[c] = ASID_TAG(asid_generation[c], asid);
+	return asid;
+}
+
+/*
+ * Drop this cpu's TLB entries for NPAGES pages of AS from VADDR, or
+ * all of them if NPAGES is 0. Called with asid_lock held.
+ */
+static
+void
+as_tlb_local(struct addrspace *as, vaddr_t vaddr, unsigned npages)
+{
+	unsigned c = curcpu->c_number;
+	uint32_t ehi;
+	int idx;
+
+	KASSERT(spinlock_do_i_hold(&asid_lock));
+
+	if (npages == 0 || npages > TLB_PROBE_MAX) {
+		as->as_asid[c] = 0;
+		if (cpu_curas[c] == as) {
+			tlb_setasid(as_newasid(as));
+		}
+		return;
+	}
+
+	for (; npages > 0; npages--, vaddr += PAGE_SIZE) {
+		ehi = as_tlbhi(as, vaddr);
+		if (ehi == 0) {
+			return;
+		}
+		idx = tlb_probe(ehi, 0);
+		if (idx >= 0) {
+			tlb_write(TLBHI_INVALID(idx), TLBLO_INVALID(), idx);
+		}
+	}
+}
+
+void
+as_tlb_shootdown(struct addrspace *as, vaddr_t vaddr, unsigned npages)
+{
+	struct tlbshootdown ts;
+	volatile unsigned pending;
+	uint32_t targets;
+	struct timespec before, after;
+	unsigned c, me;
+
+	/* We wait for other cpus' interrupt handlers */
+	KASSERT(curthread->t_curspl == 0);
+	KASSERT(curthread->t_iplhigh_count == 0);
+
+	spinlock_acquire(&asid_lock);
+	me = curcpu->c_number;
+	as_tlb_local(as, vaddr, npages);
+	targets = 0;
+	pending = 0;
+	for (c = 0; c < MAXCPUS; c++) {
+		if (c == me || as->as_asid[c] == 0) {
+			continue;
+		}
+		if (cpu_curas[c] == as) {
+			targets |= (uint32_t)1 << c;
+			pending++;
+		}
+		else {
+			as->as_asid[c] = 0;
+		}
+	}
+	spinlock_release(&asid_lock);
+
+	if (pending == 0) {
+		return;
+	}
+
+	ts.ts_as = as;
+	ts.ts_vaddr = vaddr;
+	ts.ts_npages = npages;
+	ts.ts_pending = &pending;
+
+	gettime(&before);
+	for (c = 0; c < MAXCPUS; c++) {
+		if (targets & ((uint32_t)1 << c)) {
+			ipi_tlbshootdown(cpu_get(c), &ts);
+			VM_STAT(as, vs_shootdowns);
+		}
+	}
+	while (pending > 0) {
+		/* Interrupts are on, so shootdowns sent to us still run */
+	}
+	gettime(&after);
+
+	timespec_sub(&after, &before, &after);
+	vm_stats.vs_shootdownusec += after.tv_sec * 1000000 +
+		after.tv_nsec / 1000;
+}
+
+void
+as_tlbshootdown(const struct tlbshootdown *ts)
+{
+	spinlock_acquire(&asid_lock);
+	as_tlb_local(ts->ts_as, ts->ts_vaddr, ts->ts_npages);
+	KASSERT(*ts->ts_pending > 0);
+	(*ts->ts_pending)--;
+	spinlock_release(&asid_lock);
+}
+
+/*
+ * Regions come from their own object cache.
+ */
+static struct kmem_cache *region_cache;
+
+void
+as_bootstrap(void)
+{
+	region_cache = kmem_cache_create("region", sizeof(struct region),
+					 NULL, NULL);
+	if (region_cache == NULL) {
+		panic("as_bootstrap: Out of memory\n");
+	}
+}
+
 struct addrspace *
 as_create(void)
 {
@@ -59,24 +302,153 @@ as_create(void)
 		return NULL;
 	}
 
-	/* Allocate level one PT */
-	as->page_table = (paddr_t **) alloc_kpages(1);
-	if (as->page_table == NULL) {
+	as->as_lock = rwlock_create("addrspace");
+	if (as->as_lock == NULL) {
 		kfree(as);
 		return NULL;
 	}
+	spinlock_init(&as->as_ptlock);
 
-	/* Initialise entries to NULL */
-	for (int pt1 = 0; pt1 < PAGE_TABLE_SIZE; pt1++) {
-		as->page_table[pt1] = NULL;
+	/* Empty page table */
+	if (pt_create(as)) {
+		spinlock_cleanup(&as->as_ptlock);
+		rwlock_destroy(as->as_lock);
+		kfree(as);
+		return NULL;
 	}
 
 	/* No regions when created */
-	as->first_region = NULL;
+	regionarray_init(&as->as_regions);
+	as->as_lastregion = NULL;
+	as->as_heap = NULL;
+	as->as_heapend = 0;
+	bzero(&as->as_stats, sizeof(as->as_stats));
+
+	/* No ASIDs until activated */
+	for (int c = 0; c < MAXCPUS; c++) {
+		as->as_asid[c] = 0;
+	}
 
 	return as;
 }
 
+/*
+ * Release whatever the page table entry PTE of AS holds: a swap slot,
+ * or a reference to a frame. Called with the paging lock held.
+ */
+static
+void
+as_free_pte(struct addrspace *as, paddr_t pte)
+{
+	if (pte & PTE_SWAPPED) {
+		swap_free(PTE_SWAPSLOT(pte));
+		return;
+	}
+	if (pte == 0) {
+		return;
+	}
+	vm_stat_rss(as, -1);
+	if (!vm_pte_iszero(pte)) {
+		free_kpages(PADDR_TO_KVADDR(pte & PAGE_FRAME));
+		VM_STAT(as, vs_framefree);
+	}
+}
+
+/*
+ * Throw away NPAGES pages of AS starting at VADDR. Called with as_lock
+ * held for writing and the paging lock held.
+ */
+static
+void
+as_unmap(struct addrspace *as, vaddr_t vaddr, size_t npages)
+{
+	paddr_t *ptep, old[TLB_PROBE_MAX];
+	unsigned n, i;
+	bool mapped;
+
+	while (npages > 0) {
+		/*
+		 * Unmap a batch of pages, shoot them all down at once,
+		 * and only then free what they held.
+		 */
+		n = npages < TLB_PROBE_MAX ? npages : TLB_PROBE_MAX;
+		mapped = false;
+		for (i = 0; i < n; i++) {
+			old[i] = 0;
+			ptep = pt_lookup(as, vaddr + i * PAGE_SIZE);
+			if (ptep != NULL) {
+				old[i] = *ptep;
+				pt_remove(as, vaddr + i * PAGE_SIZE);
+				mapped = mapped || (old[i] & TLBLO_VALID);
+			}
+		}
+		if (mapped) {
+			as_tlb_shootdown(as, vaddr, n);
+		}
+		for (i = 0; i < n; i++) {
+			as_free_pte(as, old[i]);
+		}
+		vaddr += n * PAGE_SIZE;
+		npages -= n;
+	}
+}
+
+/*
+ * pt_foreach() callback for as_copy: copy the PTE at VA of OLD into the
+ * address space NEWAS. Frames are shared, not copied: both address
+ * spaces map them read-only and vm_fault() gives each writer its own
+ * copy on the first write (copy-on-write). Pages out on swap get their
+ * own swap slot.
+ */
+static
+int
+as_copy_pte(struct addrspace *old, vaddr_t va, paddr_t *oldpte, void *newas)
+{
+	struct addrspace *new = newas;
+	paddr_t *newpte, pte;
+	unsigned slot;
+	int result;
+
+	/* This may page out, so look at the old PTE only afterwards */
+	result = pt_reserve(new, va);
+	if (result) {
+		return result;
+	}
+
+	pte = *oldpte;
+	if (pte & PTE_SWAPPED) {
+		result = swap_copy(PTE_SWAPSLOT(pte), &slot);
+		if (result) {
+			return result;
+		}
+		pte = PTE_MKSWAP(slot);
+	} else if (vm_pte_iszero(pte)) {
+		/* Already read-only, and not counted */
+	} else {
+		/*
+		 * Share the frame, write-protected in both. Sharing
+		 * clears the frame's owner, so also make the next TLB
+		 * miss in each go through vm_fault(), which sets the
+		 * owner again once the frame is no longer shared; the
+		 * refill handler would not.
+		 */
+		share_kpage(PADDR_TO_KVADDR(pte & PAGE_FRAME));
+		spinlock_acquire(&old->as_ptlock);
+		*oldpte &= ~(TLBLO_DIRTY | PTE_REFERENCED);
+		spinlock_release(&old->as_ptlock);
+		pte &= ~(TLBLO_DIRTY | PTE_REFERENCED);
+	}
+
+	spinlock_acquire(&new->as_ptlock);
+	newpte = pt_alloc(new, va);
+	*newpte = pte;
+	spinlock_release(&new->as_ptlock);
+	if (pte & TLBLO_VALID) {
+		vm_stat_rss(new, 1);
+	}
+	return 0;
+}
+
 int
 as_copy(struct addrspace *old, struct addrspace **ret)
 {
@@ -90,76 +462,65 @@ as_copy(struct addrspace *old, struct addrspace **ret)
 	if (new == NULL) {
 		return ENOMEM;
 	}
+
+	/* Other threads of the parent wait until we're done */
+	rwlock_acquire_write(old->as_lock);
+
 	/****************************************************/
-	/* Copy in regions */
-	struct region *old_region;
-	struct region *new_region = new->first_region;
-	for (old_region = old->first_region; old_region != NULL; old_region = old_region->next) {
+	/* Copy in regions; they are already sorted */
+	unsigned num = regionarray_num(&old->as_regions);
+	for (unsigned i = 0; i < num; i++) {
+		struct region *old_region = regionarray_get(&old->as_regions, i);
+
 		/* Allocate region for new as */
-		struct region *reg = (struct region *) kmalloc(sizeof(struct region));
+		struct region *reg = kmem_cache_alloc(region_cache);
 		if (reg == NULL) {
 			nomem = true;
 			break;
 		}
 
 		/* copy in data of old region to new region */
-		reg->vbase = old_region->vbase;
-		reg->npages = old_region->npages;
-		reg->w = old_region->w;
-		reg->w_reserve = old_region->w_reserve;
-		reg->next = NULL;
-
-		/* Link reg to list of regions */
-		if (new_region == NULL) {
-			new->first_region = reg;
-		} else {
-			new_region->next = reg;
-		}
+		*reg = *old_region;
 
-		/* Update new_region */
-		new_region = reg;
+		if (regionarray_add(&new->as_regions, reg, NULL)) {
+			kmem_cache_free(region_cache, reg);
+			nomem = true;
+			break;
+		}
+		if (old_region == old->as_heap) {
+			new->as_heap = reg;
+		}
+		if (reg->vn != NULL) {
+			VOP_INCREF(reg->vn);
+		}
 	}
 
+	new->as_heapend = old->as_heapend;
+
 	/* ENOMEM while copying regions */
 	if (nomem) {
+		rwlock_release_write(old->as_lock);
 		as_destroy(new);
 		return ENOMEM;
 	}
 
 	/****************************************************/
-	/* Copy in page table */
-	for (int pt1 = 0; pt1 < PAGE_TABLE_SIZE; pt1++) {
-		/* Allocate l1 page_table */
-		if (old->page_table[pt1] != NULL) {
-			new->page_table[pt1] = (paddr_t *) kmalloc(sizeof(paddr_t) * PAGE_TABLE_SIZE);
-			if (new->page_table[pt1] == NULL) {
-				nomem = true;
-				break; /* Break out of first loop */
-			}
-
-			for (int pt2 = 0; pt2 < PAGE_TABLE_SIZE; pt2++) {
-				/* Allocate l2 page_table */
-				if (old->page_table[pt1][pt2] != 0) {
-					vaddr_t frame = alloc_kpages(1);
-					if (frame == 0) {
-						nomem = true;
-						break; /* Break out of second loop */
-					}
-
-					/* Copy pte from old to frame */
-					memmove((void *)frame, (const void *) PADDR_TO_KVADDR(old->page_table[pt1][pt2] & PAGE_FRAME), PAGE_SIZE);
-					int dirty = old->page_table[pt1][pt2] & TLBLO_DIRTY;
-					new->page_table[pt1][pt2] = (KVADDR_TO_PADDR(frame) & PAGE_FRAME) | dirty | TLBLO_VALID;
-				} else {
-					new->page_table[pt1][pt2] = 0;
-				}
-			}
-
-			if (nomem) {
-				break; /* Break out of first loop */
-			}
-		}
+	/*
+	 * Copy in page table. Hold the paging lock so none of the
+	 * parent's pages are paged out while we're looking at them.
+	 */
+	swap_acquire();
+	if (pt_foreach(old, as_copy_pte, new)) {
+		nomem = true;
 	}
+	swap_release();
+
+	/*
+	 * The parent may still hold writable TLB entries for pages that
+	 * are now shared.
+	 */
+	as_tlb_shootdown(old, 0, 0);
+	rwlock_release_write(old->as_lock);
 
 	/* ENOMEM when copying pagetable */
 	if (nomem) {
@@ -172,35 +533,69 @@ as_copy(struct addrspace *old, struct addrspace **ret)
 	return 0;
 }
 
+/*
+ * pt_foreach() callback for as_destroy.
+ */
+static
+int
+as_destroy_pte(struct addrspace *as, vaddr_t va, paddr_t *pte, void *data)
+{
+	(void)va;
+	(void)data;
+
+	as_free_pte(as, *pte);
+	return 0;
+}
+
 void
 as_destroy(struct addrspace *as)
 {
-	/* Free regions */
-	struct region *curr, *prev;
-	curr = prev = as->first_region;
-	while (curr != NULL) {
-		curr = curr->next;
-		kfree(prev);
-		prev = curr;
-	}
-
-	/* Free ptes in page_table */
-	for (int pt1 = 0; pt1 < PAGE_TABLE_SIZE; pt1++) {
-		/* Check if pt1 has pages */
-		if (as->page_table[pt1] != NULL) {
-			for (int pt2 = 0; pt2 < PAGE_TABLE_SIZE; pt2++) {
-				/* Check if pt2 has pages */
-				if (as->page_table[pt1][pt2] != 0) {
-					free_kpages(PADDR_TO_KVADDR(as->page_table[pt1][pt2] & PAGE_FRAME));
-				}
-			}
+	/*
+	 * Free ptes in page_table. The paging lock keeps page-out away
+	 * from our frames while we free them.
+	 */
+	swap_acquire();
+
+	/* Anything still mapped from a file is unmapped now */
+	unsigned num = regionarray_num(&as->as_regions);
+	for (unsigned i = 0; i < num; i++) {
+		struct region *reg = regionarray_get(&as->as_regions, i);
+		if (reg->mmapped) {
+			(void)vm_msync(as, reg);
 		}
 	}
 
-	/* Free page_table */
-	kfree(as->page_table);
+	(void)pt_foreach(as, as_destroy_pte, NULL);
+	pt_destroy(as);
+
+	/*
+	 * Free regions, and any shared text pages nobody else is using
+	 * now that we are gone.
+	 */
+	for (unsigned i = 0; i < num; i++) {
+		struct region *reg = regionarray_get(&as->as_regions, i);
+		if (reg->vn != NULL) {
+			pagecache_purge(reg->vn);
+			VOP_DECREF(reg->vn);
+		}
+		kmem_cache_free(region_cache, reg);
+	}
+	regionarray_setsize(&as->as_regions, 0);
+	regionarray_cleanup(&as->as_regions);
+	swap_release();
+
+	/* A cpu we last ran on may not have switched away yet */
+	spinlock_acquire(&asid_lock);
+	for (unsigned c = 0; c < MAXCPUS; c++) {
+		if (cpu_curas[c] == as) {
+			cpu_curas[c] = NULL;
+		}
+	}
+	spinlock_release(&asid_lock);
 
 	/* Free addrspace */
+	spinlock_cleanup(&as->as_ptlock);
+	rwlock_destroy(as->as_lock);
 	kfree(as);
 }
 
@@ -208,44 +603,112 @@ void
 as_activate(void)
 {
 	struct addrspace *as;
+	unsigned c;
+	uint32_t asid;
 
 	as = proc_getas();
 	if (as == NULL) {
 		/*
 		 * Kernel thread without an address space; leave the
-		 * prior address space in place.
+		 * prior address space in place. But don't let the UTLB
+		 * refill handler load new translations from it. Nor
+		 * does it need shootdowns: nothing runs in it here.
 		 */
+		spinlock_acquire(&asid_lock);
+		cpupagetables[curcpu->c_number] = 0;
+		cpu_curas[curcpu->c_number] = NULL;
+		spinlock_release(&asid_lock);
 		return;
 	}
 
-	/* Disable interrupts on this CPU while frobbkubg the TLB. */
-	int spl = splhigh();
-	for (int i = 0; i < NUM_TLB; i++) {
-		tlb_write(TLBHI_INVALID(i), TLBLO_INVALID(), i);
+	spinlock_acquire(&asid_lock);
+	c = curcpu->c_number;
+
+	/*
+	 * If AS still has an ASID here, its TLB entries are still
+	 * good and there is nothing to flush.
+	 */
+	asid = as_getasid(as);
+	if (asid == 0) {
+		asid = as_newasid(as);
 	}
-	splx(spl);
+
+	tlb_setasid(asid);
+	cpupagetables[c] = pt_hwbase(as);
+	cpu_curas[c] = as;
+	spinlock_release(&asid_lock);
 }
 
 void
 as_deactivate(void)
 {
-	struct addrspace *as;
+	/*
+	 * Always stop the UTLB refill handler using the page table:
+	 * proc_destroy() clears the address space before calling us,
+	 * and is about to free it. Switching to ASID 0 hides its TLB
+	 * entries; they go away for good when this cpu next starts
+	 * a new ASID generation.
+	 */
+	spinlock_acquire(&asid_lock);
+	cpupagetables[curcpu->c_number] = 0;
+	cpu_curas[curcpu->c_number] = NULL;
+	tlb_setasid(0);
+	spinlock_release(&asid_lock);
+}
 
-	as = proc_getas();
-	if (as == NULL) {
-		/*
-		 * Kernel thread without an address space; leave the
-		 * prior address space in place.
-		 */
-		return;
+/*
+ * Index of the first region of AS whose base is above VADDR, that is,
+ * where a region starting at VADDR would be inserted.
+ */
+static
+unsigned
+as_region_index(struct addrspace *as, vaddr_t vaddr)
+{
+	unsigned lo, hi, mid;
+
+	lo = 0;
+	hi = regionarray_num(&as->as_regions);
+	while (lo < hi) {
+		mid = lo + (hi - lo) / 2;
+		if (regionarray_get(&as->as_regions, mid)->vbase <= vaddr) {
+			lo = mid + 1;
+		} else {
+			hi = mid;
+		}
 	}
+	return lo;
+}
 
-	/* Disable interrupts on this CPU while frobbkubg the TLB. */
-	int spl = splhigh();
-	for (int i = 0; i < NUM_TLB; i++) {
-		tlb_write(TLBHI_INVALID(i), TLBLO_INVALID(), i);
+/*
+ * Find the region containing VADDR. Faults tend to come in runs on
+ * the same region, so the last region found is checked first. Faults
+ * in several threads may update the hint at once, which is harmless:
+ * it is only ever set to a region of AS, and only cleared with as_lock
+ * held for writing.
+ */
+struct region *
+as_find_region(struct addrspace *as, vaddr_t vaddr)
+{
+	struct region *reg;
+	unsigned pos;
+
+	reg = as->as_lastregion;
+	if (reg != NULL && REGION_CONTAINS(reg, vaddr)) {
+		return reg;
 	}
-	splx(spl);
+
+	/* Only the region before the insertion point can contain vaddr */
+	pos = as_region_index(as, vaddr);
+	if (pos == 0) {
+		return NULL;
+	}
+	reg = regionarray_get(&as->as_regions, pos - 1);
+	if (!REGION_CONTAINS(reg, vaddr)) {
+		return NULL;
+	}
+
+	as->as_lastregion = reg;
+	return reg;
 }
 
 /*
@@ -267,12 +730,6 @@ as_define_region(struct addrspace *as, vaddr_t vaddr, size_t memsize,
         return ENOSYS;
 	}
 
-	/* Allocate new region */
-	struct region *new_region = (struct region *) kmalloc(sizeof(struct region));
-	if (new_region == NULL) {
-		return ENOMEM;
-	}
-
 	/* Align the region. First, the base... */
 	memsize += vaddr & ~(vaddr_t)PAGE_FRAME;
 	vaddr &= PAGE_FRAME;
@@ -281,6 +738,17 @@ as_define_region(struct addrspace *as, vaddr_t vaddr, size_t memsize,
 	memsize = (memsize + PAGE_SIZE - 1) & PAGE_FRAME;
 	size_t npages = memsize / PAGE_SIZE;
 
+	/* Must lie entirely in user space */
+	if (vaddr >= USERSPACETOP || memsize > USERSPACETOP - vaddr) {
+		return EFAULT;
+	}
+
+	/* Allocate new region */
+	struct region *new_region = kmem_cache_alloc(region_cache);
+	if (new_region == NULL) {
+		return ENOMEM;
+	}
+
 	/* Initialize new region */
 	new_region->vbase = vaddr;
 	new_region->npages = npages;
@@ -292,33 +760,80 @@ as_define_region(struct addrspace *as, vaddr_t vaddr, size_t memsize,
 	// if (executable)
 	// 	new_region->rwx |= RG_EXE_MASK;
 	new_region->w_reserve = new_region->w;
-    new_region->next = NULL;
+	new_region->vn = NULL;
+	new_region->file_offset = 0;
+	new_region->file_vaddr = 0;
+	new_region->file_size = 0;
+	new_region->mmapped = false;
 
-	/* Check if any region is associated with as */
-	if (as->first_region == NULL) {
-        as->first_region = new_region;
-        return 0;
-    }
+	/* Keep the array sorted, and refuse to overlap a neighbour */
+	unsigned num = regionarray_num(&as->as_regions);
+	unsigned pos = as_region_index(as, vaddr);
+	if (pos > 0) {
+		struct region *prev = regionarray_get(&as->as_regions, pos - 1);
+		if (prev->vbase + prev->npages * PAGE_SIZE > vaddr) {
+			kmem_cache_free(region_cache, new_region);
+			return EINVAL;
+		}
+	}
+	if (pos < num) {
+		struct region *next = regionarray_get(&as->as_regions, pos);
+		if (vaddr + memsize > next->vbase) {
+			kmem_cache_free(region_cache, new_region);
+			return EINVAL;
+		}
+	}
 
-	/* Connect region to as */
-	struct region* tmp_region = as->first_region;
-    while(tmp_region->next != NULL) {
-        tmp_region = tmp_region->next;
+	int result = regionarray_add(&as->as_regions, new_region, NULL);
+	if (result) {
+		kmem_cache_free(region_cache, new_region);
+		return result;
 	}
-    tmp_region->next = new_region;
+	for (unsigned i = num; i > pos; i--) {
+		regionarray_set(&as->as_regions, i,
+				regionarray_get(&as->as_regions, i - 1));
+	}
+	regionarray_set(&as->as_regions, pos, new_region);
 
 	(void) readable;
 	(void) executable;
     return 0;
 }
 
+/*
+ * Back the first FILESIZE bytes from VADDR, in the region containing
+ * VADDR, with the file V starting at OFFSET. Nothing is read now:
+ * vm_fault() reads each page in the first time it is touched.
+ */
+int
+as_define_file(struct addrspace *as, vaddr_t vaddr, size_t filesize,
+	       struct vnode *v, off_t offset)
+{
+	struct region *reg;
+
+	reg = as_find_region(as, vaddr);
+	if (reg == NULL || reg->vn != NULL ||
+	    vaddr + filesize > reg->vbase + reg->npages * PAGE_SIZE) {
+		return EINVAL;
+	}
+
+	VOP_INCREF(v);
+	reg->vn = v;
+	reg->file_offset = offset;
+	reg->file_vaddr = vaddr;
+	reg->file_size = filesize;
+
+	return 0;
+}
+
 /* Make READONLY regions READWRITE for loading purposes */
 int
 as_prepare_load(struct addrspace *as)
 {
 	/* Temporarily set all regions to writable */
-	struct region *cur_reg;
-	for (cur_reg = as->first_region; cur_reg != NULL; cur_reg = cur_reg->next) {
+	unsigned num = regionarray_num(&as->as_regions);
+	for (unsigned i = 0; i < num; i++) {
+		struct region *cur_reg = regionarray_get(&as->as_regions, i);
 		cur_reg->w = 1;
 	}
 	
@@ -330,17 +845,28 @@ int
 as_complete_load(struct addrspace *as)
 {
 	/* Store back rwx permissions */
-	struct region *cur_reg;
-	for (cur_reg = as->first_region; cur_reg != NULL; cur_reg = cur_reg->next) {
+	unsigned num = regionarray_num(&as->as_regions);
+	for (unsigned i = 0; i < num; i++) {
+		struct region *cur_reg = regionarray_get(&as->as_regions, i);
 		cur_reg->w = cur_reg->w_reserve;
 	}
 
-	/* Flush TLB */
-	int spl = splhigh();
-	for (int i = 0; i < NUM_TLB; i++) {
-		tlb_write(TLBHI_INVALID(i), TLBLO_INVALID(), i);
+	/* The heap starts out empty, right after the last segment */
+	if (num > 0) {
+		struct region *last = regionarray_get(&as->as_regions, num - 1);
+		vaddr_t heapbase = last->vbase + last->npages * PAGE_SIZE;
+		int result;
+
+		result = as_define_region(as, heapbase, 0, 1, 1, 0);
+		if (result) {
+			return result;
+		}
+		as->as_heap = regionarray_get(&as->as_regions, num);
+		as->as_heapend = heapbase;
 	}
-	splx(spl);
+
+	/* Flush TLB */
+	as_tlb_shootdown(as, 0, 0);
 	return 0;
 }
 
@@ -359,3 +885,198 @@ as_define_stack(struct addrspace *as, vaddr_t *stackptr)
 	return 0;
 }
 
+/*
+ * Move the end of the heap by AMOUNT bytes and hand back the old end.
+ * Growing just makes the heap region bigger, whatever the amount:
+ * vm_fault() fills in each page the first time it is touched.
+ * Shrinking frees the pages given back straight away.
+ */
+int
+as_sbrk(struct addrspace *as, intptr_t amount, vaddr_t *oldbreak)
+{
+	struct region *heap = as->as_heap;
+	vaddr_t newbreak;
+	size_t npages;
+	unsigned pos;
+
+	if (heap == NULL) {
+		return ENOMEM;
+	}
+
+	rwlock_acquire_write(as->as_lock);
+	if (amount < 0 && (vaddr_t) -amount > as->as_heapend - heap->vbase) {
+		rwlock_release_write(as->as_lock);
+		return EINVAL;
+	}
+	if (amount > 0 && (vaddr_t) amount > USERSPACETOP - as->as_heapend) {
+		rwlock_release_write(as->as_lock);
+		return ENOMEM;
+	}
+	newbreak = as->as_heapend + amount;
+	npages = (ROUNDUP(newbreak, PAGE_SIZE) - heap->vbase) / PAGE_SIZE;
+
+	if (npages > heap->npages) {
+		/* Don't run into the next region (the stack) */
+		pos = as_region_index(as, heap->vbase);
+		if (pos < regionarray_num(&as->as_regions) &&
+		    heap->vbase + npages * PAGE_SIZE >
+		    regionarray_get(&as->as_regions, pos)->vbase) {
+			rwlock_release_write(as->as_lock);
+			return ENOMEM;
+		}
+		heap->npages = npages;
+	} else if (npages < heap->npages) {
+		swap_acquire();
+		as_unmap(as, heap->vbase + npages * PAGE_SIZE,
+			 heap->npages - npages);
+		heap->npages = npages;
+		swap_release();
+	}
+
+	*oldbreak = as->as_heapend;
+	as->as_heapend = newbreak;
+	rwlock_release_write(as->as_lock);
+	return 0;
+}
+
+/*
+ * Map LENGTH bytes of the file V from OFFSET, which must be page
+ * aligned, into the highest gap below the stack that is big enough,
+ * and hand back the address. Like program segments, the pages are
+ * read in by vm_fault() when first touched; the part of the mapping
+ * past the end of the file reads as zeroes and is never written back.
+ */
+int
+as_mmap(struct addrspace *as, size_t length, bool writeable,
+	struct vnode *v, off_t offset, vaddr_t *ret)
+{
+	struct stat st;
+	struct region *below, *above, *reg;
+	vaddr_t vaddr;
+	size_t filesize;
+	unsigned i;
+	int result;
+
+	if (length == 0 || offset < 0 || (offset & ~(off_t)PAGE_FRAME) != 0) {
+		return EINVAL;
+	}
+	if (length > USERSPACETOP) {
+		return ENOMEM;
+	}
+	length = ROUNDUP(length, PAGE_SIZE);
+
+	result = VOP_MMAP(v);
+	if (result) {
+		return result;
+	}
+	result = VOP_STAT(v, &st);
+	if (result) {
+		return result;
+	}
+	filesize = 0;
+	if (st.st_size > offset) {
+		filesize = st.st_size - offset < (off_t)length ?
+			st.st_size - offset : length;
+	}
+
+	rwlock_acquire_write(as->as_lock);
+	vaddr = 0;
+	for (i = regionarray_num(&as->as_regions); i > 1; i--) {
+		below = regionarray_get(&as->as_regions, i - 2);
+		above = regionarray_get(&as->as_regions, i - 1);
+		if (above->vbase - (below->vbase + below->npages * PAGE_SIZE)
+		    >= length) {
+			vaddr = above->vbase - length;
+			break;
+		}
+	}
+	if (vaddr == 0) {
+		rwlock_release_write(as->as_lock);
+		return ENOMEM;
+	}
+
+	result = as_define_region(as, vaddr, length, 1, writeable, 0);
+	if (result) {
+		rwlock_release_write(as->as_lock);
+		return result;
+	}
+	result = as_define_file(as, vaddr, filesize, v, offset);
+	KASSERT(result == 0);
+	reg = as_find_region(as, vaddr);
+	reg->mmapped = true;
+	rwlock_release_write(as->as_lock);
+
+	*ret = vaddr;
+	return 0;
+}
+
+/*
+ * Remove the mapping made by as_mmap at VADDR, after writing back
+ * what was written through it. If that fails the mapping stays.
+ */
+int
+as_munmap(struct addrspace *as, vaddr_t vaddr)
+{
+	struct region *reg;
+	unsigned pos;
+	int result;
+
+	rwlock_acquire_write(as->as_lock);
+	pos = as_region_index(as, vaddr);
+	if (pos == 0) {
+		rwlock_release_write(as->as_lock);
+		return EINVAL;
+	}
+	reg = regionarray_get(&as->as_regions, pos - 1);
+	if (reg->vbase != vaddr || !reg->mmapped) {
+		rwlock_release_write(as->as_lock);
+		return EINVAL;
+	}
+
+	swap_acquire();
+	result = vm_msync(as, reg);
+	if (result) {
+		swap_release();
+		rwlock_release_write(as->as_lock);
+		return result;
+	}
+	as_unmap(as, reg->vbase, reg->npages);
+	regionarray_remove(&as->as_regions, pos - 1);
+	if (as->as_lastregion == reg) {
+		as->as_lastregion = NULL;
+	}
+	swap_release();
+	rwlock_release_write(as->as_lock);
+
+	VOP_DECREF(reg->vn);
+	kmem_cache_free(region_cache, reg);
+	return 0;
+}
+
+/*
+ * Write back the modified pages of every mapping of V in AS.
+ */
+int
+as_msync(struct addrspace *as, struct vnode *v)
+{
+	struct region *reg;
+	unsigned i, num;
+	int result, err = 0;
+
+	rwlock_acquire_read(as->as_lock);
+	swap_acquire();
+	num = regionarray_num(&as->as_regions);
+	for (i = 0; i < num; i++) {
+		reg = regionarray_get(&as->as_regions, i);
+		if (reg->mmapped && reg->vn == v) {
+			result = vm_msync(as, reg);
+			if (result && err == 0) {
+				err = result;
+			}
+		}
+	}
+	swap_release();
+	rwlock_release_read(as->as_lock);
+
+	return err;
+}
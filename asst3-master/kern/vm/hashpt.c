@@ -0,0 +1,310 @@
+/*
+ * Copyright (c) 2000, 2001, 2002, 2003, 2004, 2005, 2008, 2009
+ *	The President and Fellows of Harvard College.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE UNIVERSITY AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE UNIVERSITY OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * Hashed page table (options hashpt): one table for all address
+ * spaces, with an entry for each user page that is mapped or swapped
+ * out, hashed on (address space, page). Page table memory then grows
+ * with the number of pages in use, not with how spread out they are,
+ * which suits many small processes. There is no table for the UTLB
+ * refill handler to walk, so every TLB miss goes through vm_fault().
+ *
+ * The bucket array is sized to physical memory at boot. Entries are
+ * carved out of pages allocated on demand, and are recycled but never
+ * given back. Each address space also chains its own entries together
+ * so that copying or destroying it only visits its own pages.
+ *
+ * The table is shared by address spaces faulting in parallel on
+ * different cpus, so the hash chains, the free list and the address
+ * space lists are all protected by hpt_lock, lookups included. It is
+ * only ever held for a walk down one chain. The PTEs themselves are
+ * protected by their address space's PTE lock like any other.
+ */
+
+#include <types.h>
+#include <kern/errno.h>
+#include <lib.h>
+#include <spinlock.h>
+#include <addrspace.h>
+#include <vm.h>
+#include <pagetable.h>
+
+struct hpt_entry {
+	struct addrspace *he_as;	/* owner; NULL if free */
+	vaddr_t he_vpage;		/* page-aligned user address */
+	paddr_t he_pte;
+	struct hpt_entry *he_next;	/* hash chain, or free list */
+	struct hpt_entry *he_asnext;	/* owner's entries */
+	struct hpt_entry *he_asprev;
+};
+
+static struct hpt_entry **hpt_buckets;
+static unsigned hpt_nbuckets;		/* a power of two */
+static struct hpt_entry *hpt_freelist;
+static struct spinlock hpt_lock = SPINLOCK_INITIALIZER;
+
+/* Pages used for buckets and entries, for pt_stats() */
+static unsigned hpt_npages, hpt_peakpages;
+
+static
+unsigned
+hpt_hash(struct addrspace *as, vaddr_t va)
+{
+	uint32_t h;
+
+	h = (va >> 12) * 2654435761U ^ (uint32_t) (uintptr_t) as;
+	h ^= h >> 16;
+	return h & (hpt_nbuckets - 1);
+}
+
+void
+pt_bootstrap(void)
+{
+	unsigned nframes, nfree, npages;
+
+	kpages_stats(&nframes, &nfree);
+	hpt_nbuckets = 1;
+	while (hpt_nbuckets < nframes) {
+		hpt_nbuckets <<= 1;
+	}
+
+	npages = DIVROUNDUP(hpt_nbuckets * sizeof(struct hpt_entry *),
+			    PAGE_SIZE);
+	hpt_buckets = (struct hpt_entry **) alloc_kpages(npages);
+	if (hpt_buckets == NULL) {
+		panic("pt_bootstrap: no memory for %u buckets\n",
+		      hpt_nbuckets);
+	}
+	bzero(hpt_buckets, hpt_nbuckets * sizeof(struct hpt_entry *));
+	hpt_npages = hpt_peakpages = npages;
+}
+
+int
+pt_create(struct addrspace *as)
+{
+	as->as_hptlist = NULL;
+	return 0;
+}
+
+static
+struct hpt_entry *
+hpt_find(struct addrspace *as, vaddr_t va)
+{
+	struct hpt_entry *he;
+
+	va &= PAGE_FRAME;
+	for (he = hpt_buckets[hpt_hash(as, va)]; he != NULL; he = he->he_next) {
+		if (he->he_as == as && he->he_vpage == va) {
+			return he;
+		}
+	}
+	return NULL;
+}
+
+paddr_t *
+pt_lookup(struct addrspace *as, vaddr_t va)
+{
+	struct hpt_entry *he;
+
+	spinlock_acquire(&hpt_lock);
+	he = hpt_find(as, va);
+	spinlock_release(&hpt_lock);
+	return he == NULL ? NULL : &he->he_pte;
+}
+
+int
+pt_reserve(struct addrspace *as, vaddr_t va)
+{
+	struct hpt_entry *he;
+	unsigned h, i;
+
+	spinlock_acquire(&hpt_lock);
+	while (hpt_find(as, va) == NULL && hpt_freelist == NULL) {
+		/* Carve up a new page of entries */
+		spinlock_release(&hpt_lock);
+		he = (struct hpt_entry *) vm_alloc_page(true);
+		if (he == NULL) {
+			return ENOMEM;
+		}
+		spinlock_acquire(&hpt_lock);
+		for (i = 0; i < PAGE_SIZE / sizeof(*he); i++) {
+			he[i].he_next = hpt_freelist;
+			hpt_freelist = &he[i];
+		}
+		if (++hpt_npages > hpt_peakpages) {
+			hpt_peakpages = hpt_npages;
+		}
+	}
+	if (hpt_find(as, va) != NULL) {
+		spinlock_release(&hpt_lock);
+		return 0;
+	}
+
+	/*
+	 * The entry is made now, holding 0, and pt_alloc() just finds
+	 * it. An entry that never gets filled in is freed by
+	 * pt_unreserve(), or with the rest by pt_destroy().
+	 */
+	he = hpt_freelist;
+	hpt_freelist = he->he_next;
+	he->he_vpage = va & PAGE_FRAME;
+	he->he_pte = 0;
+	he->he_as = as;
+
+	he->he_asprev = NULL;
+	he->he_asnext = as->as_hptlist;
+	if (as->as_hptlist != NULL) {
+		as->as_hptlist->he_asprev = he;
+	}
+	as->as_hptlist = he;
+
+	h = hpt_hash(as, va & PAGE_FRAME);
+	he->he_next = hpt_buckets[h];
+	hpt_buckets[h] = he;
+	spinlock_release(&hpt_lock);
+
+	return 0;
+}
+
+paddr_t *
+pt_alloc(struct addrspace *as, vaddr_t va)
+{
+	paddr_t *pte;
+
+	KASSERT(spinlock_do_i_hold(&as->as_ptlock));
+
+	pte = pt_lookup(as, va);
+	KASSERT(pte != NULL);
+	return pte;
+}
+
+/*
+ * Unlink HE from its hash chain and its owner's list, and free it.
+ * Called with hpt_lock held.
+ */
+static
+void
+hpt_freeentry(struct hpt_entry *he)
+{
+	struct hpt_entry **pp;
+
+	pp = &hpt_buckets[hpt_hash(he->he_as, he->he_vpage)];
+	while (*pp != he) {
+		KASSERT(*pp != NULL);
+		pp = &(*pp)->he_next;
+	}
+	*pp = he->he_next;
+
+	if (he->he_asprev != NULL) {
+		he->he_asprev->he_asnext = he->he_asnext;
+	}
+	else {
+		he->he_as->as_hptlist = he->he_asnext;
+	}
+	if (he->he_asnext != NULL) {
+		he->he_asnext->he_asprev = he->he_asprev;
+	}
+
+	he->he_as = NULL;
+	he->he_next = hpt_freelist;
+	hpt_freelist = he;
+}
+
+void
+pt_remove(struct addrspace *as, vaddr_t va)
+{
+	struct hpt_entry *he;
+
+	/* The PTE lock keeps the TLB miss fast path off the entry */
+	spinlock_acquire(&as->as_ptlock);
+	spinlock_acquire(&hpt_lock);
+	he = hpt_find(as, va);
+	if (he != NULL) {
+		hpt_freeentry(he);
+	}
+	spinlock_release(&hpt_lock);
+	spinlock_release(&as->as_ptlock);
+}
+
+void
+pt_unreserve(struct addrspace *as, vaddr_t va)
+{
+	struct hpt_entry *he;
+
+	spinlock_acquire(&as->as_ptlock);
+	spinlock_acquire(&hpt_lock);
+	he = hpt_find(as, va);
+	if (he != NULL && he->he_pte == 0) {
+		hpt_freeentry(he);
+	}
+	spinlock_release(&hpt_lock);
+	spinlock_release(&as->as_ptlock);
+}
+
+void
+pt_destroy(struct addrspace *as)
+{
+	spinlock_acquire(&hpt_lock);
+	while (as->as_hptlist != NULL) {
+		hpt_freeentry(as->as_hptlist);
+	}
+	spinlock_release(&hpt_lock);
+}
+
+int
+pt_foreach(struct addrspace *as, pt_func func, void *data)
+{
+	struct hpt_entry *he;
+	int result;
+
+	for (he = as->as_hptlist; he != NULL; he = he->he_asnext) {
+		if (he->he_pte == 0) {
+			continue;
+		}
+		result = func(as, he->he_vpage, &he->he_pte, data);
+		if (result) {
+			return result;
+		}
+	}
+	return 0;
+}
+
+vaddr_t
+pt_hwbase(struct addrspace *as)
+{
+	(void) as;
+	return 0;
+}
+
+void
+pt_stats(size_t *bytes, size_t *peakbytes)
+{
+	*bytes = hpt_npages * PAGE_SIZE;
+	*peakbytes = hpt_peakpages * PAGE_SIZE;
+}
@@ -29,8 +29,13 @@
 
 #include <types.h>
 #include <lib.h>
+#include <spl.h>
 #include <spinlock.h>
+#include <cpu.h>
+#include <current.h>
+#include <mainbus.h>
 #include <vm.h>
+#include <platform/maxcpus.h>
 
 /*
  * Kernel malloc.
@@ -78,6 +83,10 @@ fill_deadbeef(void *vptr, size_t len)
 //    cannot recursively use the subpage allocator. (We could probably
 //    make that work, but it would be painful.)
 //
+//    In front of the pages, each cpu keeps a magazine of free blocks
+//    of each size, so most kmalloc and kfree calls don't touch the
+//    pages or their lock at all (see below).
+//
 
 ////////////////////////////////////////
 
@@ -102,6 +111,12 @@ fill_deadbeef(void *vptr, size_t len)
  * LABELS records the allocation site and a generation number for each
  * allocation and is useful for tracking down memory leaks.
  *
+ * PROFILE enables LABELS and also keeps counts for each allocation
+ * site: allocations, frees, bytes still allocated, and allocations by
+ * size. The khprof menu command prints them. A site is the address
+ * kmalloc was called from, so everything allocated through a wrapper
+ * such as kstrdup or array_setsize counts against the wrapper.
+ *
  * On top of these one can enable the following:
  *
  * CHECKBEEF checks that free blocks still contain 0xdeadbeef when
@@ -117,6 +132,7 @@ fill_deadbeef(void *vptr, size_t len)
 #undef SLOWER
 #undef GUARDS
 #undef LABELS
+#undef PROFILE
 
 #undef CHECKBEEF
 #undef CHECKGUARDS
@@ -160,10 +176,8 @@ struct pageref {
 ////////////////////////////////////////
 
 /*
- * Use one spinlock for the whole thing. Making parts of the kmalloc
- * logic per-cpu is worthwhile for scalability; however, for the time
- * being at least we won't, because it adds a lot of complexity and in
- * OS/161 performance and scalability aren't super-critical.
+ * Use one spinlock for the heap pages and their pagerefs. The per-cpu
+ * magazines are what keep most calls from taking it.
  */
 
 static struct spinlock kmalloc_spinlock = SPINLOCK_INITIALIZER;
@@ -172,82 +186,88 @@ static struct spinlock kmalloc_spinlock = SPINLOCK_INITIALIZER;
 
 /*
  * We can only allocate whole pages of pageref structure at a time.
- * This is a struct type for such a page.
+ * This is a struct type for such a page: a header, with a bitmap of
+ * which pagerefs on the page are in use, followed by as many pagerefs
+ * as fit. Each page holds 253 pagerefs, which can manage up to
+ * 253 * 4K (about 1M) of kernel heap.
  *
- * Each pageref page contains 256 pagerefs, which can manage up to
- * 256 * 4K = 1M of kernel heap.
+ * Pageref pages come straight from alloc_kpages, never from the
+ * subpage allocator they keep track of, and are linked together on
+ * pagerefpages. There are as many as the heap needs: a page is added
+ * when all the others are full, and one that empties is given back,
+ * except that one empty page is kept in reserve so a heap hovering at
+ * a page boundary doesn't keep allocating and freeing it. A pageref's
+ * page is found from its address, as pageref pages are page aligned.
  */
 
-#define NPAGEREFS_PER_PAGE (PAGE_SIZE / sizeof(struct pageref))
+#define INUSE_WORDS (PAGE_SIZE / sizeof(struct pageref) / 32)
 
-struct pagerefpage {
-	struct pageref refs[NPAGEREFS_PER_PAGE];
+struct pagerefhdr {
+	struct pagerefpage *next;	/* list of all pageref pages */
+	unsigned numinuse;
+	uint32_t pagerefs_inuse[INUSE_WORDS];
 };
 
-/*
- * This structure holds a pointer to a pageref page and also its
- * bitmap of free entries.
- */
+#define NPAGEREFS_PER_PAGE \
+	((PAGE_SIZE - sizeof(struct pagerefhdr)) / sizeof(struct pageref))
 
-#define INUSE_WORDS (NPAGEREFS_PER_PAGE / 32)
-
-struct kheap_root {
-	struct pagerefpage *page;
-	uint32_t pagerefs_inuse[INUSE_WORDS];
-	unsigned numinuse;
+struct pagerefpage {
+	struct pagerefhdr hdr;
+	struct pageref refs[NPAGEREFS_PER_PAGE];
 };
 
-/*
- * It would be better to make this dynamically sizeable. However,
- * since we only actually run on System/161 and System/161 is
- * specifically limited to 16M of RAM, we'll just adopt that as a
- * static size limit.
- *
- * FUTURE: it would be better to pick this number based on the RAM
- * size we find at boot time.
- */
+#define PAGEREF_PAGE(pr) \
+	((struct pagerefpage *)((vaddr_t)(pr) & PAGE_FRAME))
 
-#define NUM_PAGEREFPAGES 16
-#define TOTAL_PAGEREFS (NUM_PAGEREFPAGES * NPAGEREFS_PER_PAGE)
-
-static struct kheap_root kheaproots[NUM_PAGEREFPAGES];
+static struct pagerefpage *pagerefpages;
+static unsigned npagerefpages;		/* pages on the list */
+static unsigned npagerefpages_empty;	/* ...with no pagerefs in use */
+static unsigned npagerefs_inuse;
 
 /*
- * Allocate a page to hold pagerefs.
+ * Add a page of pagerefs. Returns false if out of memory.
  */
 static
-void
-allocpagerefpage(struct kheap_root *root)
+bool
+allocpagerefpage(void)
 {
+	struct pagerefpage *page;
+	unsigned i;
 	vaddr_t va;
 
-	KASSERT(root->page == NULL);
+	COMPILE_ASSERT(sizeof(struct pagerefpage) <= PAGE_SIZE);
 
 	/*
 	 * We release the spinlock while calling alloc_kpages. This
 	 * avoids deadlock if alloc_kpages needs to come back here.
 	 * Note that this means things can change behind our back...
+	 * which is fine: if somebody else added a page meanwhile,
+	 * there's just more room.
 	 */
 	spinlock_release(&kmalloc_spinlock);
 	va = alloc_kpages(1);
 	spinlock_acquire(&kmalloc_spinlock);
 	if (va == 0) {
 		kprintf("kmalloc: Couldn't get a pageref page\n");
-		return;
+		return false;
 	}
 	KASSERT(va % PAGE_SIZE == 0);
 
-	if (root->page != NULL) {
-		/* Oops, somebody else allocated it. */
-		spinlock_release(&kmalloc_spinlock);
-		free_kpages(va);
-		spinlock_acquire(&kmalloc_spinlock);
-		/* Once allocated it isn't ever freed. */
-		KASSERT(root->page != NULL);
-		return;
+	page = (struct pagerefpage *)va;
+	page->hdr.numinuse = 0;
+	for (i=0; i<INUSE_WORDS; i++) {
+		page->hdr.pagerefs_inuse[i] = 0;
+	}
+	/* Mark the bits past the last pageref in use */
+	for (i=NPAGEREFS_PER_PAGE; i<INUSE_WORDS*32; i++) {
+		page->hdr.pagerefs_inuse[i/32] |= ((uint32_t)1) << (i%32);
 	}
 
-	root->page = (struct pagerefpage *)va;
+	page->hdr.next = pagerefpages;
+	pagerefpages = page;
+	npagerefpages++;
+	npagerefpages_empty++;
+	return true;
 }
 
 /*
@@ -259,12 +279,13 @@ allocpageref(void)
 {
 	unsigned i,j;
 	uint32_t k;
-	unsigned whichroot;
-	struct kheap_root *root;
+	struct pagerefpage *page;
+
+	KASSERT(spinlock_do_i_hold(&kmalloc_spinlock));
 
-	for (whichroot=0; whichroot < NUM_PAGEREFPAGES; whichroot++) {
-		root = &kheaproots[whichroot];
-		if (root->numinuse >= NPAGEREFS_PER_PAGE) {
+ again:
+	for (page = pagerefpages; page != NULL; page = page->hdr.next) {
+		if (page->hdr.numinuse >= NPAGEREFS_PER_PAGE) {
 			continue;
 		}
 
@@ -272,68 +293,73 @@ allocpageref(void)
 		 * This should probably not be a linear search.
 		 */
 		for (i=0; i<INUSE_WORDS; i++) {
-			if (root->pagerefs_inuse[i]==0xffffffff) {
+			if (page->hdr.pagerefs_inuse[i]==0xffffffff) {
 				/* full */
 				continue;
 			}
 			for (k=1,j=0; k!=0; k<<=1,j++) {
-				if ((root->pagerefs_inuse[i] & k)==0) {
-					root->pagerefs_inuse[i] |= k;
-					root->numinuse++;
-					if (root->page == NULL) {
-						allocpagerefpage(root);
+				if ((page->hdr.pagerefs_inuse[i] & k)==0) {
+					page->hdr.pagerefs_inuse[i] |= k;
+					if (page->hdr.numinuse++ == 0) {
+						npagerefpages_empty--;
 					}
-					if (root->page == NULL) {
-						return NULL;
-					}
-					return &root->page->refs[i*32 + j];
+					npagerefs_inuse++;
+					return &page->refs[i*32 + j];
 				}
 			}
 			KASSERT(0);
 		}
+		KASSERT(0);
 	}
 
-	/* ran out */
-	return NULL;
+	/* All full; grow */
+	if (!allocpagerefpage()) {
+		return NULL;
+	}
+	goto again;
 }
 
 /*
- * Release a pageref structure.
+ * Release a pageref structure. If that leaves its page empty and
+ * there's another empty page already, take the page off the list and
+ * return it for the caller to free (without the spinlock); otherwise
+ * return 0.
  */
 static
-void
+vaddr_t
 freepageref(struct pageref *p)
 {
 	size_t i, j;
 	uint32_t k;
-	unsigned whichroot;
-	struct kheap_root *root;
-	struct pagerefpage *page;
+	struct pagerefpage *page, **prev;
 
-	for (whichroot=0; whichroot < NUM_PAGEREFPAGES; whichroot++) {
-		root = &kheaproots[whichroot];
+	KASSERT(spinlock_do_i_hold(&kmalloc_spinlock));
 
-		page = root->page;
-		if (page == NULL) {
-			KASSERT(root->numinuse == 0);
-			continue;
-		}
+	page = PAGEREF_PAGE(p);
+	j = p - page->refs;
+	KASSERT(j < NPAGEREFS_PER_PAGE);
+	i = j/32;
+	k = ((uint32_t)1) << (j%32);
+	KASSERT((page->hdr.pagerefs_inuse[i] & k) != 0);
+	page->hdr.pagerefs_inuse[i] &= ~k;
+	KASSERT(page->hdr.numinuse > 0);
+	npagerefs_inuse--;
+	if (--page->hdr.numinuse > 0) {
+		return 0;
+	}
 
-		j = p-page->refs;
-		/* note: j is unsigned, don't test < 0 */
-		if (j < NPAGEREFS_PER_PAGE) {
-			/* on this page */
-			i = j/32;
-			k = ((uint32_t)1) << (j%32);
-			KASSERT((root->pagerefs_inuse[i] & k) != 0);
-			root->pagerefs_inuse[i] &= ~k;
-			KASSERT(root->numinuse > 0);
-			root->numinuse--;
-			return;
-		}
+	if (npagerefpages_empty == 0) {
+		/* Keep it in reserve */
+		npagerefpages_empty++;
+		return 0;
 	}
-	/* pageref wasn't on any of the pages */
-	KASSERT(0);
+
+	for (prev = &pagerefpages; *prev != page; prev = &(*prev)->hdr.next) {
+		KASSERT(*prev != NULL);
+	}
+	*prev = page->hdr.next;
+	npagerefpages--;
+	return (vaddr_t)page;
 }
 
 ////////////////////////////////////////
@@ -345,6 +371,70 @@ freepageref(struct pageref *p)
 static struct pageref *sizebases[NSIZES];
 static struct pageref *allbase;
 
+/*
+ * Map from physical page number to the pageref of each heap page, so
+ * kfree can find the page a block is on without searching allbase
+ * and without the lock. Entries are only changed with kmalloc_spinlock
+ * held, and the entry for a page can't change while any block on it
+ * is allocated, so the entry for a block being freed is stable.
+ * Allocated along with the first heap page.
+ */
+static struct pageref **heappages;
+static unsigned nheappages;
+
+/*
+ * Allocate the heap page map, big enough for all of RAM.
+ */
+static
+void
+heappages_create(void)
+{
+	unsigned n, npages;
+	vaddr_t va;
+
+	n = mainbus_ramsize() / PAGE_SIZE;
+	npages = DIVROUNDUP(n * sizeof(struct pageref *), PAGE_SIZE);
+	va = alloc_kpages(npages);
+	if (va == 0) {
+		kprintf("kmalloc: Couldn't get the heap page map\n");
+		return;
+	}
+	bzero((void *)va, npages * PAGE_SIZE);
+
+	spinlock_acquire(&kmalloc_spinlock);
+	if (heappages == NULL) {
+		nheappages = n;
+		heappages = (struct pageref **)va;
+		va = 0;
+	}
+	spinlock_release(&kmalloc_spinlock);
+
+	if (va != 0) {
+		/* Somebody else got there first. */
+		free_kpages(va);
+	}
+}
+
+/*
+ * Find the pageref for the heap page holding ADDR, or NULL if it isn't
+ * on a heap page. Addresses that aren't in RAM come out too big.
+ */
+static
+struct pageref *
+heappage_lookup(vaddr_t addr)
+{
+	paddr_t pa;
+
+	if (heappages == NULL) {
+		return NULL;
+	}
+	pa = KVADDR_TO_PADDR(addr);
+	if (pa / PAGE_SIZE >= nheappages) {
+		return NULL;
+	}
+	return heappages[pa / PAGE_SIZE];
+}
+
 ////////////////////////////////////////
 
 #ifdef GUARDS
@@ -450,6 +540,64 @@ checkguardband(vaddr_t blockaddr, size_t smallerblocksize, size_t blocksize)
 #endif
 #endif
 
+/* PROFILE implies LABELS */
+#ifdef PROFILE
+#ifndef LABELS
+#define LABELS
+#endif
+#endif
+
+/*
+ * Per-cpu magazines.
+ *
+ * Each cpu keeps a magazine (a small stack) of free blocks of each
+ * size. kmalloc pops a block off its cpu's magazine and kfree pushes
+ * one on; only when a magazine runs empty or fills up does it take
+ * kmalloc_spinlock, to move KMAG_BATCH blocks from or to the heap
+ * pages at once. A magazine is only touched by its own cpu, with
+ * interrupts off.
+ *
+ * A magazine holds at most a page's worth of blocks, so with large
+ * blocks it holds fewer than KMAG_SIZE. Blocks in a magazine count as
+ * allocated as far as their pages are concerned, so a page can stay
+ * around for a while after everything on it is freed.
+ *
+ * The SLOW checks look at every block on every heap page and can't
+ * tell a block waiting in a magazine from an allocated one, so there
+ * are no magazines with SLOW.
+ */
+#ifndef SLOW
+#define MAGAZINES
+#endif
+
+#ifdef MAGAZINES
+
+#define KMAG_SIZE 16
+#define KMAG_MAX(blktype) \
+	(PAGE_SIZE / sizes[blktype] < KMAG_SIZE ? \
+	 PAGE_SIZE / sizes[blktype] : KMAG_SIZE)
+#define KMAG_BATCH(blktype) (KMAG_MAX(blktype) / 2)
+
+struct kmagazine {
+	void *km_blocks[KMAG_SIZE];
+	unsigned km_count;
+};
+
+struct kmcache {
+	struct kmagazine kc_mags[NSIZES];
+
+	/* statistics */
+	unsigned kc_allocs;	/* blocks allocated on this cpu */
+	unsigned kc_frees;	/* blocks freed on this cpu */
+	unsigned kc_locks;	/* kmalloc_spinlock acquisitions for those */
+};
+
+static struct kmcache kmcaches[MAXCPUS];
+
+#endif /* MAGAZINES */
+
+////////////////////////////////////////
+
 #ifdef CHECKBEEF
 /*
  * Check that a (free) block contains deadbeef as it should.
@@ -588,14 +736,14 @@ checksubpages(void)
 	for (i=0; i<NSIZES; i++) {
 		for (pr = sizebases[i]; pr != NULL; pr = pr->next_samesize) {
 			checksubpage(pr);
-			KASSERT(sc < TOTAL_PAGEREFS);
+			KASSERT(sc < npagerefs_inuse);
 			sc++;
 		}
 	}
 
 	for (pr = allbase; pr != NULL; pr = pr->next_all) {
 		checksubpage(pr);
-		KASSERT(ac < TOTAL_PAGEREFS);
+		KASSERT(ac < npagerefs_inuse);
 		ac++;
 	}
 
@@ -609,12 +757,16 @@ checksubpages(void)
 
 #ifdef LABELS
 
-#define LABEL_PTROFFSET sizeof(struct malloclabel)
+/* Rounded up so that labels don't change kmalloc's alignment */
+#define LABEL_PTROFFSET ROUNDUP(sizeof(struct malloclabel), 8)
 #define LABEL_OVERHEAD LABEL_PTROFFSET
 
 struct malloclabel {
 	vaddr_t label;
 	unsigned generation;
+#ifdef PROFILE
+	size_t size;		/* what kmalloc was asked for */
+#endif
 };
 
 static unsigned mallocgeneration;
@@ -631,8 +783,7 @@ establishlabel(void *block, vaddr_t label)
 	ml = block;
 	ml->label = label;
 	ml->generation = mallocgeneration;
-	ml++;
-	return ml;
+	return (char *)block + LABEL_PTROFFSET;
 }
 
 static
@@ -739,6 +890,284 @@ kheap_dumpall(void)
 
 ////////////////////////////////////////
 
+#ifdef PROFILE
+
+/*
+ * Allocation profile: counts for each call site of kmalloc, kept in
+ * an open hash table keyed by the site's address. Sites that don't
+ * fit aren't profiled (kprof_dropped counts their allocations).
+ *
+ * Subpage blocks carry their site and size in their label, so kfree
+ * can find them. Multipage blocks have no room for a label, so they
+ * are remembered in kprof_large[] until freed; those that don't fit
+ * there aren't profiled either, as their frees couldn't be matched
+ * (kprof_lost counts frees of multipage blocks not found there).
+ */
+#define KPROF_NSITES 256	/* must be a power of two */
+#define KPROF_NLARGE 64
+#define KPROF_NPRINT 20		/* sites printed by kheap_printprofile */
+
+struct kprofsite {
+	vaddr_t ks_site;		/* 0 if slot unused */
+	unsigned ks_allocs;
+	unsigned ks_frees;
+	size_t ks_live;			/* bytes not yet freed */
+	unsigned ks_hist[NSIZES + 1];	/* allocations by size class */
+};
+
+struct kproflarge {
+	vaddr_t kl_addr;		/* 0 if slot unused */
+	vaddr_t kl_site;
+	size_t kl_size;
+};
+
+static struct kprofsite kprof_sites[KPROF_NSITES];
+static unsigned kprof_nsites;
+static struct kproflarge kprof_large[KPROF_NLARGE];
+static unsigned kprof_dropped;
+static unsigned kprof_lost;
+static struct spinlock kprof_lock = SPINLOCK_INITIALIZER;
+
+/*
+ * Find the entry for SITE, making it if CREATE is set and there's
+ * room. Called with kprof_lock held.
+ */
+static
+struct kprofsite *
+kprof_lookup(vaddr_t site, bool create)
+{
+	unsigned i, n;
+
+	i = (site >> 2) & (KPROF_NSITES - 1);
+	for (n = 0; n < KPROF_NSITES; n++) {
+		if (kprof_sites[i].ks_site == site) {
+			return &kprof_sites[i];
+		}
+		if (kprof_sites[i].ks_site == 0) {
+			if (!create || kprof_nsites == KPROF_NSITES - 1) {
+				return NULL;
+			}
+			kprof_sites[i].ks_site = site;
+			kprof_nsites++;
+			return &kprof_sites[i];
+		}
+		i = (i + 1) & (KPROF_NSITES - 1);
+	}
+	return NULL;
+}
+
+/*
+ * Count an allocation of SZ bytes at ADDR from SITE. LARGE is true
+ * for a multipage block.
+ */
+static
+void
+kprof_alloc(vaddr_t site, vaddr_t addr, size_t sz, bool large)
+{
+	struct kprofsite *ks;
+	unsigned i;
+
+	spinlock_acquire(&kprof_lock);
+	ks = kprof_lookup(site, true);
+	if (ks == NULL) {
+		kprof_dropped++;
+		spinlock_release(&kprof_lock);
+		return;
+	}
+	if (large) {
+		for (i = 0; i < KPROF_NLARGE; i++) {
+			if (kprof_large[i].kl_addr == 0) {
+				kprof_large[i].kl_addr = addr;
+				kprof_large[i].kl_site = site;
+				kprof_large[i].kl_size = sz;
+				break;
+			}
+		}
+		if (i == KPROF_NLARGE) {
+			/* Its free would leave it live for good */
+			kprof_dropped++;
+			spinlock_release(&kprof_lock);
+			return;
+		}
+	}
+	for (i = 0; i < NSIZES && sizes[i] < sz; i++) {
+		/* find the size class */
+	}
+	ks->ks_allocs++;
+	ks->ks_live += sz;
+	ks->ks_hist[i]++;
+	spinlock_release(&kprof_lock);
+}
+
+/*
+ * Count a free of SZ bytes allocated from SITE.
+ */
+static
+void
+kprof_free(vaddr_t site, size_t sz)
+{
+	struct kprofsite *ks;
+
+	spinlock_acquire(&kprof_lock);
+	ks = kprof_lookup(site, false);
+	if (ks != NULL) {
+		ks->ks_frees++;
+		ks->ks_live -= sz;
+	}
+	spinlock_release(&kprof_lock);
+}
+
+/*
+ * Count the free of the multipage block at ADDR, if we remember it.
+ */
+static
+void
+kprof_freelarge(vaddr_t addr)
+{
+	vaddr_t site = 0;
+	size_t sz = 0;
+	unsigned i;
+
+	spinlock_acquire(&kprof_lock);
+	for (i = 0; i < KPROF_NLARGE; i++) {
+		if (kprof_large[i].kl_addr == addr) {
+			site = kprof_large[i].kl_site;
+			sz = kprof_large[i].kl_size;
+			kprof_large[i].kl_addr = 0;
+			break;
+		}
+	}
+	if (i == KPROF_NLARGE) {
+		kprof_lost++;
+	}
+	spinlock_release(&kprof_lock);
+
+	if (site != 0) {
+		kprof_free(site, sz);
+	}
+}
+
+/*
+ * Does site A come before site B when sorting by SORTBY?
+ */
+static
+bool
+kprof_before(const struct kprofsite *a, const struct kprofsite *b,
+	     int sortby)
+{
+	switch (sortby) {
+	    case KHEAP_BYALLOCS:
+		return a->ks_allocs > b->ks_allocs;
+	    case KHEAP_BYFREES:
+		return a->ks_frees > b->ks_frees;
+	    default:
+		return a->ks_live > b->ks_live;
+	}
+}
+
+#endif /* PROFILE */
+
+/*
+ * Print the top KPROF_NPRINT allocation sites, sorted by SORTBY.
+ * Selection sort, one site at a time, so we need no memory to sort
+ * in; each site is copied out under the lock and printed without it.
+ */
+void
+kheap_printprofile(int sortby)
+{
+#ifdef PROFILE
+	uint32_t printed[KPROF_NSITES / 32];
+	struct kprofsite ks;
+	unsigned i, n, best, nsites, dropped, lost;
+
+	for (i = 0; i < KPROF_NSITES / 32; i++) {
+		printed[i] = 0;
+	}
+
+	spinlock_acquire(&kprof_lock);
+	nsites = kprof_nsites;
+	dropped = kprof_dropped;
+	lost = kprof_lost;
+	spinlock_release(&kprof_lock);
+
+	kprintf("%u allocation sites", nsites);
+	if (dropped > 0 || lost > 0) {
+		kprintf(" (%u allocations not profiled, %u frees lost)",
+			dropped, lost);
+	}
+	kprintf("\n");
+	kprintf("site        allocs    frees       live");
+	for (i = 0; i < NSIZES; i++) {
+		kprintf(" %5zu", sizes[i]);
+	}
+	kprintf("   big\n");
+
+	for (n = 0; n < KPROF_NPRINT; n++) {
+		spinlock_acquire(&kprof_lock);
+		best = KPROF_NSITES;
+		for (i = 0; i < KPROF_NSITES; i++) {
+			if (kprof_sites[i].ks_site == 0 ||
+			    (printed[i / 32] & (1U << (i % 32)))) {
+				continue;
+			}
+			if (best == KPROF_NSITES ||
+			    kprof_before(&kprof_sites[i], &kprof_sites[best],
+					 sortby)) {
+				best = i;
+			}
+		}
+		if (best < KPROF_NSITES) {
+			ks = kprof_sites[best];
+		}
+		spinlock_release(&kprof_lock);
+
+		if (best == KPROF_NSITES) {
+			break;
+		}
+		printed[best / 32] |= 1U << (best % 32);
+
+		kprintf("0x%08x %7u  %7u  %9zu", ks.ks_site, ks.ks_allocs,
+			ks.ks_frees, ks.ks_live);
+		for (i = 0; i <= NSIZES; i++) {
+			kprintf(" %5u", ks.ks_hist[i]);
+		}
+		kprintf("\n");
+	}
+#else
+	(void)sortby;
+	kprintf("Enable PROFILE in kmalloc.c to use this functionality.\n");
+#endif
+}
+
+/*
+ * Zero the allocation and free counts, to profile some particular
+ * workload. Bytes still allocated are left alone, as their frees
+ * are still to come.
+ */
+void
+kheap_resetprofile(void)
+{
+#ifdef PROFILE
+	unsigned i, j;
+
+	spinlock_acquire(&kprof_lock);
+	for (i = 0; i < KPROF_NSITES; i++) {
+		kprof_sites[i].ks_allocs = 0;
+		kprof_sites[i].ks_frees = 0;
+		for (j = 0; j <= NSIZES; j++) {
+			kprof_sites[i].ks_hist[j] = 0;
+		}
+	}
+	kprof_dropped = 0;
+	kprof_lost = 0;
+	spinlock_release(&kprof_lock);
+#else
+	kprintf("Enable PROFILE in kmalloc.c to use this functionality.\n");
+#endif
+}
+
+////////////////////////////////////////
+
 /*
  * Print the allocated/freed map of a single kernel heap page.
  */
@@ -801,6 +1230,9 @@ void
 kheap_printstats(void)
 {
 	struct pageref *pr;
+#ifdef MAGAZINES
+	unsigned c, i, cached;
+#endif
 
 	/* print the whole thing with interrupts off */
 	spinlock_acquire(&kmalloc_spinlock);
@@ -810,8 +1242,32 @@ kheap_printstats(void)
 	for (pr = allbase; pr != NULL; pr = pr->next_all) {
 		subpage_stats(pr);
 	}
+	kprintf("%u pagerefs in use on %u pages\n", npagerefs_inuse,
+		npagerefpages);
 
 	spinlock_release(&kmalloc_spinlock);
+
+#ifdef MAGAZINES
+	/*
+	 * Without the magazines every subpage kmalloc or kfree would
+	 * take kmalloc_spinlock once. The counts belong to each cpu,
+	 * so they may be slightly stale.
+	 */
+	kprintf("cpu  cached  allocs   frees  lock acquisitions\n");
+	for (c = 0; c < MAXCPUS; c++) {
+		struct kmcache *kc = &kmcaches[c];
+
+		if (kc->kc_allocs + kc->kc_frees == 0) {
+			continue;
+		}
+		cached = 0;
+		for (i = 0; i < NSIZES; i++) {
+			cached += kc->kc_mags[i].km_count;
+		}
+		kprintf("%3u  %6u  %6u  %6u  %17u\n", c, cached,
+			kc->kc_allocs, kc->kc_frees, kc->kc_locks);
+	}
+#endif
 }
 
 ////////////////////////////////////////
@@ -867,66 +1323,42 @@ int blocktype(size_t clientsz)
 }
 
 /*
- * Allocate a block of size SZ, where SZ is not large enough to
- * warrant a whole-page allocation.
+ * Take up to N free blocks of type BLKTYPE off the heap pages and put
+ * them in BLOCKS, making a fresh page if there are none. Returns how
+ * many it got, which is 0 only if we're out of memory.
  */
 static
-void *
-subpage_kmalloc(size_t sz
-#ifdef LABELS
-		, vaddr_t label
-#endif
-	)
+unsigned
+subpage_getblocks(unsigned blktype, void **blocks, unsigned n)
 {
-	unsigned blktype;	// index into sizes[] that we're using
 	struct pageref *pr;	// pageref for page we're allocating from
 	vaddr_t prpage;		// PR_PAGEADDR(pr)
 	vaddr_t fla;		// free list entry address
 	struct freelist *volatile fl;	// free list entry
-	void *retptr;		// our result
+	unsigned got;		// blocks taken so far
 
 	volatile int i;
 
-#ifdef GUARDS
-	size_t clientsz;
-#endif
-
-#ifdef GUARDS
-	clientsz = sz;
-	sz += GUARD_OVERHEAD;
-#endif
-#ifdef LABELS
-#ifdef GUARDS
-	/* Include the label in what GUARDS considers the client data. */
-	clientsz += LABEL_PTROFFSET;
-#endif
-	sz += LABEL_PTROFFSET;
-#endif
-	blktype = blocktype(sz);
-#ifdef GUARDS
-	sz = sizes[blktype];
-#endif
-
 	spinlock_acquire(&kmalloc_spinlock);
 
 	checksubpages();
 
-	for (pr = sizebases[blktype]; pr != NULL; pr = pr->next_samesize) {
+ again:
+	got = 0;
+	for (pr = sizebases[blktype]; pr != NULL && got < n;
+	     pr = pr->next_samesize) {
 
 		/* check for corruption */
 		KASSERT(PR_BLOCKTYPE(pr) == blktype);
 		checksubpage(pr);
 
-		if (pr->nfree > 0) {
-
-		doalloc: /* comes here after getting a whole fresh page */
-
+		while (pr->nfree > 0 && got < n) {
 			KASSERT(pr->freelist_offset < PAGE_SIZE);
 			prpage = PR_PAGEADDR(pr);
 			fla = prpage + pr->freelist_offset;
 			fl = (struct freelist *)fla;
 
-			retptr = fl;
+			blocks[got++] = fl;
 			fl = fl->next;
 			pr->nfree--;
 
@@ -940,19 +1372,13 @@ subpage_kmalloc(size_t sz
 				KASSERT(pr->nfree == 0);
 				pr->freelist_offset = INVALID_OFFSET;
 			}
-#ifdef GUARDS
-			retptr = establishguardband(retptr, clientsz, sz);
-#endif
-#ifdef LABELS
-			retptr = establishlabel(retptr, label);
-#endif
-
-			checksubpages();
-
-			spinlock_release(&kmalloc_spinlock);
-			return retptr;
 		}
 	}
+	if (got > 0) {
+		checksubpages();
+		spinlock_release(&kmalloc_spinlock);
+		return got;
+	}
 
 	/*
 	 * No page of the right size available.
@@ -964,11 +1390,14 @@ subpage_kmalloc(size_t sz
 	 */
 
 	spinlock_release(&kmalloc_spinlock);
+	if (heappages == NULL) {
+		heappages_create();
+	}
 	prpage = alloc_kpages(1);
 	if (prpage==0) {
 		/* Out of memory. */
 		kprintf("kmalloc: Subpage allocator couldn't get a page\n");
-		return NULL;
+		return 0;
 	}
 	KASSERT(prpage % PAGE_SIZE == 0);
 #ifdef CHECKBEEF
@@ -977,13 +1406,20 @@ subpage_kmalloc(size_t sz
 #endif
 	spinlock_acquire(&kmalloc_spinlock);
 
+	if (heappages == NULL) {
+		spinlock_release(&kmalloc_spinlock);
+		free_kpages(prpage);
+		return 0;
+	}
+	KASSERT(KVADDR_TO_PADDR(prpage) / PAGE_SIZE < nheappages);
+
 	pr = allocpageref();
 	if (pr==NULL) {
 		/* Couldn't allocate accounting space for the new page. */
 		spinlock_release(&kmalloc_spinlock);
 		free_kpages(prpage);
 		kprintf("kmalloc: Subpage allocator couldn't get pageref\n");
-		return NULL;
+		return 0;
 	}
 
 	pr->pageaddr_and_blocktype = MKPAB(prpage, blktype);
@@ -1013,8 +1449,233 @@ subpage_kmalloc(size_t sz
 	pr->next_all = allbase;
 	allbase = pr;
 
-	/* This is kind of cheesy, but avoids duplicating the alloc code. */
-	goto doalloc;
+	heappages[KVADDR_TO_PADDR(prpage) / PAGE_SIZE] = pr;
+
+	/* The new page is first on the list now. */
+	goto again;
+}
+
+/*
+ * Put the N blocks in BLOCKS back on their heap pages, giving back
+ * any page that becomes entirely free.
+ */
+static
+void
+subpage_putblocks(void **blocks, unsigned n)
+{
+	int blktype;		// index into sizes[] that we're using
+	vaddr_t ptraddr;	// address of the block
+	struct pageref *pr;	// pageref for page we're freeing in
+	vaddr_t prpage;		// PR_PAGEADDR(pr)
+	struct freelist *fl;	// free list entry
+	vaddr_t offset;		// offset into page
+	vaddr_t prrefpage;	// pageref page to give back
+	unsigned i;
+
+	spinlock_acquire(&kmalloc_spinlock);
+
+	checksubpages();
+
+	for (i=0; i<n; i++) {
+		ptraddr = (vaddr_t)blocks[i];
+		pr = heappage_lookup(ptraddr);
+		KASSERT(pr != NULL);
+		checksubpage(pr);
+
+		prpage = PR_PAGEADDR(pr);
+		blktype = PR_BLOCKTYPE(pr);
+		offset = ptraddr - prpage;
+		KASSERT(blktype >= 0 && blktype < NSIZES);
+		KASSERT(offset < PAGE_SIZE && offset % sizes[blktype] == 0);
+
+		fl = (struct freelist *)ptraddr;
+		if (pr->freelist_offset == INVALID_OFFSET) {
+			fl->next = NULL;
+		} else {
+			fl->next = (struct freelist *)(prpage + pr->freelist_offset);
+
+			/* this block should not already be on the free list! */
+#ifdef SLOW
+			{
+				struct freelist *fl2;
+
+				for (fl2 = fl->next; fl2 != NULL; fl2 = fl2->next) {
+					KASSERT(fl2 != fl);
+				}
+			}
+#else
+			/* check just the head */
+			KASSERT(fl != fl->next);
+#endif
+		}
+		pr->freelist_offset = offset;
+		pr->nfree++;
+
+		KASSERT(pr->nfree <= PAGE_SIZE / sizes[blktype]);
+		if (pr->nfree == PAGE_SIZE / sizes[blktype]) {
+			/* Whole page is free. */
+			remove_lists(pr, blktype);
+			heappages[KVADDR_TO_PADDR(prpage) / PAGE_SIZE] = NULL;
+			prrefpage = freepageref(pr);
+			/* Call free_kpages without kmalloc_spinlock. */
+			spinlock_release(&kmalloc_spinlock);
+			free_kpages(prpage);
+			if (prrefpage != 0) {
+				free_kpages(prrefpage);
+			}
+			spinlock_acquire(&kmalloc_spinlock);
+		}
+	}
+
+	checksubpages();
+
+	spinlock_release(&kmalloc_spinlock);
+}
+
+
+/*
+ * Get a free block of type BLKTYPE from this cpu's magazine, or
+ * straight from the heap pages. Returns NULL if out of memory.
+ */
+static
+void *
+subpage_getblock(unsigned blktype)
+{
+	void *block;
+#ifdef MAGAZINES
+	struct kmcache *kc;
+	struct kmagazine *km;
+	int spl;
+
+	if (CURCPU_EXISTS()) {
+		spl = splhigh();
+		kc = &kmcaches[curcpu->c_number];
+		km = &kc->kc_mags[blktype];
+		kc->kc_allocs++;
+		if (km->km_count == 0) {
+			kc->kc_locks++;
+			km->km_count = subpage_getblocks(blktype,
+						km->km_blocks,
+						KMAG_BATCH(blktype));
+		}
+		if (km->km_count == 0) {
+			splx(spl);
+			return NULL;
+		}
+		block = km->km_blocks[--km->km_count];
+		splx(spl);
+		return block;
+	}
+	/* Too early in boot for the magazines */
+#endif
+
+	if (subpage_getblocks(blktype, &block, 1) == 0) {
+		return NULL;
+	}
+	return block;
+}
+
+/*
+ * Give back a free block of type BLKTYPE, to this cpu's magazine if
+ * it can take it. When the magazine is full the oldest half of it
+ * goes back to the heap pages first.
+ */
+static
+void
+subpage_putblock(unsigned blktype, void *block)
+{
+#ifdef MAGAZINES
+	struct kmcache *kc;
+	struct kmagazine *km;
+	unsigned i, batch;
+	int spl;
+
+	if (CURCPU_EXISTS()) {
+		spl = splhigh();
+		kc = &kmcaches[curcpu->c_number];
+		km = &kc->kc_mags[blktype];
+		kc->kc_frees++;
+
+		/* this block should not already be in the magazine! */
+		for (i=0; i<km->km_count; i++) {
+			KASSERT(km->km_blocks[i] != block);
+		}
+
+		if (km->km_count == KMAG_MAX(blktype)) {
+			kc->kc_locks++;
+			batch = KMAG_BATCH(blktype);
+			subpage_putblocks(km->km_blocks, batch);
+			for (i=batch; i<km->km_count; i++) {
+				km->km_blocks[i - batch] = km->km_blocks[i];
+			}
+			km->km_count -= batch;
+		}
+		km->km_blocks[km->km_count++] = block;
+		splx(spl);
+		return;
+	}
+#else
+	(void)blktype;
+#endif
+
+	subpage_putblocks(&block, 1);
+}
+
+/*
+ * Allocate a block of size SZ, where SZ is not large enough to
+ * warrant a whole-page allocation.
+ */
+static
+void *
+subpage_kmalloc(size_t sz
+#ifdef LABELS
+		, vaddr_t label
+#endif
+	)
+{
+	unsigned blktype;	// index into sizes[] that we're using
+	void *retptr;		// our result
+
+#ifdef GUARDS
+	size_t clientsz;
+#endif
+#ifdef PROFILE
+	size_t reqsz = sz;
+	struct malloclabel *ml;
+#endif
+
+#ifdef GUARDS
+	clientsz = sz;
+	sz += GUARD_OVERHEAD;
+#endif
+#ifdef LABELS
+#ifdef GUARDS
+	/* Include the label in what GUARDS considers the client data. */
+	clientsz += LABEL_PTROFFSET;
+#endif
+	sz += LABEL_PTROFFSET;
+#endif
+	blktype = blocktype(sz);
+#ifdef GUARDS
+	sz = sizes[blktype];
+#endif
+
+	retptr = subpage_getblock(blktype);
+	if (retptr == NULL) {
+		return NULL;
+	}
+#ifdef GUARDS
+	retptr = establishguardband(retptr, clientsz, sz);
+#endif
+#ifdef LABELS
+	retptr = establishlabel(retptr, label);
+#endif
+#ifdef PROFILE
+	ml = (struct malloclabel *)((char *)retptr - LABEL_PTROFFSET);
+	ml->size = reqsz;
+	kprof_alloc(label, (vaddr_t)retptr, reqsz, false);
+#endif
+	return retptr;
 }
 
 /*
@@ -1029,12 +1690,13 @@ subpage_kfree(void *ptr)
 	vaddr_t ptraddr;	// same as ptr
 	struct pageref *pr;	// pageref for page we're freeing in
 	vaddr_t prpage;		// PR_PAGEADDR(pr)
-	vaddr_t fla;		// free list entry address
-	struct freelist *fl;	// free list entry
 	vaddr_t offset;		// offset into page
 #ifdef GUARDS
 	size_t blocksize, smallerblocksize;
 #endif
+#ifdef PROFILE
+	struct malloclabel *ml;
+#endif
 
 	ptraddr = (vaddr_t)ptr;
 #ifdef GUARDS
@@ -1061,34 +1723,19 @@ subpage_kfree(void *ptr)
 	ptraddr -= LABEL_PTROFFSET;
 #endif
 
-	spinlock_acquire(&kmalloc_spinlock);
-
-	checksubpages();
-
-	/* Silence warnings with gcc 4.8 -Og (but not -O2) */
-	prpage = 0;
-	blktype = 0;
-
-	for (pr = allbase; pr; pr = pr->next_all) {
-		prpage = PR_PAGEADDR(pr);
-		blktype = PR_BLOCKTYPE(pr);
-		KASSERT(blktype >= 0 && blktype < NSIZES);
-
-		/* check for corruption */
-		KASSERT(blktype>=0 && blktype<NSIZES);
-		checksubpage(pr);
-
-		if (ptraddr >= prpage && ptraddr < prpage + PAGE_SIZE) {
-			break;
-		}
-	}
-
+	/*
+	 * No lock needed: if this is a valid block, its page's entry
+	 * can't change until we give the block back.
+	 */
+	pr = heappage_lookup(ptraddr);
 	if (pr==NULL) {
 		/* Not on any of our pages - not a subpage allocation */
-		spinlock_release(&kmalloc_spinlock);
 		return -1;
 	}
 
+	prpage = PR_PAGEADDR(pr);
+	blktype = PR_BLOCKTYPE(pr);
+	KASSERT(blktype >= 0 && blktype < NSIZES);
 	offset = ptraddr - prpage;
 
 	/* Check for proper positioning and alignment */
@@ -1096,6 +1743,12 @@ subpage_kfree(void *ptr)
 		panic("kfree: subpage free of invalid addr %p\n", ptr);
 	}
 
+#ifdef PROFILE
+	/* The label is just before the pointer we handed out */
+	ml = (struct malloclabel *)((char *)ptr - LABEL_PTROFFSET);
+	kprof_free(ml->label, ml->size);
+#endif
+
 #ifdef GUARDS
 	blocksize = sizes[blktype];
 	smallerblocksize = blktype > 0 ? sizes[blktype - 1] : 0;
@@ -1108,60 +1761,37 @@ subpage_kfree(void *ptr)
 	 */
 	fill_deadbeef((void *)ptraddr, sizes[blktype]);
 
-	/*
-	 * We probably ought to check for free twice by seeing if the block
-	 * is already on the free list. But that's expensive, so we don't.
-	 */
+	subpage_putblock(blktype, (void *)ptraddr);
 
-	fla = prpage + offset;
-	fl = (struct freelist *)fla;
-	if (pr->freelist_offset == INVALID_OFFSET) {
-		fl->next = NULL;
-	} else {
-		fl->next = (struct freelist *)(prpage + pr->freelist_offset);
+	return 0;
+}
 
-		/* this block should not already be on the free list! */
-#ifdef SLOW
-		{
-			struct freelist *fl2;
+//
+////////////////////////////////////////////////////////////
 
-			for (fl2 = fl->next; fl2 != NULL; fl2 = fl2->next) {
-				KASSERT(fl2 != fl);
-			}
-		}
-#else
-		/* check just the head */
-		KASSERT(fl != fl->next);
-#endif
-	}
-	pr->freelist_offset = offset;
-	pr->nfree++;
+/*
+ * Calls to kmalloc and kfree, for kheap_counts(). Statistics only, so
+ * updates are allowed to race.
+ */
+static unsigned kmalloc_calls;
+static unsigned kfree_calls;
 
-	KASSERT(pr->nfree <= PAGE_SIZE / sizes[blktype]);
-	if (pr->nfree == PAGE_SIZE / sizes[blktype]) {
-		/* Whole page is free. */
-		remove_lists(pr, blktype);
-		freepageref(pr);
-		/* Call free_kpages without kmalloc_spinlock. */
-		spinlock_release(&kmalloc_spinlock);
-		free_kpages(prpage);
-	}
-	else {
-		spinlock_release(&kmalloc_spinlock);
-	}
+void
+kheap_counts(unsigned *nallocs, unsigned *nfrees)
+{
+	*nallocs = kmalloc_calls;
+	*nfrees = kfree_calls;
+}
 
-#ifdef SLOWER /* Don't get the lock unless checksubpages does something. */
+void
+kheap_pagerefs(unsigned *npages, unsigned *ninuse)
+{
 	spinlock_acquire(&kmalloc_spinlock);
-	checksubpages();
+	*npages = npagerefpages;
+	*ninuse = npagerefs_inuse;
 	spinlock_release(&kmalloc_spinlock);
-#endif
-
-	return 0;
 }
 
-//
-////////////////////////////////////////////////////////////
-
 /*
  * Allocate a block of size SZ. Redirect either to subpage_kmalloc or
  * alloc_kpages depending on how big SZ is.
@@ -1174,6 +1804,8 @@ kmalloc(size_t sz)
 	vaddr_t label;
 #endif
 
+	kmalloc_calls++;
+
 #ifdef LABELS
 #ifdef __GNUC__
 	label = (vaddr_t)__builtin_return_address(0);
@@ -1194,6 +1826,9 @@ kmalloc(size_t sz)
 			return NULL;
 		}
 		KASSERT(address % PAGE_SIZE == 0);
+#ifdef PROFILE
+		kprof_alloc(label, address, sz, true);
+#endif
 
 		return (void *)address;
 	}
@@ -1211,13 +1846,19 @@ kmalloc(size_t sz)
 void
 kfree(void *ptr)
 {
+	if (ptr == NULL) {
+		return;
+	}
+	kfree_calls++;
+
 	/*
 	 * Try subpage first; if that fails, assume it's a big allocation.
 	 */
-	if (ptr == NULL) {
-		return;
-	} else if (subpage_kfree(ptr)) {
+	if (subpage_kfree(ptr)) {
 		KASSERT((vaddr_t)ptr%PAGE_SIZE==0);
+#ifdef PROFILE
+		kprof_freelarge((vaddr_t)ptr);
+#endif
 		free_kpages((vaddr_t)ptr);
 	}
 }
@@ -0,0 +1,271 @@
+/*
+ * Copyright (c) 2000, 2001, 2002, 2003, 2004, 2005, 2008, 2009
+ *	The President and Fellows of Harvard College.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE UNIVERSITY AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE UNIVERSITY OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * Object caches (see kmem.h).
+ */
+#include <types.h>
+#include <lib.h>
+#include <spinlock.h>
+#include <kmem.h>
+
+/*
+ * Each cache keeps up to KMEM_MAXIDLE constructed objects that nobody
+ * is using. Past that, freed objects are destroyed and go back to
+ * kmalloc.
+ */
+#define KMEM_MAXIDLE 16
+
+struct kmem_cache {
+	char *kc_name;
+	size_t kc_size;
+	int (*kc_ctor)(void *obj);
+	void (*kc_dtor)(void *obj);
+	struct kmem_cache *kc_next;	/* list of all caches */
+
+	struct spinlock kc_lock;	/* protects the rest */
+	void *kc_idle[KMEM_MAXIDLE];	/* constructed objects not in use */
+	unsigned kc_nidle;
+
+	/* statistics */
+	unsigned kc_inuse;		/* objects handed out now */
+	unsigned kc_allocs;		/* objects handed out ever */
+	unsigned kc_hits;		/* ...that were ready made */
+};
+
+/* All the caches, for kmem_reap() and kmem_printstats() */
+static struct kmem_cache *kmem_caches;
+static struct spinlock kmem_lock = SPINLOCK_INITIALIZER;
+
+struct kmem_cache *
+kmem_cache_create(const char *name, size_t size,
+		  int (*ctor)(void *obj), void (*dtor)(void *obj))
+{
+	struct kmem_cache *kc;
+
+	KASSERT(size > 0);
+
+	kc = kmalloc(sizeof(*kc));
+	if (kc == NULL) {
+		return NULL;
+	}
+	kc->kc_name = kstrdup(name);
+	if (kc->kc_name == NULL) {
+		kfree(kc);
+		return NULL;
+	}
+	kc->kc_size = size;
+	kc->kc_ctor = ctor;
+	kc->kc_dtor = dtor;
+	spinlock_init(&kc->kc_lock);
+	kc->kc_nidle = 0;
+	kc->kc_inuse = 0;
+	kc->kc_allocs = 0;
+	kc->kc_hits = 0;
+
+	spinlock_acquire(&kmem_lock);
+	kc->kc_next = kmem_caches;
+	kmem_caches = kc;
+	spinlock_release(&kmem_lock);
+
+	return kc;
+}
+
+/*
+ * Make a new object, or return NULL if out of memory.
+ */
+static
+void *
+kmem_construct(struct kmem_cache *kc)
+{
+	void *obj;
+
+	obj = kmalloc(kc->kc_size);
+	if (obj == NULL) {
+		return NULL;
+	}
+	if (kc->kc_ctor != NULL && kc->kc_ctor(obj)) {
+		kfree(obj);
+		return NULL;
+	}
+	return obj;
+}
+
+/*
+ * Get rid of an object for good.
+ */
+static
+void
+kmem_destruct(struct kmem_cache *kc, void *obj)
+{
+	if (kc->kc_dtor != NULL) {
+		kc->kc_dtor(obj);
+	}
+	kfree(obj);
+}
+
+/*
+ * Destroy the idle objects of one cache.
+ */
+static
+void
+kmem_cache_reap(struct kmem_cache *kc)
+{
+	void *idle[KMEM_MAXIDLE];
+	unsigned i, n;
+
+	spinlock_acquire(&kc->kc_lock);
+	n = kc->kc_nidle;
+	for (i=0; i<n; i++) {
+		idle[i] = kc->kc_idle[i];
+	}
+	kc->kc_nidle = 0;
+	spinlock_release(&kc->kc_lock);
+
+	for (i=0; i<n; i++) {
+		kmem_destruct(kc, idle[i]);
+	}
+}
+
+void
+kmem_cache_destroy(struct kmem_cache *kc)
+{
+	struct kmem_cache **p;
+
+	spinlock_acquire(&kmem_lock);
+	for (p = &kmem_caches; *p != kc; p = &(*p)->kc_next) {
+		KASSERT(*p != NULL);
+	}
+	*p = kc->kc_next;
+	spinlock_release(&kmem_lock);
+
+	KASSERT(kc->kc_inuse == 0);
+	kmem_cache_reap(kc);
+	spinlock_cleanup(&kc->kc_lock);
+	kfree(kc->kc_name);
+	kfree(kc);
+}
+
+void *
+kmem_cache_alloc(struct kmem_cache *kc)
+{
+	void *obj;
+	bool hit;
+
+	hit = false;
+	spinlock_acquire(&kc->kc_lock);
+	if (kc->kc_nidle > 0) {
+		obj = kc->kc_idle[--kc->kc_nidle];
+		hit = true;
+	}
+	spinlock_release(&kc->kc_lock);
+
+	if (!hit) {
+		obj = kmem_construct(kc);
+		if (obj == NULL) {
+			/* Try again after freeing what the caches hold */
+			kmem_reap();
+			obj = kmem_construct(kc);
+			if (obj == NULL) {
+				return NULL;
+			}
+		}
+	}
+
+	spinlock_acquire(&kc->kc_lock);
+	kc->kc_inuse++;
+	kc->kc_allocs++;
+	if (hit) {
+		kc->kc_hits++;
+	}
+	spinlock_release(&kc->kc_lock);
+
+	return obj;
+}
+
+void
+kmem_cache_free(struct kmem_cache *kc, void *obj)
+{
+	KASSERT(obj != NULL);
+
+	spinlock_acquire(&kc->kc_lock);
+	KASSERT(kc->kc_inuse > 0);
+	kc->kc_inuse--;
+	if (kc->kc_nidle < KMEM_MAXIDLE) {
+		kc->kc_idle[kc->kc_nidle++] = obj;
+		obj = NULL;
+	}
+	spinlock_release(&kc->kc_lock);
+
+	if (obj != NULL) {
+		kmem_destruct(kc, obj);
+	}
+}
+
+void
+kmem_reap(void)
+{
+	struct kmem_cache *kc;
+
+	spinlock_acquire(&kmem_lock);
+	for (kc = kmem_caches; kc != NULL; kc = kc->kc_next) {
+		kmem_cache_reap(kc);
+	}
+	spinlock_release(&kmem_lock);
+}
+
+void
+kmem_counts(unsigned *nallocs, unsigned *nhits)
+{
+	struct kmem_cache *kc;
+
+	*nallocs = *nhits = 0;
+	spinlock_acquire(&kmem_lock);
+	for (kc = kmem_caches; kc != NULL; kc = kc->kc_next) {
+		*nallocs += kc->kc_allocs;
+		*nhits += kc->kc_hits;
+	}
+	spinlock_release(&kmem_lock);
+}
+
+void
+kmem_printstats(void)
+{
+	struct kmem_cache *kc;
+
+	kprintf("Object caches:\n");
+	kprintf("name              size  in use  idle   allocs     hits\n");
+	spinlock_acquire(&kmem_lock);
+	for (kc = kmem_caches; kc != NULL; kc = kc->kc_next) {
+		kprintf("%-16s %5zu  %6u  %4u  %7u  %7u\n", kc->kc_name,
+			kc->kc_size, kc->kc_inuse, kc->kc_nidle,
+			kc->kc_allocs, kc->kc_hits);
+	}
+	spinlock_release(&kmem_lock);
+}
@@ -0,0 +1,382 @@
+/*
+ * Copyright (c) 2000, 2001, 2002, 2003, 2004, 2005, 2008, 2009
+ *	The President and Fellows of Harvard College.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE UNIVERSITY AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE UNIVERSITY OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * Virtually contiguous kernel memory: kvmalloc and kvfree (see lib.h).
+ *
+ * kmalloc hands out anything bigger than a page as physically
+ * contiguous frames in kseg0, which the buddy allocator can stop
+ * finding once memory has been chopped up for long enough, even with
+ * plenty of frames free. kvmalloc instead takes single frames, which
+ * can always be had while any are free, and maps them one after the
+ * other in kseg2.
+ *
+ * kseg2 is mapped through the TLB like user memory. Its mappings are
+ * kept in kvm_ptes[], one PTE per page of the window at KVM_BASE, and
+ * loaded by vm_fault() -> kvm_fault() when the kernel misses on them.
+ * The TLB entries are global, so they match whatever ASID is loaded
+ * and survive address space switches.
+ *
+ * A PTE is 0 (page free), a TLBLO value with TLBLO_VALID set (page
+ * mapped), or has KVM_PTE_RESERVED set (page taken but not mapped).
+ * Each allocation is followed by a reserved guard page, so running
+ * off the end of one faults rather than scribbling on the next, and
+ * kvfree finds the end of an allocation by looking for it. Pages
+ * being freed keep their frame number with KVM_PTE_RESERVED until
+ * every cpu has dropped them from its TLB, so using memory after
+ * freeing it faults too.
+ *
+ * Reserving and releasing pages of the window is done under kvm_lock.
+ * Otherwise a PTE belongs to whoever holds the allocation, and only
+ * changes in kvmalloc and kvfree. kvm_fault needs no lock: it can
+ * only be looking at a PTE that is live.
+ */
+#include <types.h>
+#include <kern/errno.h>
+#include <lib.h>
+#include <cpu.h>
+#include <spl.h>
+#include <spinlock.h>
+#include <membar.h>
+#include <current.h>
+#include <thread.h>
+#include <vm.h>
+#include <machine/tlb.h>
+#include <platform/maxcpus.h>
+
+/* The window: 16M of kseg2 */
+#define KVM_BASE	MIPS_KSEG2
+#define KVM_NPAGES	4096
+
+#define KVM_PTE_RESERVED 0x00000001
+
+static paddr_t kvm_ptes[KVM_NPAGES];
+static unsigned kvm_rotor;		/* where to start looking */
+static struct spinlock kvm_lock = SPINLOCK_INITIALIZER;
+
+/*
+ * Cpus that have loaded kseg2 mappings into their TLB, and so need
+ * telling when one goes away. Each cpu only sets its own.
+ */
+static volatile bool kvm_tlbused[MAXCPUS];
+
+/* statistics */
+static unsigned kvm_nallocs;		/* successful allocations */
+static unsigned kvm_nfailed;		/* failed allocations */
+static unsigned kvm_nmapped;		/* pages mapped now */
+static unsigned kvm_npeak;		/* most pages ever mapped */
+static unsigned kvm_nfaults;		/* TLB refills */
+static unsigned kvm_nshootdowns;	/* shootdown IPIs sent */
+
+#define KVM_INDEX(va) (((va) - KVM_BASE) / PAGE_SIZE)
+#define KVM_VADDR(ix) (KVM_BASE + (vaddr_t)(ix) * PAGE_SIZE)
+
+/*
+ * Look for N free pages in a row between FROM and TO. Called with
+ * kvm_lock held.
+ */
+static
+bool
+kvm_findrun(unsigned from, unsigned to, unsigned n, unsigned *ret)
+{
+	unsigned i, run;
+
+	run = 0;
+	for (i = from; i < to; i++) {
+		if (kvm_ptes[i] != 0) {
+			run = 0;
+			continue;
+		}
+		if (++run == n) {
+			*ret = i + 1 - n;
+			return true;
+		}
+	}
+	return false;
+}
+
+/*
+ * Give back the N pages of the window from IX, which must not be
+ * mapped in any TLB.
+ */
+static
+void
+kvm_release(unsigned ix, unsigned n)
+{
+	unsigned i;
+
+	spinlock_acquire(&kvm_lock);
+	for (i = ix; i < ix + n; i++) {
+		KASSERT(kvm_ptes[i] & KVM_PTE_RESERVED);
+		kvm_ptes[i] = 0;
+	}
+	spinlock_release(&kvm_lock);
+}
+
+/*
+ * Drop this cpu's TLB entries for the N pages from VADDR. Checks each
+ * entry rather than probing for each page, which is cheaper once
+ * there are more pages than a few.
+ */
+static
+void
+kvm_tlb_local(vaddr_t vaddr, unsigned n)
+{
+	uint32_t ehi, elo;
+	int i, spl;
+
+	spl = splhigh();
+	for (i = 0; i < NUM_TLB; i++) {
+		tlb_read(&ehi, &elo, i);
+		ehi &= TLBHI_VPAGE;
+		if (ehi >= vaddr && ehi - vaddr < n * PAGE_SIZE) {
+			tlb_write(TLBHI_INVALID(i), TLBLO_INVALID(), i);
+		}
+	}
+	splx(spl);
+}
+
+/*
+ * Make every cpu drop its TLB entries for the N pages from VADDR,
+ * and wait until they have.
+ */
+static
+void
+kvm_tlb_shootdown(vaddr_t vaddr, unsigned n)
+{
+	struct tlbshootdown ts;
+	volatile unsigned pending;
+	uint32_t targets;
+	unsigned c, me;
+	int spl;
+
+	/* We wait for other cpus' interrupt handlers */
+	KASSERT(curthread->t_curspl == 0);
+	KASSERT(curthread->t_iplhigh_count == 0);
+
+	ts.ts_as = NULL;
+	ts.ts_vaddr = vaddr;
+	ts.ts_npages = n;
+	ts.ts_pending = &pending;
+
+	/*
+	 * Stay on this cpu while flushing it and picking the others.
+	 * Sending may sleep, if a target's queue is full, and so move
+	 * us elsewhere; by then that does no harm.
+	 */
+	spl = splhigh();
+	me = curcpu->c_number;
+	kvm_tlb_local(vaddr, n);
+
+	targets = 0;
+	pending = 0;
+	for (c = 0; c < MAXCPUS; c++) {
+		if (c != me && kvm_tlbused[c]) {
+			targets |= (uint32_t)1 << c;
+			pending++;
+		}
+	}
+	for (c = 0; c < MAXCPUS; c++) {
+		if (targets & ((uint32_t)1 << c)) {
+			ipi_tlbshootdown(cpu_get(c), &ts);
+			kvm_nshootdowns++;
+		}
+	}
+	splx(spl);
+
+	while (pending > 0) {
+		/* Interrupts are on, so shootdowns sent to us still run */
+	}
+}
+
+void
+kvm_tlbshootdown(const struct tlbshootdown *ts)
+{
+	KASSERT(ts->ts_as == NULL);
+
+	kvm_tlb_local(ts->ts_vaddr, ts->ts_npages);
+	spinlock_acquire(&kvm_lock);
+	KASSERT(*ts->ts_pending > 0);
+	(*ts->ts_pending)--;
+	spinlock_release(&kvm_lock);
+}
+
+void *
+kvmalloc(size_t size)
+{
+	unsigned npages, ix, i;
+	vaddr_t page;
+
+	/* Nothing to gain for a page or less */
+	if (size <= PAGE_SIZE) {
+		return kmalloc(size);
+	}
+	npages = DIVROUNDUP(size, PAGE_SIZE);
+
+	/* Reserve the pages plus a guard page */
+	spinlock_acquire(&kvm_lock);
+	if (npages >= KVM_NPAGES ||
+	    (!kvm_findrun(kvm_rotor, KVM_NPAGES, npages + 1, &ix) &&
+	     !kvm_findrun(0, KVM_NPAGES, npages + 1, &ix))) {
+		kvm_nfailed++;
+		spinlock_release(&kvm_lock);
+		return NULL;
+	}
+	for (i = ix; i <= ix + npages; i++) {
+		kvm_ptes[i] = KVM_PTE_RESERVED;
+	}
+	kvm_rotor = ix + npages + 1;
+	spinlock_release(&kvm_lock);
+
+	for (i = 0; i < npages; i++) {
+		page = alloc_kpages(1);
+		if (page == 0) {
+			break;
+		}
+		kvm_ptes[ix + i] = (KVADDR_TO_PADDR(page) & PAGE_FRAME) |
+			TLBLO_GLOBAL | TLBLO_DIRTY | TLBLO_VALID;
+	}
+
+	if (i < npages) {
+		/* Out of memory; nothing has been near the TLB yet */
+		while (i-- > 0) {
+			page = PADDR_TO_KVADDR(kvm_ptes[ix + i] & PAGE_FRAME);
+			kvm_ptes[ix + i] = KVM_PTE_RESERVED;
+			free_kpages(page);
+		}
+		kvm_release(ix, npages + 1);
+		spinlock_acquire(&kvm_lock);
+		kvm_nfailed++;
+		spinlock_release(&kvm_lock);
+		return NULL;
+	}
+
+	/* Other cpus must see the PTEs before they see the pointer */
+	membar_store_store();
+
+	spinlock_acquire(&kvm_lock);
+	kvm_nallocs++;
+	kvm_nmapped += npages;
+	if (kvm_nmapped > kvm_npeak) {
+		kvm_npeak = kvm_nmapped;
+	}
+	spinlock_release(&kvm_lock);
+
+	return (void *)KVM_VADDR(ix);
+}
+
+void
+kvfree(void *ptr)
+{
+	vaddr_t va = (vaddr_t)ptr;
+	unsigned ix, npages, i;
+	paddr_t pte;
+
+	if (va < KVM_BASE) {
+		kfree(ptr);
+		return;
+	}
+
+	KASSERT(va % PAGE_SIZE == 0);
+	KASSERT(va < KVM_VADDR(KVM_NPAGES));
+	ix = KVM_INDEX(va);
+	KASSERT(kvm_ptes[ix] & TLBLO_VALID);
+
+	/* Unmap up to the guard page, keeping the frames */
+	for (npages = 0; kvm_ptes[ix + npages] & TLBLO_VALID; npages++) {
+		pte = kvm_ptes[ix + npages];
+		kvm_ptes[ix + npages] = (pte & PAGE_FRAME) | KVM_PTE_RESERVED;
+	}
+	KASSERT(kvm_ptes[ix + npages] == KVM_PTE_RESERVED);
+
+	kvm_tlb_shootdown(va, npages);
+
+	for (i = 0; i < npages; i++) {
+		free_kpages(PADDR_TO_KVADDR(kvm_ptes[ix + i] & PAGE_FRAME));
+		kvm_ptes[ix + i] = KVM_PTE_RESERVED;
+	}
+	kvm_release(ix, npages + 1);
+
+	spinlock_acquire(&kvm_lock);
+	kvm_nmapped -= npages;
+	spinlock_release(&kvm_lock);
+}
+
+/*
+ * Load the TLB entry for a kseg2 address, on behalf of vm_fault().
+ * The kernel may have any locks held, or interrupts off, so this
+ * takes no locks. Faults on pages that aren't mapped, including guard
+ * pages and freed memory, fail.
+ */
+int
+kvm_fault(int faulttype, vaddr_t faultaddress)
+{
+	uint32_t ehi;
+	paddr_t pte;
+	int idx, spl;
+
+	(void)faulttype;
+
+	if (faultaddress < KVM_BASE ||
+	    faultaddress >= KVM_VADDR(KVM_NPAGES)) {
+		return EFAULT;
+	}
+	pte = kvm_ptes[KVM_INDEX(faultaddress)];
+	if ((pte & TLBLO_VALID) == 0) {
+		return EFAULT;
+	}
+
+	ehi = faultaddress & TLBHI_VPAGE;
+	spl = splhigh();
+	kvm_tlbused[curcpu->c_number] = true;
+	idx = tlb_probe(ehi, 0);
+	if (idx >= 0) {
+		tlb_write(ehi, pte, idx);
+	}
+	else {
+		tlb_random(ehi, pte);
+	}
+	splx(spl);
+
+	kvm_nfaults++;
+	return 0;
+}
+
+/*
+ * Print statistics (for the "vm" menu command).
+ */
+void
+kvm_printstats(void)
+{
+	kprintf("kvmalloc: %u allocations, %u failed; %u pages mapped, "
+		"%u peak, of %u\n", kvm_nallocs, kvm_nfailed,
+		kvm_nmapped, kvm_npeak, KVM_NPAGES);
+	kprintf("kvmalloc: %u TLB refills, %u shootdowns\n",
+		kvm_nfaults, kvm_nshootdowns);
+}
@@ -0,0 +1,284 @@
+/*
+ * Copyright (c) 2000, 2001, 2002, 2003, 2004, 2005, 2008, 2009
+ *	The President and Fellows of Harvard College.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE UNIVERSITY AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE UNIVERSITY OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * Shared page cache for read-only executable text.
+ */
+
+#include <types.h>
+#include <lib.h>
+#include <spinlock.h>
+#include <vnode.h>
+#include <vm.h>
+#include <swap.h>
+#include <pagecache.h>
+
+#define PAGECACHE_BUCKETS 256
+#define PAGECACHE_VNODES 16
+
+struct pcentry {
+	struct vnode *pc_vn;
+	off_t pc_offset;
+	vaddr_t pc_kpage;
+	struct pcentry *pc_next;	/* hash chain */
+	struct pcentry *pc_vnext;	/* pages of the same vnode */
+};
+
+/* The cached pages of one vnode, which holds a reference to it */
+struct pcvnode {
+	struct vnode *pv_vn;
+	struct pcentry *pv_pages;
+	struct pcvnode *pv_next;
+};
+
+/* Hash chains and per-vnode page lists; protected by the paging lock */
+static struct pcentry *pagecache[PAGECACHE_BUCKETS];
+
+/*
+ * The vnodes with pages cached, and a generation count bumped by
+ * every invalidation. Changing either takes the paging lock and
+ * pagecache_lock both, so holding either one is enough to look;
+ * pagecache_invalidate() can then tell without the paging lock that a
+ * vnode has nothing cached, which is nearly always the case.
+ */
+static struct spinlock pagecache_lock = SPINLOCK_INITIALIZER;
+static struct pcvnode *pagecache_vnodes[PAGECACHE_VNODES];
+static unsigned pagecache_gen;
+
+static
+unsigned
+pagecache_hash(struct vnode *v, off_t offset)
+{
+	return ((uintptr_t)v / sizeof(struct vnode) +
+		(unsigned)(offset / PAGE_SIZE)) % PAGECACHE_BUCKETS;
+}
+
+/*
+ * Find the per-vnode record of V. Returns the link pointing at it,
+ * which points at NULL if V has no pages cached.
+ */
+static
+struct pcvnode **
+pagecache_findvnode(struct vnode *v)
+{
+	struct pcvnode **pvp;
+	unsigned h;
+
+	h = ((uintptr_t)v / sizeof(struct vnode)) % PAGECACHE_VNODES;
+	for (pvp = &pagecache_vnodes[h]; *pvp != NULL;
+	     pvp = &(*pvp)->pv_next) {
+		if ((*pvp)->pv_vn == v) {
+			break;
+		}
+	}
+	return pvp;
+}
+
+/* Take PC out of its hash chain and free it along with its page */
+static
+void
+pagecache_drop(struct pcentry *pc)
+{
+	struct pcentry **pp;
+
+	pp = &pagecache[pagecache_hash(pc->pc_vn, pc->pc_offset)];
+	while (*pp != pc) {
+		KASSERT(*pp != NULL);
+		pp = &(*pp)->pc_next;
+	}
+	*pp = pc->pc_next;
+	free_kpages(pc->pc_kpage);
+	kfree(pc);
+}
+
+/* Forget the vnode record *PVP, which has no pages left */
+static
+void
+pagecache_dropvnode(struct pcvnode **pvp)
+{
+	struct pcvnode *pv = *pvp;
+
+	KASSERT(pv->pv_pages == NULL);
+
+	spinlock_acquire(&pagecache_lock);
+	*pvp = pv->pv_next;
+	spinlock_release(&pagecache_lock);
+
+	VOP_DECREF(pv->pv_vn);
+	kfree(pv);
+}
+
+vaddr_t
+pagecache_lookup(struct vnode *v, off_t offset, unsigned *gen)
+{
+	struct pcentry *pc;
+
+	KASSERT(swap_i_hold());
+
+	spinlock_acquire(&pagecache_lock);
+	*gen = pagecache_gen;
+	spinlock_release(&pagecache_lock);
+
+	for (pc = pagecache[pagecache_hash(v, offset)]; pc != NULL;
+	     pc = pc->pc_next) {
+		if (pc->pc_vn == v && pc->pc_offset == offset) {
+			share_kpage(pc->pc_kpage);
+			return pc->pc_kpage;
+		}
+	}
+	return 0;
+}
+
+void
+pagecache_insert(struct vnode *v, off_t offset, vaddr_t kpage, unsigned gen)
+{
+	struct pcvnode **pvp, *pv;
+	struct pcentry *pc;
+	bool newpv;
+	unsigned h;
+
+	KASSERT(swap_i_hold());
+
+	pc = kmalloc(sizeof(*pc));
+	if (pc == NULL) {
+		return;
+	}
+
+	/* Only we can add or remove vnodes, so PVP stays good */
+	pvp = pagecache_findvnode(v);
+	pv = *pvp;
+	newpv = (pv == NULL);
+	if (newpv) {
+		pv = kmalloc(sizeof(*pv));
+		if (pv == NULL) {
+			kfree(pc);
+			return;
+		}
+		pv->pv_vn = v;
+		pv->pv_pages = NULL;
+		pv->pv_next = NULL;
+	}
+
+	spinlock_acquire(&pagecache_lock);
+	if (gen != pagecache_gen) {
+		/* The file may have changed while KPAGE was read */
+		spinlock_release(&pagecache_lock);
+		if (newpv) {
+			kfree(pv);
+		}
+		kfree(pc);
+		return;
+	}
+	if (newpv) {
+		*pvp = pv;
+	}
+	spinlock_release(&pagecache_lock);
+
+	if (newpv) {
+		VOP_INCREF(v);
+	}
+	share_kpage(kpage);
+
+	h = pagecache_hash(v, offset);
+	pc->pc_vn = v;
+	pc->pc_offset = offset;
+	pc->pc_kpage = kpage;
+	pc->pc_next = pagecache[h];
+	pagecache[h] = pc;
+	pc->pc_vnext = pv->pv_pages;
+	pv->pv_pages = pc;
+}
+
+void
+pagecache_purge(struct vnode *v)
+{
+	struct pcvnode **pvp, *pv;
+	struct pcentry **pp, *pc;
+
+	KASSERT(swap_i_hold());
+
+	pvp = pagecache_findvnode(v);
+	pv = *pvp;
+	if (pv == NULL) {
+		return;
+	}
+
+	pp = &pv->pv_pages;
+	while ((pc = *pp) != NULL) {
+		if (kpage_refcount(pc->pc_kpage) > 1) {
+			pp = &pc->pc_vnext;
+			continue;
+		}
+
+		/* Nobody but us maps it any more */
+		*pp = pc->pc_vnext;
+		pagecache_drop(pc);
+	}
+
+	if (pv->pv_pages == NULL) {
+		pagecache_dropvnode(pvp);
+	}
+}
+
+void
+pagecache_invalidate(struct vnode *v)
+{
+	struct pcvnode **pvp, *pv;
+	struct pcentry *pc;
+	bool cached, held;
+
+	spinlock_acquire(&pagecache_lock);
+	pagecache_gen++;
+	cached = (*pagecache_findvnode(v) != NULL);
+	spinlock_release(&pagecache_lock);
+	if (!cached) {
+		return;
+	}
+
+	held = swap_i_hold();
+	if (!held) {
+		swap_acquire();
+	}
+
+	/* It may have been purged meanwhile */
+	pvp = pagecache_findvnode(v);
+	pv = *pvp;
+	if (pv != NULL) {
+		/* Processes already running keep the frames they have mapped */
+		while ((pc = pv->pv_pages) != NULL) {
+			pv->pv_pages = pc->pc_vnext;
+			pagecache_drop(pc);
+		}
+		pagecache_dropvnode(pvp);
+	}
+
+	if (!held) {
+		swap_release();
+	}
+}
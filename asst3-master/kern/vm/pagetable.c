@@ -0,0 +1,289 @@
+/*
+ * Copyright (c) 2000, 2001, 2002, 2003, 2004, 2005, 2008, 2009
+ *	The President and Fellows of Harvard College.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE UNIVERSITY AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE UNIVERSITY OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * Two-level page table: a page of pointers to second-level pages of
+ * PTEs, indexed as in addrspace.h. Second-level tables are made the
+ * first time something in their 4M of address space is mapped. The
+ * layout is known to the UTLB refill handler in exception-mips1.S.
+ *
+ * Alongside it we keep a count of the PTEs in use in each second-level
+ * table, and a bitmap of which ones exist. A table is freed as soon as
+ * its count drops to zero, and pt_foreach() and pt_destroy() look only
+ * at tables in the bitmap, and in each only until they have seen all
+ * its PTEs. A process that uses a dozen pages is then copied and torn
+ * down in time proportional to a dozen pages, not a million PTEs.
+ *
+ * Second-level tables are added under the address space's PTE lock,
+ * and lookups need no lock: a table only goes away when its last PTE
+ * is removed, which nothing else can be looking up at the time except
+ * the refill handler on another cpu, which pt_remove() waits out.
+ */
+
+#include <types.h>
+#include <kern/errno.h>
+#include <lib.h>
+#include <spinlock.h>
+#include <addrspace.h>
+#include <vm.h>
+#include <pagetable.h>
+#include "opt-hashpt.h"
+
+#if !OPT_HASHPT		/* otherwise hashpt.c provides all this */
+
+#define L2COUNT_SIZE (PAGE_TABLE_SIZE * sizeof(uint16_t))
+
+#define L1MAP_TEST(as, i) ((as)->as_l1map[(i) / 32] & (1U << ((i) % 32)))
+#define L1MAP_SET(as, i)  ((as)->as_l1map[(i) / 32] |= 1U << ((i) % 32))
+#define L1MAP_CLR(as, i)  ((as)->as_l1map[(i) / 32] &= ~(1U << ((i) % 32)))
+
+/* Bytes used for page tables, for pt_stats() */
+static size_t pt_bytes, pt_peakbytes;
+static struct spinlock pt_bytes_lock = SPINLOCK_INITIALIZER;
+
+static
+void
+pt_account(ssize_t bytes)
+{
+	spinlock_acquire(&pt_bytes_lock);
+	pt_bytes += bytes;
+	if (pt_bytes > pt_peakbytes) {
+		pt_peakbytes = pt_bytes;
+	}
+	spinlock_release(&pt_bytes_lock);
+}
+
+void
+pt_bootstrap(void)
+{
+	/* nothing to do */
+}
+
+int
+pt_create(struct addrspace *as)
+{
+	as->as_l2count = kmalloc(L2COUNT_SIZE);
+	if (as->as_l2count == NULL) {
+		return ENOMEM;
+	}
+	as->page_table = (paddr_t **) alloc_kpages(1);
+	if (as->page_table == NULL) {
+		kfree(as->as_l2count);
+		return ENOMEM;
+	}
+	bzero(as->page_table, PAGE_TABLE_SIZE * sizeof(paddr_t *));
+	bzero(as->as_l2count, L2COUNT_SIZE);
+	bzero(as->as_l1map, sizeof(as->as_l1map));
+	pt_account(PAGE_SIZE + L2COUNT_SIZE);
+	return 0;
+}
+
+void
+pt_destroy(struct addrspace *as)
+{
+	for (int w = 0; w < PAGE_TABLE_SIZE / 32; w++) {
+		if (as->as_l1map[w] == 0) {
+			continue;
+		}
+		for (int pt1 = w * 32; pt1 < (w + 1) * 32; pt1++) {
+			if (L1MAP_TEST(as, pt1)) {
+				free_kpages((vaddr_t) as->page_table[pt1]);
+				pt_account(-PAGE_SIZE);
+			}
+		}
+	}
+	free_kpages((vaddr_t) as->page_table);
+	kfree(as->as_l2count);
+	pt_account(-(ssize_t) (PAGE_SIZE + L2COUNT_SIZE));
+	as->page_table = NULL;
+	as->as_l2count = NULL;
+}
+
+paddr_t *
+pt_lookup(struct addrspace *as, vaddr_t va)
+{
+	paddr_t *l2 = as->page_table[PT1_INDEX(va)];
+
+	if (l2 == NULL || l2[PT2_INDEX(va)] == 0) {
+		return NULL;
+	}
+	return &l2[PT2_INDEX(va)];
+}
+
+int
+pt_reserve(struct addrspace *as, vaddr_t va)
+{
+	paddr_t *l2;
+
+	if (as->page_table[PT1_INDEX(va)] != NULL) {
+		return 0;
+	}
+
+	/* A zeroed page is an empty table */
+	l2 = (paddr_t *) vm_alloc_page(true);
+	if (l2 == NULL) {
+		return ENOMEM;
+	}
+
+	spinlock_acquire(&as->as_ptlock);
+	if (as->page_table[PT1_INDEX(va)] == NULL) {
+		as->page_table[PT1_INDEX(va)] = l2;
+		L1MAP_SET(as, PT1_INDEX(va));
+		l2 = NULL;
+	}
+	spinlock_release(&as->as_ptlock);
+
+	if (l2 != NULL) {
+		/* Another thread got there first */
+		free_kpages((vaddr_t) l2);
+		return 0;
+	}
+	pt_account(PAGE_SIZE);
+	return 0;
+}
+
+paddr_t *
+pt_alloc(struct addrspace *as, vaddr_t va)
+{
+	paddr_t *l2 = as->page_table[PT1_INDEX(va)];
+
+	KASSERT(spinlock_do_i_hold(&as->as_ptlock));
+	KASSERT(l2 != NULL);
+
+	if (l2[PT2_INDEX(va)] == 0) {
+		as->as_l2count[PT1_INDEX(va)]++;
+	}
+	return &l2[PT2_INDEX(va)];
+}
+
+/*
+ * Free the second-level table L2, which held the PTE for VA and has
+ * just been unhooked from AS. Other threads of the process may be in
+ * the refill handler on other cpus, walking it with interrupts off; a
+ * shootdown waits until they are done.
+ */
+static
+void
+pt_freel2(struct addrspace *as, vaddr_t va, paddr_t *l2)
+{
+	as_tlb_shootdown(as, va, 1);
+	free_kpages((vaddr_t) l2);
+	pt_account(-PAGE_SIZE);
+}
+
+void
+pt_remove(struct addrspace *as, vaddr_t va)
+{
+	uint32_t pt1 = PT1_INDEX(va);
+	paddr_t *l2;
+
+	spinlock_acquire(&as->as_ptlock);
+	l2 = as->page_table[pt1];
+	KASSERT(l2 != NULL);
+	KASSERT(as->as_l2count[pt1] > 0);
+
+	l2[PT2_INDEX(va)] = 0;
+	if (--as->as_l2count[pt1] > 0) {
+		spinlock_release(&as->as_ptlock);
+		return;
+	}
+
+	/* Nothing left in it */
+	as->page_table[pt1] = NULL;
+	L1MAP_CLR(as, pt1);
+	spinlock_release(&as->as_ptlock);
+	pt_freel2(as, va, l2);
+}
+
+void
+pt_unreserve(struct addrspace *as, vaddr_t va)
+{
+	uint32_t pt1 = PT1_INDEX(va);
+	paddr_t *l2;
+
+	spinlock_acquire(&as->as_ptlock);
+	l2 = as->page_table[pt1];
+	if (l2 == NULL || as->as_l2count[pt1] > 0) {
+		spinlock_release(&as->as_ptlock);
+		return;
+	}
+	as->page_table[pt1] = NULL;
+	L1MAP_CLR(as, pt1);
+	spinlock_release(&as->as_ptlock);
+	pt_freel2(as, va, l2);
+}
+
+int
+pt_foreach(struct addrspace *as, pt_func func, void *data)
+{
+	paddr_t *l2;
+	unsigned left;
+	int result;
+
+	for (int w = 0; w < PAGE_TABLE_SIZE / 32; w++) {
+		if (as->as_l1map[w] == 0) {
+			continue;
+		}
+		for (int pt1 = w * 32; pt1 < (w + 1) * 32; pt1++) {
+			if (!L1MAP_TEST(as, pt1)) {
+				continue;
+			}
+			l2 = as->page_table[pt1];
+			left = as->as_l2count[pt1];
+			for (int pt2 = 0; left > 0; pt2++) {
+				KASSERT(pt2 < PAGE_TABLE_SIZE);
+				if (l2[pt2] == 0) {
+					continue;
+				}
+				left--;
+				result = func(as, ((vaddr_t) pt1 << 22) | ((vaddr_t) pt2 << 12),
+					      &l2[pt2], data);
+				if (result) {
+					return result;
+				}
+			}
+		}
+	}
+	return 0;
+}
+
+vaddr_t
+pt_hwbase(struct addrspace *as)
+{
+	return (vaddr_t) as->page_table;
+}
+
+void
+pt_stats(size_t *bytes, size_t *peakbytes)
+{
+	*bytes = pt_bytes;
+	*peakbytes = pt_peakbytes;
+}
+
+#endif /* !OPT_HASHPT */
@@ -0,0 +1,261 @@
+/*
+ * Copyright (c) 2000, 2001, 2002, 2003, 2004, 2005, 2008, 2009
+ *	The President and Fellows of Harvard College.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE UNIVERSITY AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE UNIVERSITY OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * Swap space management and page-out.
+ */
+
+#include <types.h>
+#include <kern/errno.h>
+#include <kern/stat.h>
+#include <lib.h>
+#include <bitmap.h>
+#include <uio.h>
+#include <synch.h>
+#include <spinlock.h>
+#include <vnode.h>
+#include <vfs.h>
+#include <addrspace.h>
+#include <vm.h>
+#include <machine/tlb.h>
+#include <swap.h>
+#include <pagetable.h>
+
+static struct vnode *swap_vnode;	/* raw swap device, or NULL */
+static struct bitmap *swap_map;		/* slots in use */
+static unsigned swap_nslots;
+static struct lock *swap_lock;		/* the paging lock */
+
+/* Bounce buffer for swap_copy; protected by swap_lock */
+static char swap_buf[PAGE_SIZE];
+
+void
+swap_bootstrap(void)
+{
+	struct stat st;
+	int result;
+
+	swap_lock = lock_create("swap");
+	if (swap_lock == NULL) {
+		panic("swap_bootstrap: Out of memory\n");
+	}
+
+	result = vfs_swapon(SWAP_DEVICE, &swap_vnode);
+	if (result) {
+		kprintf("swap: %s: %s; running without swap\n",
+			SWAP_DEVICE, strerror(result));
+		swap_vnode = NULL;
+		return;
+	}
+
+	result = VOP_STAT(swap_vnode, &st);
+	if (result) {
+		panic("swap_bootstrap: stat %s: %s\n", SWAP_DEVICE,
+		      strerror(result));
+	}
+
+	swap_nslots = st.st_size / PAGE_SIZE;
+	swap_map = bitmap_create(swap_nslots);
+	if (swap_map == NULL) {
+		panic("swap_bootstrap: Out of memory\n");
+	}
+
+	kprintf("swap: %u pages on %s\n", swap_nslots, SWAP_DEVICE);
+}
+
+void
+swap_acquire(void)
+{
+	lock_acquire(swap_lock);
+}
+
+void
+swap_release(void)
+{
+	lock_release(swap_lock);
+}
+
+bool
+swap_i_hold(void)
+{
+	return lock_do_i_hold(swap_lock);
+}
+
+/*
+ * Transfer one page between swap slot SLOT and kernel address KPAGE.
+ */
+static
+int
+swap_io(unsigned slot, vaddr_t kpage, enum uio_rw rw)
+{
+	struct iovec iov;
+	struct uio ku;
+	int result;
+
+	KASSERT(slot < swap_nslots);
+
+	uio_kinit(&iov, &ku, (void *)kpage, PAGE_SIZE,
+		  (off_t)slot * PAGE_SIZE, rw);
+	if (rw == UIO_READ) {
+		result = VOP_READ(swap_vnode, &ku);
+	}
+	else {
+		result = VOP_WRITE(swap_vnode, &ku);
+	}
+	if (result) {
+		return result;
+	}
+	if (ku.uio_resid != 0) {
+		/* Short transfer: the device is smaller than it said */
+		return EIO;
+	}
+	return 0;
+}
+
+int
+swap_evict(void)
+{
+	struct addrspace *as;
+	vaddr_t kpage, va;
+	paddr_t *pte, oldpte;
+	unsigned slot;
+	int result;
+
+	KASSERT(swap_i_hold());
+
+	if (swap_vnode == NULL) {
+		return ENOMEM;
+	}
+	if (bitmap_alloc(swap_map, &slot)) {
+		/* Swap is full */
+		return ENOMEM;
+	}
+
+	kpage = kpage_victim(&as, &va);
+	if (kpage == 0) {
+		bitmap_unmark(swap_map, slot);
+		return ENOMEM;
+	}
+
+	/*
+	 * Unmap the page before writing it out, so the owner faults
+	 * (and waits for us) rather than changing it underneath us.
+	 * The owner's PTE lock makes its faults in progress either
+	 * finish with the page first, and be shot down, or see it
+	 * gone. Anything that could remove the PTE holds the paging
+	 * lock. But a copy-on-write fault that started while the frame
+	 * was still shared can replace it without: then it is about to
+	 * be freed anyway, and we let it go.
+	 */
+	spinlock_acquire(&as->as_ptlock);
+	pte = pt_lookup(as, va);
+	KASSERT(pte != NULL);
+	oldpte = *pte;
+	if ((oldpte & TLBLO_VALID) == 0 ||
+	    (oldpte & PAGE_FRAME) != KVADDR_TO_PADDR(kpage)) {
+		spinlock_release(&as->as_ptlock);
+		bitmap_unmark(swap_map, slot);
+		return 0;
+	}
+	*pte = PTE_MKSWAP(slot);
+	spinlock_release(&as->as_ptlock);
+	as_tlb_shootdown(as, va, 1);
+
+	result = swap_io(slot, kpage, UIO_WRITE);
+	if (result) {
+		spinlock_acquire(&as->as_ptlock);
+		*pte = oldpte;
+		spinlock_release(&as->as_ptlock);
+		kpage_setowner(kpage, as, va);
+		bitmap_unmark(swap_map, slot);
+		return result;
+	}
+
+	free_kpages(kpage);
+	VM_STAT(as, vs_framefree);
+	vm_stat_rss(as, -1);
+	return 0;
+}
+
+int
+swap_read(unsigned slot, vaddr_t kpage)
+{
+	KASSERT(swap_i_hold());
+	KASSERT(bitmap_isset(swap_map, slot));
+
+	return swap_io(slot, kpage, UIO_READ);
+}
+
+int
+swap_pagein(unsigned slot, vaddr_t kpage)
+{
+	int result;
+
+	result = swap_read(slot, kpage);
+	if (result) {
+		return result;
+	}
+	bitmap_unmark(swap_map, slot);
+	return 0;
+}
+
+int
+swap_copy(unsigned slot, unsigned *ret)
+{
+	unsigned newslot;
+	int result;
+
+	KASSERT(swap_i_hold());
+	KASSERT(bitmap_isset(swap_map, slot));
+
+	if (bitmap_alloc(swap_map, &newslot)) {
+		return ENOMEM;
+	}
+
+	result = swap_io(slot, (vaddr_t)swap_buf, UIO_READ);
+	if (result == 0) {
+		result = swap_io(newslot, (vaddr_t)swap_buf, UIO_WRITE);
+	}
+	if (result) {
+		bitmap_unmark(swap_map, newslot);
+		return result;
+	}
+
+	*ret = newslot;
+	return 0;
+}
+
+void
+swap_free(unsigned slot)
+{
+	KASSERT(swap_i_hold());
+	KASSERT(bitmap_isset(swap_map, slot));
+
+	bitmap_unmark(swap_map, slot);
+}
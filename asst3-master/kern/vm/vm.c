@@ -1,7 +1,9 @@
 #include <types.h>
+#include <kern/vmstat.h>
 #include <kern/errno.h>
 #include <lib.h>
 #include <thread.h>
+#include <synch.h>
 #include <addrspace.h>
 #include <vm.h>
 #include <machine/tlb.h>
@@ -9,44 +11,670 @@
 #include <current.h>
 #include <proc.h>
 #include <copyinout.h>
+#include <swap.h>
+#include <uio.h>
+#include <vnode.h>
+#include <pagecache.h>
+#include <pagetable.h>
 
 
 /* Place your page table functions here */
 
-int
-vm_create_l1_pte(paddr_t **page_table, uint32_t pt1)
+/*
+ * Locking.
+ *
+ * A fault holds its address space's as_lock for reading, so the
+ * threads of a process fault in parallel, on different cpus, with no
+ * global lock; changing the regions or taking pages away (sbrk, mmap,
+ * munmap, fork) holds it for writing. The page table itself is only
+ * changed under the address space's as_ptlock spinlock. A fault does
+ * the slow part of getting a page (allocating it, reading it in,
+ * copying it) with neither held, then installs the page with
+ * vm_pte_install() only if the PTE still holds what it did when the
+ * fault looked at it. If not, another thread got there first: the
+ * page is thrown away and the access simply tried again.
+ *
+ * The paging lock (swap_acquire) is taken only to page in or out and
+ * for the page cache. Page-out changes its victim's PTE under the
+ * victim's as_ptlock, so a fault that looked at a PTE before it was
+ * paged out fails to install over it and tries again, and waits for
+ * the page-out to finish when it does.
+ *
+ * Lock order: as_lock, paging lock, as_ptlock, frame table spinlock.
+ * Nothing that may sleep or send a shootdown is done with as_ptlock
+ * held.
+ */
+
+/*
+ * Statistics for the whole system. The frame counts here are only
+ * those for user pages; vm_getstats() reports the allocator's own.
+ */
+struct vmstat vm_stats;
+static struct spinlock vm_stat_lock = SPINLOCK_INITIALIZER;
+
+unsigned
+vm_fault_count(void)
 {
-    KASSERT(page_table[pt1] == NULL);
+    return vm_stats.vs_readfaults + vm_stats.vs_writefaults +
+        vm_stats.vs_readonlyfaults;
+}
 
-    /* Create PAGE_TABLE_SIZE pt1 */
-    page_table[pt1] = (paddr_t *) kmalloc(sizeof(paddr_t) * PAGE_TABLE_SIZE);
-    if (page_table[pt1] == NULL) {
-        return ENOMEM;
+/*
+ * Account for NPAGES (possibly negative) more pages being mapped in
+ * AS.
+ */
+void
+vm_stat_rss(struct addrspace *as, int npages)
+{
+    spinlock_acquire(&vm_stat_lock);
+    as->as_stats.vs_rss += npages;
+    if (as->as_stats.vs_rss > as->as_stats.vs_peakrss) {
+        as->as_stats.vs_peakrss = as->as_stats.vs_rss;
     }
-    
-    /* Zero the pages */
-    for (int pt2 = 0; pt2 < PAGE_TABLE_SIZE; pt2++) {
-        page_table[pt1][pt2] = 0;
+    vm_stats.vs_rss += npages;
+    if (vm_stats.vs_rss > vm_stats.vs_peakrss) {
+        vm_stats.vs_peakrss = vm_stats.vs_rss;
+    }
+    spinlock_release(&vm_stat_lock);
+}
+
+/*
+ * Get the statistics of AS, or of the whole system if AS is NULL.
+ */
+void
+vm_getstats(struct addrspace *as, struct vmstat *vs)
+{
+    if (as != NULL) {
+        *vs = as->as_stats;
+        return;
+    }
+    *vs = vm_stats;
+    kpages_counts(&vs->vs_framealloc, &vs->vs_framefree);
+}
+
+/*
+ * Print the system-wide statistics (for the "vm" menu command).
+ */
+void
+vm_printstats(void)
+{
+    struct vmstat vs;
+
+    vm_getstats(NULL, &vs);
+    kprintf("Page faults: %u read, %u write, %u read-only\n",
+            vs.vs_readfaults, vs.vs_writefaults, vs.vs_readonlyfaults);
+    kprintf("Zero-filled pages: %u\n", vs.vs_zerofills);
+    kprintf("TLB: %u refills in vm_fault, %u address space flushes\n",
+            vs.vs_tlbrefills, vs.vs_tlbflushes);
+    kprintf("TLB shootdowns: %u, %u us waiting\n",
+            vs.vs_shootdowns, vs.vs_shootdownusec);
+    kprintf("Frames: %u allocated, %u freed\n",
+            vs.vs_framealloc, vs.vs_framefree);
+    kprintf("User pages mapped: %u, %u peak\n", vs.vs_rss, vs.vs_peakrss);
+    kvm_printstats();
+}
+
+/*
+ * A frame of zeroes, mapped read-only wherever untouched anonymous
+ * memory is read. A write fault replaces it with a private frame.
+ * Mappings of it are not reference counted (there can be more of them
+ * than the frame table can count), so nothing must free it through a
+ * PTE: use vm_pte_iszero(). The one reference it does hold is doubled
+ * at boot, which keeps page replacement away from it.
+ */
+static vaddr_t zero_page;
+
+bool
+vm_pte_iszero(paddr_t pte)
+{
+    return (pte & TLBLO_VALID) &&
+        (pte & PAGE_FRAME) == (KVADDR_TO_PADDR(zero_page) & PAGE_FRAME);
+}
+
+static paddr_t
+vm_zero_pte(void)
+{
+    return (KVADDR_TO_PADDR(zero_page) & PAGE_FRAME) | TLBLO_VALID;
+}
+
+/*
+ * Does the page at VADDR in REG get any of its contents from a file?
+ * If not it starts out all zeroes.
+ */
+static bool
+vm_page_hasfile(struct region *reg, vaddr_t vaddr)
+{
+    return reg->vn != NULL &&
+        vaddr < reg->file_vaddr + reg->file_size &&
+        vaddr + PAGE_SIZE > reg->file_vaddr;
+}
+
+/*
+ * Allocate a frame for user memory or a page table, paging something
+ * out if physical memory is full. If ZEROED, the frame is cleared
+ * (from the pre-zeroed pool when possible). Takes the paging lock to
+ * page out, unless the caller holds it already.
+ */
+vaddr_t
+vm_alloc_page(bool zeroed)
+{
+    vaddr_t page;
+    bool held;
+
+    page = zeroed ? alloc_zeroed_kpage() : alloc_kpages(1);
+    if (page != 0) {
+        return page;
+    }
+
+    held = swap_i_hold();
+    if (!held) {
+        swap_acquire();
+    }
+    while ((page = zeroed ? alloc_zeroed_kpage() : alloc_kpages(1)) == 0) {
+        if (swap_evict()) {
+            break;
+        }
+    }
+    if (!held) {
+        swap_release();
+    }
+    return page;
+}
+
+/*
+ * Load the PTE at PTE, which maps FAULTADDRESS, into the TLB,
+ * replacing any stale entry, and tell page replacement the page is in
+ * use. Called with the PTE lock held.
+ */
+static void
+vm_tlb_write(struct addrspace *as, vaddr_t faultaddress, paddr_t *pte)
+{
+    uint32_t ehi, elo;
+    int idx;
+
+    KASSERT(spinlock_do_i_hold(&as->as_ptlock));
+    KASSERT(*pte & TLBLO_VALID);
+
+    ehi = as_tlbhi(as, faultaddress);
+    KASSERT(ehi != 0);
+    *pte |= PTE_REFERENCED;
+    elo = *pte & ~PTE_REFERENCED;
+    idx = tlb_probe(ehi, 0);
+    if (idx >= 0) {
+        tlb_write(ehi, elo, idx);
+    } else {
+        tlb_random(ehi, elo);
+    }
+    kpage_setowner(PADDR_TO_KVADDR(elo & PAGE_FRAME), as, faultaddress & PAGE_FRAME);
+}
+
+/*
+ * Load the PTE for FAULTADDRESS into the TLB, if the page is still in
+ * memory. If it has just been paged out, the access faults again.
+ */
+static void
+vm_tlb_load(struct addrspace *as, vaddr_t faultaddress)
+{
+    paddr_t *pte;
+
+    spinlock_acquire(&as->as_ptlock);
+    pte = pt_lookup(as, faultaddress);
+    if (pte != NULL && (*pte & TLBLO_VALID)) {
+        vm_tlb_write(as, faultaddress, pte);
+    }
+    spinlock_release(&as->as_ptlock);
+}
+
+/*
+ * Make NEWPTE the PTE for FAULTADDRESS, provided it still holds OLDPTE
+ * (0 for none; the referenced bit doesn't count), and if LOAD put it
+ * in the TLB. Returns false, having done nothing, if another thread
+ * changed the PTE first. Room for a new PTE must have been made with
+ * pt_reserve().
+ */
+static bool
+vm_pte_install(struct addrspace *as, vaddr_t faultaddress, paddr_t oldpte,
+               paddr_t newpte, bool load)
+{
+    paddr_t *pte;
+    bool ok;
+
+    KASSERT(newpte != 0);
+
+    spinlock_acquire(&as->as_ptlock);
+    if (oldpte == 0) {
+        pte = pt_alloc(as, faultaddress);
+    } else {
+        pte = pt_lookup(as, faultaddress);
+        KASSERT(pte != NULL);
+    }
+    ok = ((*pte ^ oldpte) & ~PTE_REFERENCED) == 0;
+    if (ok) {
+        *pte = newpte;
+        if (load) {
+            vm_tlb_write(as, faultaddress, pte);
+        } else if (newpte & TLBLO_VALID) {
+            kpage_setowner(PADDR_TO_KVADDR(newpte & PAGE_FRAME), as,
+                           faultaddress & PAGE_FRAME);
+        }
+    }
+    spinlock_release(&as->as_ptlock);
+    return ok;
+}
+
+/*
+ * Test and clear the referenced bit of the page mapped at VADDR in AS.
+ * Also drop the page's TLB entry, so that the next use refills it and
+ * sets the bit again. Only this cpu's: the bit is a hint, and we are
+ * called with the frame table locked, where we can't wait for other
+ * cpus. Actually paging the page out shoots it down everywhere.
+ *
+ * Nor can we take the PTE lock here (it comes before the frame table
+ * lock), so the bit is cleared with pte_cas(): if anything else
+ * changes the PTE at the same time, the page counts as used.
+ */
+bool
+vm_page_referenced(struct addrspace *as, vaddr_t vaddr)
+{
+    paddr_t *pte = pt_lookup(as, vaddr);
+    paddr_t old;
+
+    KASSERT(pte != NULL);
+    old = *pte;
+    if ((old & PTE_REFERENCED) == 0) {
+        return false;
+    }
+    if (pte_cas(pte, old, old & ~PTE_REFERENCED)) {
+        vm_tlb_invalidate(as, vaddr);
+    }
+    return true;
+}
+
+void
+vm_tlb_invalidate(struct addrspace *as, vaddr_t vaddr)
+{
+    int spl = splhigh();
+    uint32_t ehi = as_tlbhi(as, vaddr);
+    if (ehi != 0) {
+        int idx = tlb_probe(ehi, 0);
+        if (idx >= 0) {
+            tlb_write(TLBHI_INVALID(idx), TLBLO_INVALID(), idx);
+        }
+    }
+    splx(spl);
+}
+
+/*
+ * Handle a write to a page that is mapped read-only. If the region is
+ * writable the page is shared copy-on-write: take a private copy of
+ * the frame (or a fresh one in place of the zero page) unless we are
+ * already its last user, then make the PTE writable and update the TLB
+ * entry that faulted. OLDPTE is the page's PTE when the fault looked.
+ */
+static int
+vm_break_cow(struct addrspace *as, vaddr_t faultaddress, paddr_t oldpte)
+{
+    struct region *reg;
+    paddr_t pte;
+    vaddr_t frame, copy;
+
+    KASSERT(oldpte & TLBLO_VALID);
+
+    /* Genuinely read-only */
+    reg = as_find_region(as, faultaddress);
+    if (reg == NULL || !reg->w) {
+        return EFAULT;
+    }
+
+    frame = PADDR_TO_KVADDR(oldpte & PAGE_FRAME);
+    copy = 0;
+    if (vm_pte_iszero(oldpte)) {
+        /* First write to anonymous memory */
+        copy = vm_alloc_page(true);
+        if (copy == 0) {
+            return ENOMEM;
+        }
+        pte = (KVADDR_TO_PADDR(copy) & PAGE_FRAME) | TLBLO_VALID;
+    } else if (kpage_refcount(frame) > 1) {
+        copy = vm_alloc_page(false);
+        if (copy == 0) {
+            return ENOMEM;
+        }
+        memmove((void *) copy, (const void *) frame, PAGE_SIZE);
+        pte = (KVADDR_TO_PADDR(copy) & PAGE_FRAME) | TLBLO_VALID;
+    } else {
+        pte = oldpte & ~PTE_REFERENCED;
+    }
+    pte |= TLBLO_DIRTY;
+
+    /* The same frame, just writable now: update the TLB entry */
+    if (copy == 0) {
+        vm_pte_install(as, faultaddress, oldpte, pte, true);
+        return 0;
+    }
+
+    if (!vm_pte_install(as, faultaddress, oldpte, pte, false)) {
+        /* Someone else broke it (or it was paged out); try again */
+        free_kpages(copy);
+        return 0;
     }
+    VM_STAT(as, vs_framealloc);
+
+    /*
+     * Other cpus running this address space must stop reading the
+     * old frame before we drop our reference to it.
+     */
+    as_tlb_shootdown(as, faultaddress & PAGE_FRAME, 1);
+    if (!vm_pte_iszero(oldpte)) {
+        free_kpages(frame);
+        VM_STAT(as, vs_framefree);
+    }
+    vm_tlb_load(as, faultaddress);
 
     return 0;
 }
 
+/*
+ * Move the page at KPAGE, which maps user address VADDR in the file
+ * backed region REG, to or from the file: only the part of the page
+ * the file covers. Reads fill in new, zeroed pages; writes are the
+ * writeback of mmap() regions.
+ */
+static int
+vm_page_io(struct region *reg, vaddr_t vaddr, vaddr_t kpage, enum uio_rw rw)
+{
+    struct iovec iov;
+    struct uio ku;
+    vaddr_t start, end;
+    int res;
+
+    start = vaddr > reg->file_vaddr ? vaddr : reg->file_vaddr;
+    end = reg->file_vaddr + reg->file_size;
+    if (end > vaddr + PAGE_SIZE) {
+        end = vaddr + PAGE_SIZE;
+    }
+    if (start >= end) {
+        /* All bss */
+        return 0;
+    }
 
+    uio_kinit(&iov, &ku, (void *) (kpage + (start - vaddr)), end - start,
+              reg->file_offset + (start - reg->file_vaddr), rw);
+    res = (rw == UIO_READ) ? VOP_READ(reg->vn, &ku) : VOP_WRITE(reg->vn, &ku);
+    if (res) {
+        return res;
+    }
+    if (ku.uio_resid != 0 && rw == UIO_READ && !reg->mmapped) {
+        /* short read; problem with executable? */
+        kprintf("ELF: short read on segment - file truncated?\n");
+        return ENOEXEC;
+    }
+    return 0;
+}
+
+/*
+ * Write the modified pages of REG, a region mapped with mmap(), back
+ * to its file. Each page is write-protected again before it is
+ * written, so a write made while that is under way is noticed next
+ * time. We can't tell whether a page out on swap has been written
+ * since it was last written back, so those are always written.
+ * Called with the paging lock held, and as_lock unless AS is being
+ * destroyed.
+ */
 int
-vm_create_l2_pte(paddr_t **page_table, uint32_t pt1, uint32_t pt2, uint32_t dirty)
+vm_msync(struct addrspace *as, struct region *reg)
+{
+    vaddr_t va, end, kpage, bounce = 0;
+    paddr_t *pte, old;
+    bool written = false;
+    int res = 0;
+
+    KASSERT(swap_i_hold());
+    KASSERT(reg->mmapped);
+
+    end = reg->file_vaddr + reg->file_size;
+    for (va = reg->vbase; va < end; va += PAGE_SIZE) {
+        pte = pt_lookup(as, va);
+        if (pte == NULL) {
+            continue;
+        }
+
+        /* Paging is locked out, so the page stays where it is */
+        old = *pte;
+        if (old & PTE_SWAPPED) {
+            if (bounce == 0) {
+                bounce = vm_alloc_page(false);
+                if (bounce == 0) {
+                    res = ENOMEM;
+                    break;
+                }
+            }
+            /* The PTE still names the slot, so it must not be freed */
+            res = swap_read(PTE_SWAPSLOT(old), bounce);
+            if (res) {
+                break;
+            }
+            kpage = bounce;
+        } else if ((old & TLBLO_VALID) && (old & TLBLO_DIRTY)) {
+            kpage = PADDR_TO_KVADDR(old & PAGE_FRAME);
+            spinlock_acquire(&as->as_ptlock);
+            *pte &= ~TLBLO_DIRTY;
+            spinlock_release(&as->as_ptlock);
+            as_tlb_shootdown(as, va, 1);
+        } else {
+            continue;
+        }
+
+        written = true;
+        res = vm_page_io(reg, va, kpage, UIO_WRITE);
+        if (res) {
+            if (kpage != bounce) {
+                /* Still needs writing */
+                spinlock_acquire(&as->as_ptlock);
+                *pte |= TLBLO_DIRTY;
+                spinlock_release(&as->as_ptlock);
+            }
+            break;
+        }
+    }
+
+    if (written) {
+        /* Anything running this file from now on must see the change */
+        pagecache_invalidate(reg->vn);
+    }
+    if (bounce != 0) {
+        free_kpages(bounce);
+    }
+    return res;
+}
+
+/*
+ * Bring a page back in from swap. OLDPTE is its PTE when the fault
+ * looked.
+ */
+static int
+vm_swapin(struct addrspace *as, vaddr_t faultaddress, paddr_t oldpte)
 {
-    KASSERT(page_table[pt1][pt2] == 0);
+    struct region *reg;
+    paddr_t pte;
+    vaddr_t page;
+    int res;
+
+    reg = as_find_region(as, faultaddress);
+    KASSERT(reg != NULL);
+
+    swap_acquire();
 
-    vaddr_t v_page = alloc_kpages(1);
-    if (v_page == 0)
+    /* Another thread may have brought it in while we waited */
+    if (*pt_lookup(as, faultaddress) != oldpte) {
+        swap_release();
+        return 0;
+    }
+
+    page = vm_alloc_page(false);
+    if (page == 0) {
+        swap_release();
         return ENOMEM;
+    }
 
-    page_table[pt1][pt2] = (KVADDR_TO_PADDR(v_page) & PAGE_FRAME) | dirty | TLBLO_VALID;
+    res = swap_pagein(PTE_SWAPSLOT(oldpte), page);
+    if (res) {
+        swap_release();
+        free_kpages(page);
+        return res;
+    }
+
+    /*
+     * Swapped pages were private, so writable if the region is.
+     * Only the paging lock holder changes a swapped-out PTE.
+     */
+    pte = (KVADDR_TO_PADDR(page) & PAGE_FRAME) | TLBLO_VALID;
+    if (reg->w) {
+        pte |= TLBLO_DIRTY;
+    }
+    if (!vm_pte_install(as, faultaddress, oldpte, pte, true)) {
+        panic("vm_swapin: PTE for 0x%x changed under the paging lock\n",
+              faultaddress);
+    }
+    swap_release();
+
+    VM_STAT(as, vs_framealloc);
+    vm_stat_rss(as, 1);
 
     return 0;
 }
 
+/*
+ * Look up the page at OFFSET in the page cache, taking a reference to
+ * it, or return 0. *GEN is set as by pagecache_lookup().
+ */
+static vaddr_t
+vm_pagecache_get(struct vnode *vn, off_t offset, unsigned *gen)
+{
+    vaddr_t kpage;
+
+    swap_acquire();
+    kpage = pagecache_lookup(vn, offset, gen);
+    swap_release();
+    return kpage;
+}
+
+/*
+ * Fault-around: having mapped the new page at FAULTADDRESS in REG, map
+ * the rest of its VM_FAULTAROUND window that is cheap to get, then
+ * load the window's resident pages into unused TLB slots. A scan
+ * through memory then takes one fault per window rather than one per
+ * page.
+ *
+ * Cheap means the zero page after a read and fresh anonymous pages
+ * after a write, while there is free memory (nothing is paged out for
+ * pages nobody has asked for yet), and text pages already in the page
+ * cache. Speculative pages that don't fit in the TLB are not marked
+ * referenced, so page replacement takes them first if they go unused;
+ * those loaded into the TLB are, as their use no longer faults to say
+ * so. (Making page table room for them may still page something out;
+ * that is not speculative memory but the cost of mapping anything at
+ * all.) Pages another thread maps meanwhile are left to it.
+ */
+static void
+vm_fault_around(struct addrspace *as, struct region *reg, int faulttype,
+                vaddr_t faultaddress)
+{
+    vaddr_t start, end, va, kpage;
+    paddr_t *pte, newpte;
+    uint32_t ehi, elo;
+    int slots[VM_FAULTAROUND];
+    int nslots, i;
+    unsigned gen;
+
+    start = faultaddress & ~(vaddr_t)(VM_FAULTAROUND * PAGE_SIZE - 1);
+    end = start + VM_FAULTAROUND * PAGE_SIZE;
+    if (start < reg->vbase) {
+        start = reg->vbase;
+    }
+    if (end > reg->vbase + reg->npages * PAGE_SIZE) {
+        end = reg->vbase + reg->npages * PAGE_SIZE;
+    }
+    faultaddress &= PAGE_FRAME;
+
+    for (va = start; va < end; va += PAGE_SIZE) {
+        pte = pt_lookup(as, va);
+        if (pte != NULL && *pte != 0) {
+            continue;
+        }
+        kpage = 0;
+        if (!vm_page_hasfile(reg, va) && faulttype == VM_FAULT_READ) {
+            newpte = vm_zero_pte();
+        } else if (!vm_page_hasfile(reg, va)) {
+            kpage = alloc_zeroed_kpage();
+            if (kpage == 0) {
+                break;
+            }
+            newpte = (KVADDR_TO_PADDR(kpage) & PAGE_FRAME) | TLBLO_VALID;
+            if (reg->w) {
+                newpte |= TLBLO_DIRTY;
+            }
+        } else if (!reg->w) {
+            kpage = vm_pagecache_get(reg->vn, reg->file_offset +
+                                     ((off_t) va - (off_t) reg->file_vaddr),
+                                     &gen);
+            if (kpage == 0) {
+                continue;
+            }
+            newpte = (KVADDR_TO_PADDR(kpage) & PAGE_FRAME) | TLBLO_VALID;
+        } else {
+            continue;
+        }
+
+        if (pt_reserve(as, va)) {
+            if (kpage != 0) {
+                free_kpages(kpage);
+            }
+            break;
+        }
+        if (!vm_pte_install(as, va, 0, newpte, false)) {
+            if (kpage != 0) {
+                free_kpages(kpage);
+            }
+            continue;
+        }
+        if (!vm_page_hasfile(reg, va)) {
+            VM_STAT(as, vs_zerofills);
+            if (kpage != 0) {
+                VM_STAT(as, vs_framealloc);
+            }
+        }
+        vm_stat_rss(as, 1);
+    }
+
+    /* The PTE lock keeps page-out away while we load the TLB */
+    spinlock_acquire(&as->as_ptlock);
+    nslots = 0;
+    for (i = 0; i < NUM_TLB && nslots < VM_FAULTAROUND; i++) {
+        tlb_read(&ehi, &elo, i);
+        if ((elo & TLBLO_VALID) == 0) {
+            slots[nslots++] = i;
+        }
+    }
+    for (va = start; va < end && nslots > 0; va += PAGE_SIZE) {
+        pte = pt_lookup(as, va);
+        elo = pte == NULL ? 0 : *pte;
+        if (va == faultaddress || (elo & TLBLO_VALID) == 0) {
+            continue;
+        }
+        ehi = as_tlbhi(as, va);
+        KASSERT(ehi != 0);
+        if (tlb_probe(ehi, 0) >= 0) {
+            continue;
+        }
+        /* Using it won't fault now, so mark it as vm_tlb_write() does */
+        *pte |= PTE_REFERENCED;
+        tlb_write(ehi, elo & ~PTE_REFERENCED, slots[--nslots]);
+        kpage_setowner(PADDR_TO_KVADDR(elo & PAGE_FRAME), as, va);
+    }
+    spinlock_release(&as->as_ptlock);
+}
+
 void vm_bootstrap(void)
 {
     /* Initialise any global components of your VM sub-system here.  
@@ -54,23 +682,169 @@ void vm_bootstrap(void)
      * You may or may not need to add anything here depending what's
      * provided or required by the assignment spec.
      */
+    pt_bootstrap();
+    swap_bootstrap();
+    as_bootstrap();
+
+    zero_page = alloc_kpages(1);
+    if (zero_page == 0) {
+        panic("vm_bootstrap: no memory for the zero page\n");
+    }
+    bzero((void *) zero_page, PAGE_SIZE);
+    share_kpage(zero_page);
+
+    zeropool_bootstrap();
+}
+
+/*
+ * Fault on a page that is not in memory, or not writable. Called with
+ * as_lock held for reading; see the top of this file for how faults
+ * on the same page in different threads sort themselves out.
+ */
+static int
+vm_fault_page(struct addrspace *as, int faulttype, vaddr_t faultaddress)
+{
+    uint32_t dirty = 0;
+    paddr_t *pte = pt_lookup(as, faultaddress);
+    paddr_t oldpte = pte == NULL ? 0 : *pte;
+
+    if (oldpte & PTE_SWAPPED) {
+        return vm_swapin(as, faultaddress, oldpte);
+    }
+    if (oldpte & TLBLO_VALID) {
+        /* Write to a read-only page: copy-on-write or a real fault */
+        if (faulttype != VM_FAULT_READ && (oldpte & TLBLO_DIRTY) == 0) {
+            return vm_break_cow(as, faultaddress, oldpte);
+        }
+        vm_tlb_load(as, faultaddress);
+        return 0;
+    }
+
+    if (faulttype == VM_FAULT_READONLY) {
+        return EFAULT;
+    }
+
+    /* Not a valid translation -> Look up region */
+    struct region *cur_reg = as_find_region(as, faultaddress);
+    
+    /* Invalid region */
+    if (cur_reg == NULL) {
+        return EFAULT;
+    }
+
+    /* Make room for the PTE */
+    int res = pt_reserve(as, faultaddress);
+    if (res) {
+        return res;
+    }
+
+    /*
+     * Set dirty bit if region is writable. Mapped file pages stay
+     * write-protected until they are actually written, so that
+     * vm_msync() knows which to write back.
+     */
+    bool hasfile = vm_page_hasfile(cur_reg, faultaddress & PAGE_FRAME);
+    if (cur_reg->w && (!(hasfile && cur_reg->mmapped) ||
+                       faulttype == VM_FAULT_WRITE)) {
+        dirty = TLBLO_DIRTY;
+    } else {
+        dirty = 0;
+    }
+
+    /* Reading untouched anonymous memory: zeroes until it is written */
+    if (!hasfile && faulttype == VM_FAULT_READ) {
+        if (vm_pte_install(as, faultaddress, 0, vm_zero_pte(), true)) {
+            VM_STAT(as, vs_zerofills);
+            vm_stat_rss(as, 1);
+            vm_fault_around(as, cur_reg, faulttype, faultaddress);
+        }
+        return 0;
+    }
+
+    /*
+     * Read-only file pages (program text) are shared by everyone
+     * running the same binary.
+     */
+    bool shareable = hasfile && !cur_reg->w && !cur_reg->mmapped;
+    off_t offset = cur_reg->file_offset +
+        ((off_t) (faultaddress & PAGE_FRAME) - (off_t) cur_reg->file_vaddr);
+    vaddr_t kpage;
+    unsigned gen = 0;
+
+    if (shareable) {
+        kpage = vm_pagecache_get(cur_reg->vn, offset, &gen);
+        if (kpage != 0) {
+            paddr_t newpte = (KVADDR_TO_PADDR(kpage) & PAGE_FRAME) | TLBLO_VALID;
+            if (!vm_pte_install(as, faultaddress, 0, newpte, true)) {
+                free_kpages(kpage);
+                return 0;
+            }
+            vm_stat_rss(as, 1);
+            vm_fault_around(as, cur_reg, faulttype, faultaddress);
+            return 0;
+        }
+    }
+
+    /* Allocate frame, zero-fill */
+    kpage = vm_alloc_page(true);
+    if (kpage == 0) {
+        return ENOMEM;
+    }
+
+    /* File backed: read the page in from the executable */
+    if (hasfile) {
+        res = vm_page_io(cur_reg, faultaddress & PAGE_FRAME, kpage, UIO_READ);
+        if (res) {
+            free_kpages(kpage);
+            return res;
+        }
+
+        if (shareable) {
+            /* Unless another thread has just read it in too */
+            vaddr_t cached;
+            unsigned nowgen;
+
+            swap_acquire();
+            cached = pagecache_lookup(cur_reg->vn, offset, &nowgen);
+            if (cached == 0) {
+                pagecache_insert(cur_reg->vn, offset, kpage, gen);
+            }
+            swap_release();
+            if (cached != 0) {
+                free_kpages(kpage);
+                kpage = cached;
+            }
+        }
+    }
+
+    /* Insert PTE */
+    if (!vm_pte_install(as, faultaddress, 0,
+                        (KVADDR_TO_PADDR(kpage) & PAGE_FRAME) | dirty | TLBLO_VALID,
+                        true)) {
+        free_kpages(kpage);
+        return 0;
+    }
+    if (!hasfile) {
+        VM_STAT(as, vs_zerofills);
+    }
+    VM_STAT(as, vs_framealloc);
+    vm_stat_rss(as, 1);
+
+    vm_fault_around(as, cur_reg, faulttype, faultaddress);
+
+    return 0;
 }
 
 /* TLB miss handler */
 int
 vm_fault(int faulttype, vaddr_t faultaddress)
 {
-    uint32_t ehi, elo;
-    uint32_t dirty = 0;
-    volatile paddr_t paddr;
-    bool alloc_pt1 = false;
+    int res;
 
 	// faultaddress &= PAGE_FRAME;
 
-    /* Check if VM_FAULT is Readonly */
     switch(faulttype) {
         case VM_FAULT_READONLY:
-            return EFAULT;
         case VM_FAULT_READ:
         case VM_FAULT_WRITE:
             break;
@@ -78,6 +852,11 @@ vm_fault(int faulttype, vaddr_t faultaddress)
             return EINVAL;
     }
 
+    /* Kernel memory from kvmalloc() */
+    if (faultaddress >= MIPS_KSEG2) {
+        return kvm_fault(faulttype, faultaddress);
+    }
+
     /* Check if curproc is kernel process */
     if (curproc == NULL) {
         return EFAULT;
@@ -89,77 +868,74 @@ vm_fault(int faulttype, vaddr_t faultaddress)
         return EFAULT;
     }
 
-    /* |PT1|PT2|Offset|
-     * |10 |10 | 12   | */
-    paddr = KVADDR_TO_PADDR(faultaddress);
-    uint32_t pt1 = paddr >> 22;
-    uint32_t pt2 = (paddr << 10) >> 22;
-
-    /* Ensure pt1 is not NULL */
-    if (as->page_table[pt1] == NULL) {
-        /* Allocate level 1 page table */
-        int res = vm_create_l1_pte(as->page_table, pt1);
-        if (res) {
-            return res;
-        }
-        alloc_pt1 = true;
-    }
-
-    /* Check if is a valid translation */
-    if (as->page_table[pt1][pt2] == 0) {
-        /* Not a valid translation -> Look up region */
-        struct region *cur_reg;
-        for (cur_reg = as->first_region; cur_reg != NULL; cur_reg = cur_reg->next) {
-            /* Check if is valid region */
-            if (faultaddress >= cur_reg->vbase &&
-                faultaddress < (cur_reg->vbase + (cur_reg->npages * PAGE_SIZE))) {
-                    /* Set dirty bit if region is writable */
-                    if (cur_reg->w) {
-                        dirty = TLBLO_DIRTY;
-                    } else {
-                        dirty = 0;
-                    }
-                    break;
-            }
-        }
-        
-        /* Invalid region */
-        if (cur_reg == NULL) {
-            if (alloc_pt1) {
-                kfree(as->page_table[pt1]);
-            }
-            return EFAULT;
-        }
+    switch (faulttype) {
+        case VM_FAULT_READ:
+            VM_STAT(as, vs_readfaults);
+            break;
+        case VM_FAULT_WRITE:
+            VM_STAT(as, vs_writefaults);
+            break;
+        default:
+            VM_STAT(as, vs_readonlyfaults);
+            break;
+    }
 
-        /* Allocate frame, zero-fill, Insert PTE */
-        int res = vm_create_l2_pte(as->page_table, pt1, pt2, dirty);
-        if (res) {
-            if (alloc_pt1) {
-                kfree(as->page_table[pt1]);
-            }
-            return res;
+    /*
+     * Plain TLB miss on a page that is in memory: just load it. The
+     * PTE lock keeps the page from being paged out between reading
+     * the PTE and loading it, without holding up faults elsewhere.
+     *
+     * The UTLB refill handler in exception-mips1.S does this before
+     * we ever get here for pages marked referenced; this catches the
+     * rest (the first use of a page since page replacement looked at
+     * it, and misses taken through the general exception vector).
+     */
+    if (faulttype != VM_FAULT_READONLY) {
+        spinlock_acquire(&as->as_ptlock);
+        paddr_t *pte = pt_lookup(as, faultaddress);
+        if (pte != NULL && (*pte & TLBLO_VALID) &&
+            (faulttype == VM_FAULT_READ || (*pte & TLBLO_DIRTY))) {
+            vm_tlb_write(as, faultaddress, pte);
+            VM_STAT(as, vs_tlbrefills);
+            spinlock_release(&as->as_ptlock);
+            return 0;
         }
+        spinlock_release(&as->as_ptlock);
     }
 
-    /* Load TLB */
-    ehi = faultaddress & PAGE_FRAME;
-    elo = as->page_table[pt1][pt2];
+    /* Everything else may change the page table */
+    rwlock_acquire_read(as->as_lock);
+    res = vm_fault_page(as, faulttype, faultaddress);
+    rwlock_release_read(as->as_lock);
 
-    int spl = splhigh();
-    tlb_random(ehi, elo);
-    splx(spl);
+    if (res) {
+        /*
+         * A failed fault may have left page table room behind. Other
+         * faults may be between pt_reserve() and pt_alloc() on the
+         * same table, so it can only go with the table to ourselves.
+         */
+        rwlock_acquire_write(as->as_lock);
+        swap_acquire();
+        pt_unreserve(as, faultaddress);
+        swap_release();
+        rwlock_release_write(as->as_lock);
+    }
 
-    return 0;
+    return res;
 }
 
 /*
- * SMP-specific functions.  Unused in our UNSW configuration.
+ * SMP-specific functions. Shootdowns are sent by as_tlb_shootdown().
  */
 
 void
 vm_tlbshootdown(const struct tlbshootdown *ts)
 {
-	(void)ts;
-	panic("vm tried to do tlb shootdown?!\n");
+	if (ts->ts_as == NULL) {
+		kvm_tlbshootdown(ts);
+	}
+	else {
+		as_tlbshootdown(ts);
+	}
 }
 
@@ -0,0 +1,113 @@
+/*
+ * Copyright (c) 2000, 2001, 2002, 2003, 2004, 2005, 2008, 2009
+ *	The President and Fellows of Harvard College.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE UNIVERSITY AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE UNIVERSITY OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#include <stdio.h>
+#include <unistd.h>
+#include <err.h>
+
+/*
+ * vmstat - print virtual memory statistics.
+ *
+ * Usage: vmstat
+ *        vmstat command [args...]
+ *
+ * With no arguments, prints the system-wide counters since boot.
+ * Given a command, runs it and prints how much each counter moved
+ * while it ran, for watching what a benchmark does to the VM system.
+ */
+
+static
+void
+show(const struct vmstat *vs)
+{
+	printf("faults:      %u read, %u write, %u read-only\n",
+	       vs->vs_readfaults, vs->vs_writefaults, vs->vs_readonlyfaults);
+	printf("zero-filled: %u pages\n", vs->vs_zerofills);
+	printf("tlb:         %u refills in vm_fault, %u flushes\n",
+	       vs->vs_tlbrefills, vs->vs_tlbflushes);
+	printf("shootdowns:  %u, %u us waiting\n",
+	       vs->vs_shootdowns, vs->vs_shootdownusec);
+	printf("frames:      %u allocated, %u freed\n",
+	       vs->vs_framealloc, vs->vs_framefree);
+	printf("mapped:      %u pages, %u peak\n",
+	       vs->vs_rss, vs->vs_peakrss);
+}
+
+static
+void
+getstats(struct vmstat *vs)
+{
+	if (vmstat(VMSTAT_GLOBAL, vs) < 0) {
+		err(1, "vmstat");
+	}
+}
+
+int
+main(int argc, char *argv[])
+{
+	struct vmstat before, after;
+	pid_t pid;
+	int status;
+
+	if (argc < 2) {
+		getstats(&after);
+		show(&after);
+		return 0;
+	}
+
+	getstats(&before);
+	pid = fork();
+	if (pid < 0) {
+		err(1, "fork");
+	}
+	if (pid == 0) {
+		execvp(argv[1], argv + 1);
+		err(1, "%s", argv[1]);
+	}
+	if (waitpid(pid, &status, 0) < 0) {
+		err(1, "waitpid");
+	}
+	getstats(&after);
+
+	/* Counters become deltas; the mapped page counts stay absolute */
+	after.vs_readfaults -= before.vs_readfaults;
+	after.vs_writefaults -= before.vs_writefaults;
+	after.vs_readonlyfaults -= before.vs_readonlyfaults;
+	after.vs_zerofills -= before.vs_zerofills;
+	after.vs_tlbrefills -= before.vs_tlbrefills;
+	after.vs_tlbflushes -= before.vs_tlbflushes;
+	after.vs_shootdowns -= before.vs_shootdowns;
+	after.vs_shootdownusec -= before.vs_shootdownusec;
+	after.vs_framealloc -= before.vs_framealloc;
+	after.vs_framefree -= before.vs_framefree;
+
+	printf("vmstat: %s (includes our own fork)\n", argv[1]);
+	show(&after);
+	return 0;
+}
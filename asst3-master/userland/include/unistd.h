@@ -40,10 +40,12 @@
  */
 #include <kern/fcntl.h>
 #include <kern/ioctl.h>
+#include <kern/mman.h>
 #include <kern/reboot.h>
 #include <kern/seek.h>
 #include <kern/time.h>
 #include <kern/unistd.h>
+#include <kern/vmstat.h>
 #include <kern/wait.h>
 
 
@@ -164,10 +166,12 @@ time_t time(time_t *seconds);			/* calls __time */
  * You should implement this version as this is what we expect to test.
  */
 
-#define PROT_READ 1
-#define PROT_WRITE 2
+/* PROT_READ and PROT_WRITE come from <kern/mman.h> */
 
 void *mmap(size_t length, int prot, int fd, off_t offset);
 int munmap(void *addr);
 
+/* VM statistics, for the whole system or ourselves (OS/161 specific) */
+int vmstat(int which, struct vmstat *vs);
+
 #endif /* _UNISTD_H_ */
@@ -0,0 +1,309 @@
+/*
+ * Copyright (c) 2000, 2001, 2002, 2003, 2004, 2005, 2008, 2009
+ *	The President and Fellows of Harvard College.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE UNIVERSITY AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE UNIVERSITY OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * mmaptest.c
+ *
+ *	Test mmap() and munmap() on a file: that a mapping shows the
+ *	file's contents (and zeroes past its end), and that changes
+ *	made through a writable mapping reach the file on munmap() and
+ *	on fsync(), including from pages that were paged out to swap.
+ *
+ *	Usage: mmaptest [filename]
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <err.h>
+
+#define PageSize	4096
+#define FilePages	6
+#define FileSize	(FilePages * PageSize + PageSize / 2)
+#define MapSize		((FilePages + 2) * PageSize)
+
+/* Larger than RAM, so most of the mapping ends up on swap */
+#define SwapPages	2048
+#define SwapSize	(SwapPages * PageSize)
+
+static char buf[FileSize];
+
+/* The byte the file holds at OFFSET, as written by makefile() */
+static
+char
+pattern(size_t offset)
+{
+	return 'a' + (offset / PageSize + offset) % 26;
+}
+
+static
+void
+makefile(const char *name)
+{
+	size_t i;
+	ssize_t r;
+	int fd;
+
+	for (i=0; i<FileSize; i++) {
+		buf[i] = pattern(i);
+	}
+
+	fd = open(name, O_WRONLY|O_CREAT|O_TRUNC, 0664);
+	if (fd < 0) {
+		err(1, "%s: open for write", name);
+	}
+	r = write(fd, buf, FileSize);
+	if (r < 0) {
+		err(1, "%s: write", name);
+	}
+	if (r != FileSize) {
+		errx(1, "%s: short write (%zd of %d)", name, r, FileSize);
+	}
+	close(fd);
+}
+
+/* Read the whole file back into buf with read() */
+static
+void
+readfile(int fd, const char *name)
+{
+	ssize_t r;
+
+	if (lseek(fd, 0, SEEK_SET) < 0) {
+		err(1, "%s: lseek", name);
+	}
+	r = read(fd, buf, FileSize);
+	if (r < 0) {
+		err(1, "%s: read", name);
+	}
+	if (r != FileSize) {
+		errx(1, "%s: short read (%zd of %d)", name, r, FileSize);
+	}
+}
+
+/*
+ * Map the file read-only and check every byte, including the zeroes
+ * past the end of the file.
+ */
+static
+void
+test_read(const char *name)
+{
+	char *map;
+	size_t i;
+	int fd;
+
+	printf("Reading through a mapping...\n");
+
+	fd = open(name, O_RDONLY);
+	if (fd < 0) {
+		err(1, "%s: open", name);
+	}
+	map = mmap(MapSize, PROT_READ, fd, 0);
+	if (map == (void *)-1) {
+		err(1, "mmap");
+	}
+	close(fd);
+
+	for (i=0; i<FileSize; i++) {
+		if (map[i] != pattern(i)) {
+			errx(1, "offset %zu: found %d, expected %d",
+			     i, map[i], pattern(i));
+		}
+	}
+	for (; i<MapSize; i++) {
+		if (map[i] != 0) {
+			errx(1, "offset %zu past end of file: found %d",
+			     i, map[i]);
+		}
+	}
+
+	if (munmap(map)) {
+		err(1, "munmap");
+	}
+	printf("Passed.\n");
+}
+
+/*
+ * Change one byte in every page through a writable mapping, and check
+ * with read() that the changes got to the file after fsync() and
+ * after munmap().
+ */
+static
+void
+test_write(const char *name)
+{
+	char *map;
+	size_t i;
+	int fd;
+
+	printf("Writing through a mapping...\n");
+
+	fd = open(name, O_RDWR);
+	if (fd < 0) {
+		err(1, "%s: open", name);
+	}
+	map = mmap(FileSize, PROT_READ|PROT_WRITE, fd, 0);
+	if (map == (void *)-1) {
+		err(1, "mmap");
+	}
+
+	for (i=0; i<FileSize; i+=PageSize) {
+		map[i] = 'X';
+	}
+	if (fsync(fd)) {
+		err(1, "fsync");
+	}
+	readfile(fd, name);
+	for (i=0; i<FileSize; i+=PageSize) {
+		if (buf[i] != 'X') {
+			errx(1, "offset %zu: change not written by fsync", i);
+		}
+	}
+
+	for (i=1; i<FileSize; i+=PageSize) {
+		map[i] = 'Y';
+	}
+	if (munmap(map)) {
+		err(1, "munmap");
+	}
+	readfile(fd, name);
+	for (i=0; i<FileSize; i++) {
+		char expected = pattern(i);
+
+		if (i % PageSize == 0) {
+			expected = 'X';
+		}
+		else if (i % PageSize == 1) {
+			expected = 'Y';
+		}
+		if (buf[i] != expected) {
+			errx(1, "offset %zu: found %d, expected %d",
+			     i, buf[i], expected);
+		}
+	}
+	close(fd);
+	printf("Passed.\n");
+}
+
+/* The byte test_swap() stores at offset 0 of page PAGE on pass PASS */
+static
+char
+swappattern(size_t page, int pass)
+{
+	return 'A' + (page + pass) % 26;
+}
+
+/*
+ * Dirty a mapping bigger than RAM so that most of it gets paged out,
+ * then fsync() twice, changing it in between; each fsync() has to
+ * write back the swapped pages and leave them on swap. munmap() and
+ * exit then release the swap.
+ */
+static
+void
+test_swap(const char *name)
+{
+	char *map;
+	size_t i;
+	ssize_t r;
+	int fd, pass;
+
+	printf("Writing back swapped pages of a mapping...\n");
+
+	fd = open(name, O_RDWR|O_CREAT|O_TRUNC, 0664);
+	if (fd < 0) {
+		err(1, "%s: open", name);
+	}
+	memset(buf, 0, PageSize);
+	for (i=0; i<SwapPages; i++) {
+		r = write(fd, buf, PageSize);
+		if (r != PageSize) {
+			err(1, "%s: write", name);
+		}
+	}
+	map = mmap(SwapSize, PROT_READ|PROT_WRITE, fd, 0);
+	if (map == (void *)-1) {
+		err(1, "mmap");
+	}
+
+	for (pass=0; pass<2; pass++) {
+		for (i=0; i<SwapPages; i++) {
+			map[i * PageSize] = swappattern(i, pass);
+		}
+		if (fsync(fd)) {
+			err(1, "fsync");
+		}
+		for (i=0; i<SwapPages; i++) {
+			if (lseek(fd, i * PageSize, SEEK_SET) < 0) {
+				err(1, "%s: lseek", name);
+			}
+			r = read(fd, buf, 1);
+			if (r != 1) {
+				err(1, "%s: read", name);
+			}
+			if (buf[0] != swappattern(i, pass)) {
+				errx(1, "page %zu, pass %d: found %d, "
+				     "expected %d", i, pass, buf[0],
+				     swappattern(i, pass));
+			}
+			if (map[i * PageSize] != swappattern(i, pass)) {
+				errx(1, "page %zu, pass %d: mapping lost "
+				     "its contents", i, pass);
+			}
+		}
+	}
+
+	if (munmap(map)) {
+		err(1, "munmap");
+	}
+	close(fd);
+	printf("Passed.\n");
+}
+
+int
+main(int argc, char *argv[])
+{
+	const char *name = "mmaptest.dat";
+
+	if (argc > 1) {
+		name = argv[1];
+	}
+
+	makefile(name);
+	test_read(name);
+	test_write(name);
+	test_swap(name);
+	remove(name);
+
+	printf("mmaptest done.\n");
+	return 0;
+}
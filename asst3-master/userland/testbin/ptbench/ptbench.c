@@ -0,0 +1,177 @@
+/*
+ * Copyright (c) 2000, 2001, 2002, 2003, 2004, 2005, 2008, 2009
+ *	The President and Fellows of Harvard College.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE UNIVERSITY AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE UNIVERSITY OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * ptbench.c
+ *
+ *	Page table benchmark: starts NumProcs small processes at once.
+ *	Each touches a few pages of fresh memory, timing how long the
+ *	faults take, and then stays alive until all of them have run, so
+ *	that their page tables all exist at the same time.
+ *
+ *	Run it against kernels with and without "options hashpt" to
+ *	compare the two page table implementations. Fault latency is
+ *	printed here; for the memory used by page tables, use the kernel
+ *	menu's "kp" command afterwards, which reports the peak.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <err.h>
+
+#define PageSize	4096
+#define NumProcs	64
+#define NumPages	16
+#define Settle		5	/* seconds for everyone to have started */
+
+#define ResultFile	"ptbench.out"
+
+static char pages[NumPages][PageSize];
+
+/*
+ * Return the current time in nanoseconds.
+ */
+static
+unsigned long long
+now(void)
+{
+	time_t secs;
+	unsigned long nsecs;
+
+	if (__time(&secs, &nsecs) < 0) {
+		err(1, "__time");
+	}
+	return (unsigned long long)secs * 1000000000ULL + nsecs;
+}
+
+/*
+ * Child NUM: touch our pages, record the nanoseconds per page in slot
+ * NUM of the result file, and wait for DEADLINE.
+ */
+static
+void
+child(int fd, unsigned num, unsigned long long deadline)
+{
+	unsigned long long start, end;
+	unsigned long result;
+	unsigned i;
+
+	start = now();
+	for (i = 0; i < NumPages; i++) {
+		pages[i][0] = (char)num;
+	}
+	end = now();
+	result = (unsigned long)((end - start) / NumPages);
+
+	if (lseek(fd, num * sizeof(result), SEEK_SET) < 0) {
+		err(1, "lseek");
+	}
+	if (write(fd, &result, sizeof(result)) != sizeof(result)) {
+		err(1, "write");
+	}
+
+	while (now() < deadline) {
+		/* spin */
+	}
+
+	for (i = 0; i < NumPages; i++) {
+		if (pages[i][0] != (char)num) {
+			errx(1, "page %u has the wrong contents", i);
+		}
+	}
+	_exit(0);
+}
+
+int
+main(void)
+{
+	unsigned long result, total, worst;
+	unsigned long long deadline;
+	pid_t pids[NumProcs];
+	unsigned i;
+	int fd, status, failed;
+
+	fd = open(ResultFile, O_RDWR|O_CREAT|O_TRUNC, 0664);
+	if (fd < 0) {
+		err(1, "%s", ResultFile);
+	}
+
+	deadline = now() + Settle * 1000000000ULL;
+	for (i = 0; i < NumProcs; i++) {
+		pids[i] = fork();
+		if (pids[i] < 0) {
+			err(1, "fork");
+		}
+		if (pids[i] == 0) {
+			child(fd, i, deadline);
+		}
+	}
+	if (now() > deadline) {
+		warnx("forking took longer than %u seconds; "
+		      "not all processes ran at once", Settle);
+	}
+
+	failed = 0;
+	for (i = 0; i < NumProcs; i++) {
+		if (waitpid(pids[i], &status, 0) < 0) {
+			err(1, "waitpid");
+		}
+		if (status != 0) {
+			failed++;
+		}
+	}
+
+	total = worst = 0;
+	for (i = 0; i < NumProcs; i++) {
+		if (lseek(fd, i * sizeof(result), SEEK_SET) < 0) {
+			err(1, "lseek");
+		}
+		if (read(fd, &result, sizeof(result)) != sizeof(result)) {
+			errx(1, "%s: short read", ResultFile);
+		}
+		total += result;
+		if (result > worst) {
+			worst = result;
+		}
+	}
+	close(fd);
+	remove(ResultFile);
+
+	printf("ptbench: %u processes, %u pages each\n", NumProcs, NumPages);
+	printf("  first touch: %lu ns per page on average, %lu worst\n",
+	       total / NumProcs, worst);
+	printf("  use the kernel's \"kp\" command for page table memory\n");
+
+	if (failed) {
+		errx(1, "%d processes failed", failed);
+	}
+	return 0;
+}
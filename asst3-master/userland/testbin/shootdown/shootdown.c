@@ -0,0 +1,178 @@
+/*
+ * Copyright (c) 2000, 2001, 2002, 2003, 2004, 2005, 2008, 2009
+ *	The President and Fellows of Harvard College.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE UNIVERSITY AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE UNIVERSITY OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * shootdown.c
+ *
+ *	Multi-cpu TLB shootdown stress test. Run it on a sys161 with
+ *	several cpus ("cpus=4" on the mainboard line of sys161.conf)
+ *	and less memory than the processes want, so that pages are
+ *	paged out from under processes running on other cpus.
+ *
+ *	NumProcs processes each repeatedly grow their heap, write a
+ *	pattern unique to them and the round into every page, check it,
+ *	and shrink the heap again, which unmaps everything they wrote.
+ *	They also write over a fixed array each round, which keeps it
+ *	going out to swap and back. A translation left behind in some
+ *	cpu's TLB after a page was unmapped or paged out would let a
+ *	process see another's data, or lose its own, and a check fails.
+ *
+ *	At the end it prints how many shootdowns were sent and how long
+ *	each took on average, from the kernel's VM statistics.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <err.h>
+
+#define PageSize	4096
+#define NumProcs	8
+#define Rounds		20
+#define HeapPages	64
+#define FixedPages	128
+
+static unsigned fixed[FixedPages][PageSize / sizeof(unsigned)];
+
+static
+unsigned
+pattern(unsigned proc, unsigned round, unsigned page)
+{
+	return (proc << 24) ^ (round << 16) ^ page ^ 0x5a5a0000;
+}
+
+/*
+ * Fill NPAGES pages at P with the pattern for (PROC, ROUND), check
+ * them, and return the number of words that were wrong.
+ */
+static
+unsigned
+fillcheck(unsigned (*p)[PageSize / sizeof(unsigned)], unsigned npages,
+	  unsigned proc, unsigned round)
+{
+	unsigned page, i, bad;
+
+	for (page = 0; page < npages; page++) {
+		for (i = 0; i < PageSize / sizeof(unsigned); i += 64) {
+			p[page][i] = pattern(proc, round, page) + i;
+		}
+	}
+
+	bad = 0;
+	for (page = 0; page < npages; page++) {
+		for (i = 0; i < PageSize / sizeof(unsigned); i += 64) {
+			if (p[page][i] != pattern(proc, round, page) + i) {
+				bad++;
+			}
+		}
+	}
+	return bad;
+}
+
+static
+void
+child(unsigned proc)
+{
+	unsigned (*heap)[PageSize / sizeof(unsigned)];
+	unsigned round, bad;
+
+	for (round = 0; round < Rounds; round++) {
+		heap = sbrk(HeapPages * PageSize);
+		if (heap == (void *)-1) {
+			err(1, "proc %u: sbrk", proc);
+		}
+
+		bad = fillcheck(heap, HeapPages, proc, round);
+		bad += fillcheck(fixed, FixedPages, proc, round);
+		if (bad > 0) {
+			errx(1, "proc %u round %u: %u bad words",
+			     proc, round, bad);
+		}
+
+		if (sbrk(-HeapPages * PageSize) == (void *)-1) {
+			err(1, "proc %u: sbrk shrink", proc);
+		}
+	}
+	_exit(0);
+}
+
+int
+main(void)
+{
+	struct vmstat before, after;
+	pid_t pids[NumProcs];
+	unsigned i, shootdowns, usec;
+	int status, failed;
+
+	if (vmstat(VMSTAT_GLOBAL, &before) < 0) {
+		err(1, "vmstat");
+	}
+
+	for (i = 0; i < NumProcs; i++) {
+		pids[i] = fork();
+		if (pids[i] < 0) {
+			err(1, "fork");
+		}
+		if (pids[i] == 0) {
+			child(i);
+		}
+	}
+
+	failed = 0;
+	for (i = 0; i < NumProcs; i++) {
+		if (waitpid(pids[i], &status, 0) < 0) {
+			err(1, "waitpid");
+		}
+		if (status != 0) {
+			failed++;
+		}
+	}
+
+	if (vmstat(VMSTAT_GLOBAL, &after) < 0) {
+		err(1, "vmstat");
+	}
+	shootdowns = after.vs_shootdowns - before.vs_shootdowns;
+	usec = after.vs_shootdownusec - before.vs_shootdownusec;
+
+	printf("shootdown: %u processes, %u rounds\n", NumProcs, Rounds);
+	printf("  %u shootdowns sent", shootdowns);
+	if (shootdowns > 0) {
+		printf(", %u us each on average", usec / shootdowns);
+	}
+	printf("\n");
+	if (shootdowns == 0) {
+		printf("  (none needed: only one cpu, or enough memory)\n");
+	}
+
+	if (failed) {
+		errx(1, "%d processes failed", failed);
+	}
+	printf("shootdown: passed\n");
+	return 0;
+}
@@ -0,0 +1,126 @@
+/*
+ * Copyright (c) 2000, 2001, 2002, 2003, 2004, 2005, 2008, 2009
+ *	The President and Fellows of Harvard College.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE UNIVERSITY AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE UNIVERSITY OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * tlbbench.c
+ *
+ *	Microbenchmark for TLB refill cost. Touches one word per page,
+ *	first over a few pages that stay in the TLB and then over many
+ *	more pages than the TLB holds, so that (nearly) every access in
+ *	the second loop is a TLB miss. The difference in time per
+ *	access is the cost of a refill.
+ *
+ *	Run it against kernels with and without the fast path refill
+ *	handler to compare them.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <err.h>
+
+#define PageSize	4096
+#define NumPages	256	/* four times the 64 entry TLB */
+#define HotPages	16	/* comfortably fits in the TLB */
+#define Accesses	(1024*1024)
+
+static char pages[NumPages][PageSize];
+
+/*
+ * Return the current time in nanoseconds.
+ */
+static
+unsigned long long
+now(void)
+{
+	time_t secs;
+	unsigned long nsecs;
+
+	if (__time(&secs, &nsecs) < 0) {
+		err(1, "__time");
+	}
+	return (unsigned long long)secs * 1000000000ULL + nsecs;
+}
+
+/*
+ * Touch Accesses pages, cycling over the first NPAGES of pages[].
+ * Return nanoseconds per access.
+ */
+static
+unsigned long
+run(unsigned npages)
+{
+	volatile char *p;
+	unsigned long long start, end;
+	unsigned i, j;
+
+	start = now();
+	for (i = j = 0; i < Accesses; i++) {
+		p = pages[j];
+		(*p)++;
+		if (++j == npages) {
+			j = 0;
+		}
+	}
+	end = now();
+
+	return (unsigned long)((end - start) / Accesses);
+}
+
+int
+main(void)
+{
+	unsigned long hot, cold;
+	unsigned i;
+
+	/* Fault everything in first so we only measure refills */
+	for (i = 0; i < NumPages; i++) {
+		pages[i][0] = 0;
+	}
+
+	hot = run(HotPages);
+	cold = run(NumPages);
+
+	printf("tlbbench: %u accesses\n", Accesses);
+	printf("  %3u pages (TLB hits):   %lu ns per access\n",
+	       HotPages, hot);
+	printf("  %3u pages (TLB misses): %lu ns per access\n",
+	       NumPages, cold);
+	printf("  TLB refill: about %lu ns\n", cold > hot ? cold - hot : 0);
+
+	/* Every page was bumped the same number of times by each run */
+	for (i = 0; i < NumPages; i++) {
+		if (pages[i][0] != (char)(Accesses / NumPages +
+		    (i < HotPages ? Accesses / HotPages : 0))) {
+			errx(1, "page %u has the wrong contents", i);
+		}
+	}
+
+	return 0;
+}